@@ -71,7 +71,9 @@ DoorStrike strikes[] = {
 const size_t NUM_READERS = sizeof(readers)/sizeof(readers[0]);
 const size_t NUM_STRIKES = sizeof(strikes)/sizeof(strikes[0]);
 
-CardDatabase cardDb;
+// CardIndex::HASH trades memory for constant-time lookups on very large card
+// sets; CardIndex::BLOCK compresses dense card runs to a byte or two per card
+CardDatabase cardDb(CardIndex::SORTED);
 AccessLog accessLog;
 CardReaderWebServer webServer(readers, NUM_READERS, strikes, NUM_STRIKES, cardDb, accessLog);
 
@@ -151,7 +153,13 @@ void setup() {
     Serial.println("LittleFS Mounted!");
   }
   
-  // Initialize card database and access log
+  // Initialize card database and access log. Guest cards removed at
+  // their expiry are logged from the database's writer task.
+  cardDb.setRevokeHandler([](CardDatabase::CardKey card) {
+    char key[CardDatabase::KEY_TEXT_SIZE];
+    CardDatabase::formatKey(card, key);
+    accessLog.addMessage("Card " + String(key) + " - Expired and revoked");
+  });
   if (!cardDb.begin()) {
     Serial.println("Failed to initialize card database");
     return;
@@ -202,6 +210,7 @@ void loop() {
             // Get the decoded card information
             long card = readers[i].getCardId();
             unsigned int siteCode = readers[i].getSiteCode();
+            unsigned int format = readers[i].getCardFormat();
             Serial.println("Card ID: ");
             Serial.println(card);
             Serial.println("Site Code: ");
@@ -211,16 +220,24 @@ void loop() {
             
             // Grant access if card is in database OR site code is 0x10
             //if (cardDb.hasCard(card) || siteCode == 0x10) {
-            if (siteCode == 198){
-              if (cardDb.hasCard(card) ){
+            AccessDecision decision = cardDb.checkAccess(readers[i].getRawData(), format, siteCode, card, i);
+            if (decision != AccessDecision::FACILITY_REFUSED){
+              if (decision == AccessDecision::GRANTED){
                 accessLog.addCardAccess(card, true);
                 Serial.println("Entry Granted!");
                 // Engage all strikes with automatic timeout
                 for (size_t j = 0; j < NUM_STRIKES; j++) {
                   strikes[j].engageWithTimeout(5000); // 5 second timeout
               }
-              } else {
+              } else if (decision == AccessDecision::NOT_ENROLLED) {
                 Serial.println("Card not in database!");
+              } else {
+                // Enrolled, but its metadata refuses this reader, date or time
+                accessLog.addCardAccess(card, false);
+                Serial.println(decision == AccessDecision::DOOR_REFUSED ? "Card not allowed at this door!" :
+                               decision == AccessDecision::EXPIRED ? "Card expired!" :
+                               decision == AccessDecision::OUTSIDE_SCHEDULE ? "Card outside its schedule!" :
+                               "Card not valid yet!");
               }
 
 
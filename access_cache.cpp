@@ -0,0 +1,82 @@
+#include "access_cache.h"
+
+AccessCache::AccessCache()
+    : stamp(0), hits(0), misses(0), evictions(0), invalidations(0), used(0) {
+    clear();
+}
+
+void AccessCache::clear() {
+    for (size_t i = 0; i < CAPACITY; i++) {
+        entries[i].bits = 0;
+        entries[i].referenced = false;
+    }
+    for (size_t i = 0; i < SETS; i++) {
+        hands[i] = 0;
+    }
+    used = 0;
+}
+
+bool AccessCache::checkStamp(uint32_t current) {
+    if (current == stamp) {
+        return true;
+    }
+    if (used > 0) {
+        clear();
+        invalidations++;
+    }
+    stamp = current;
+    return false;
+}
+
+size_t AccessCache::setOf(uint64_t raw, uint8_t bits) {
+    // Card numbers are the low bits and close together, so mix before
+    // taking the top bits
+    uint64_t hash = (raw ^ ((uint64_t)bits << 56)) * 0x9e3779b97f4a7c15ULL;
+    return hash >> 58 & (SETS - 1);
+}
+
+bool AccessCache::lookup(uint64_t raw, uint8_t bits, uint32_t current, AccessDecision& decision) {
+    if (checkStamp(current)) {
+        Entry* set = &entries[setOf(raw, bits) * WAYS];
+        for (size_t i = 0; i < WAYS; i++) {
+            if (set[i].bits == bits && set[i].raw == raw) {
+                set[i].referenced = true;
+                decision = set[i].decision;
+                hits++;
+                return true;
+            }
+        }
+    }
+    misses++;
+    return false;
+}
+
+void AccessCache::insert(uint64_t raw, uint8_t bits, uint32_t current, AccessDecision decision) {
+    // A decision made under an older stamp is already stale
+    if (bits == 0 || current != stamp) {
+        return;
+    }
+
+    size_t index = setOf(raw, bits);
+    Entry* set = &entries[index * WAYS];
+    size_t way = WAYS;
+    for (size_t i = 0; i < WAYS; i++) {
+        if (set[i].bits == 0) {
+            way = i;
+            used++;
+            break;
+        }
+    }
+    if (way == WAYS) {
+        // At most one lap clears every mark, so this ends within two
+        uint8_t& hand = hands[index];
+        while (set[hand].referenced) {
+            set[hand].referenced = false;
+            hand = (hand + 1) % WAYS;
+        }
+        way = hand;
+        hand = (hand + 1) % WAYS;
+        evictions++;
+    }
+    set[way] = {raw, bits, decision, false};
+}
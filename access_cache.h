@@ -0,0 +1,65 @@
+#pragma once
+
+#include <Arduino.h>
+#include <atomic>
+
+// What the door does with a swipe
+enum class AccessDecision : uint8_t {
+    GRANTED,
+    NOT_ENROLLED,      // Facility allowed, card not in the database
+    FACILITY_REFUSED,
+    DOOR_REFUSED,      // Enrolled, but not for this reader
+    NOT_YET_VALID,     // Enrolled, but before its start date
+    EXPIRED,           // Enrolled, but past its expiry
+    OUTSIDE_SCHEDULE   // Enrolled, but outside its schedule's hours
+};
+
+// Recent access decisions keyed by the raw Wiegand value and bit count, so
+// a regular's repeat swipes skip the facility check and the card lookup.
+// 4-way set associative with CLOCK replacement in each set: a hit marks
+// its entry, and an insert into a full set takes the first unmarked entry
+// after the set's hand, clearing marks as it passes them.
+//
+// Entries are only valid for the stamp they were made under; the caller
+// passes its current policy stamp on every call, and a new one empties the
+// cache. Lookups and inserts are for one task (the reader loop); the
+// counters can be read from anywhere.
+class AccessCache {
+public:
+    static constexpr size_t WAYS = 4;
+    static constexpr size_t SETS = 64;  // Power of two
+    static constexpr size_t CAPACITY = WAYS * SETS;
+
+    AccessCache();
+
+    bool lookup(uint64_t raw, uint8_t bits, uint32_t stamp, AccessDecision& decision);
+    void insert(uint64_t raw, uint8_t bits, uint32_t stamp, AccessDecision decision);
+
+    uint32_t getHits() const { return hits; }
+    uint32_t getMisses() const { return misses; }
+    uint32_t getEvictions() const { return evictions; }
+    uint32_t getInvalidations() const { return invalidations; }
+    size_t size() const { return used; }
+
+private:
+    struct Entry {
+        uint64_t raw;
+        uint8_t bits;  // 0 marks an empty entry; a burst has at least one bit
+        AccessDecision decision;
+        bool referenced;
+    };
+
+    Entry entries[CAPACITY];
+    uint8_t hands[SETS];
+    uint32_t stamp;
+
+    std::atomic<uint32_t> hits;
+    std::atomic<uint32_t> misses;
+    std::atomic<uint32_t> evictions;
+    std::atomic<uint32_t> invalidations;
+    std::atomic<size_t> used;
+
+    void clear();
+    bool checkStamp(uint32_t current);
+    static size_t setOf(uint64_t raw, uint8_t bits);
+};
@@ -0,0 +1,264 @@
+#include "access_schedule.h"
+#include <algorithm>
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+
+// Bound to references, as in vector::resize(), so C++11 needs it defined
+constexpr uint8_t AccessSchedules::NONE;
+
+namespace {
+
+// Indexed by row: tm_wday order, then the holiday row
+const char* const DAY_NAMES[] = {"sun", "mon", "tue", "wed", "thu", "fri", "sat", "holiday"};
+
+// Day ranges run Monday to Sunday, so "sat-sun" is the weekend
+int weekPosition(int row) {
+    return (row + 6) % 7;
+}
+
+std::string trim(const std::string& text) {
+    size_t start = text.find_first_not_of(" \t");
+    if (start == std::string::npos) {
+        return "";
+    }
+    return text.substr(start, text.find_last_not_of(" \t") - start + 1);
+}
+
+std::vector<std::string> split(const std::string& text, char separator) {
+    std::vector<std::string> parts;
+    size_t start = 0;
+    while (true) {
+        size_t end = text.find(separator, start);
+        parts.push_back(trim(text.substr(start, end == std::string::npos ? std::string::npos : end - start)));
+        if (end == std::string::npos) {
+            return parts;
+        }
+        start = end + 1;
+    }
+}
+
+int dayRow(const std::string& name) {
+    for (int row = 0; row <= AccessSchedules::HOLIDAY_ROW; row++) {
+        if (name == DAY_NAMES[row]) {
+            return row;
+        }
+    }
+    return -1;
+}
+
+// "HH:MM" on a 15 minute boundary, as a slot of the day; 24:00 is the
+// end of the last slot
+bool parseTime(const std::string& text, uint16_t& slot) {
+    if (text.size() != 5 || text[2] != ':' || !isdigit((uint8_t)text[0]) || !isdigit((uint8_t)text[1]) ||
+        !isdigit((uint8_t)text[3]) || !isdigit((uint8_t)text[4])) {
+        return false;
+    }
+    int hour = (text[0] - '0') * 10 + (text[1] - '0');
+    int minute = (text[3] - '0') * 10 + (text[4] - '0');
+    if (minute % 15 != 0 || minute >= 60 || hour > 24 || (hour == 24 && minute != 0)) {
+        return false;
+    }
+    slot = (hour * 60 + minute) / 15;
+    return true;
+}
+
+std::string formatTime(uint16_t slot) {
+    char text[12];
+    snprintf(text, sizeof(text), "%02u:%02u", slot / 4, slot % 4 * 15);
+    return text;
+}
+
+bool testSlot(const AccessSchedules::Week& week, uint16_t slot) {
+    return week.bits[slot / 32] >> (slot % 32) & 1;
+}
+
+// One rule: days, a space, then times
+bool compileRule(const std::string& rule, AccessSchedules::Week& week) {
+    size_t space = rule.find_first_of(" \t");
+    if (space == std::string::npos) {
+        return false;
+    }
+
+    uint8_t rows = 0;
+    for (const std::string& days : split(rule.substr(0, space), ',')) {
+        size_t dash = days.find('-');
+        int first = dayRow(days.substr(0, dash));
+        int last = dash == std::string::npos ? first : dayRow(days.substr(dash + 1));
+        if (first < 0 || last < 0) {
+            return false;
+        }
+        if (first != last) {
+            if (first == AccessSchedules::HOLIDAY_ROW || last == AccessSchedules::HOLIDAY_ROW ||
+                weekPosition(first) > weekPosition(last)) {
+                return false;
+            }
+            for (int position = weekPosition(first); position <= weekPosition(last); position++) {
+                rows |= 1 << (position + 1) % 7;
+            }
+        }
+        rows |= 1 << first;
+    }
+
+    for (const std::string& span : split(trim(rule.substr(space)), ',')) {
+        size_t dash = span.find('-');
+        uint16_t start, end;
+        if (dash == std::string::npos || !parseTime(span.substr(0, dash), start) ||
+            !parseTime(span.substr(dash + 1), end) || start >= end) {
+            return false;
+        }
+        for (int row = 0; row <= AccessSchedules::HOLIDAY_ROW; row++) {
+            if (rows & 1 << row) {
+                for (uint16_t slot = row * AccessSchedules::SLOTS_PER_DAY + start;
+                     slot < row * AccessSchedules::SLOTS_PER_DAY + end; slot++) {
+                    week.bits[slot / 32] |= 1UL << (slot % 32);
+                }
+            }
+        }
+    }
+    return true;
+}
+
+// The open times of one row, like "09:00-12:00,13:00-17:00"
+std::string describeRow(const AccessSchedules::Week& week, int row) {
+    std::string times;
+    uint16_t base = row * AccessSchedules::SLOTS_PER_DAY;
+    for (uint16_t slot = 0; slot < AccessSchedules::SLOTS_PER_DAY; slot++) {
+        if (!testSlot(week, base + slot)) {
+            continue;
+        }
+        uint16_t end = slot;
+        while (end < AccessSchedules::SLOTS_PER_DAY && testSlot(week, base + end)) {
+            end++;
+        }
+        times += (times.empty() ? "" : ",") + formatTime(slot) + "-" + formatTime(end);
+        slot = end;
+    }
+    return times;
+}
+
+}  // namespace
+
+AccessSchedules::AccessSchedules() {
+    memset(weeks, 0, sizeof(weeks));
+}
+
+bool AccessSchedules::compile(const char* hours, Week& week) {
+    memset(&week, 0, sizeof(week));
+    std::string text = trim(hours);
+    if (text.empty() || text == "none") {
+        return true;
+    }
+    for (const std::string& rule : split(text, ';')) {
+        if (!compileRule(rule, week)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+std::string AccessSchedules::describe(const Week& week) {
+    // Runs of neighbouring days with the same times share a rule
+    std::string hours;
+    int position = 0;
+    while (position <= 7) {
+        int row = position == 7 ? HOLIDAY_ROW : (position + 1) % 7;
+        std::string times = describeRow(week, row);
+        int last = position;
+        while (row != HOLIDAY_ROW && last + 1 < 7 && describeRow(week, (last + 2) % 7) == times) {
+            last++;
+        }
+        if (!times.empty()) {
+            std::string days = DAY_NAMES[row];
+            if (last != position) {
+                days += std::string("-") + DAY_NAMES[(last + 1) % 7];
+            }
+            hours += (hours.empty() ? "" : ";") + days + " " + times;
+        }
+        position = last + 1;
+    }
+    return hours.empty() ? "none" : hours;
+}
+
+bool AccessSchedules::isValidName(const char* name) {
+    size_t length = strlen(name);
+    if (length == 0 || length > MAX_NAME) {
+        return false;
+    }
+    for (size_t i = 0; i < length; i++) {
+        if (!isalnum((uint8_t)name[i]) && name[i] != '-' && name[i] != '_' && name[i] != '.') {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool AccessSchedules::parseDate(const char* text, uint32_t& date) {
+    // YYYY-MM-DD
+    if (strlen(text) != 10 || text[4] != '-' || text[7] != '-') {
+        return false;
+    }
+    uint32_t digits = 0;
+    for (size_t i = 0; i < 10; i++) {
+        if (i != 4 && i != 7) {
+            if (!isdigit((uint8_t)text[i])) {
+                return false;
+            }
+            digits = digits * 10 + (text[i] - '0');
+        }
+    }
+    unsigned year = digits / 10000, month = digits / 100 % 100, day = digits % 100;
+    static const uint8_t DAYS_IN_MONTH[] = {31, 29, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+    bool leap = (year % 4 == 0 && year % 100 != 0) || year % 400 == 0;
+    if (year < 1970 || month < 1 || month > 12 || day < 1 || day > DAYS_IN_MONTH[month - 1] ||
+        (month == 2 && day == 29 && !leap)) {
+        return false;
+    }
+    date = digits;
+    return true;
+}
+
+std::string AccessSchedules::formatDate(uint32_t date) {
+    char text[16];
+    snprintf(text, sizeof(text), "%04u-%02u-%02u", (unsigned)(date / 10000), (unsigned)(date / 100 % 100),
+             (unsigned)(date % 100));
+    return text;
+}
+
+uint16_t AccessSchedules::slotAt(time_t now, time_t& slotStart, time_t& slotEnd) const {
+    struct tm local;
+    localtime_r(&now, &local);
+    uint32_t date = (local.tm_year + 1900) * 10000 + (local.tm_mon + 1) * 100 + local.tm_mday;
+    uint16_t row = isHoliday(date) ? HOLIDAY_ROW : local.tm_wday;
+    slotStart = now - (local.tm_min % 15) * 60 - local.tm_sec;
+    slotEnd = slotStart + SLOT_SECONDS;
+    return row * SLOTS_PER_DAY + (local.tm_hour * 60 + local.tm_min) / 15;
+}
+
+size_t AccessSchedules::size() const {
+    size_t count = 0;
+    for (size_t i = 0; i < MAX_SCHEDULES; i++) {
+        count += !names[i].empty();
+    }
+    return count;
+}
+
+void AccessSchedules::set(uint8_t id, const std::string& name, const Week& week) {
+    names[id - 1] = name;
+    weeks[id - 1] = week;
+}
+
+void AccessSchedules::remove(uint8_t id) {
+    names[id - 1].clear();
+    memset(&weeks[id - 1], 0, sizeof(Week));
+}
+
+bool AccessSchedules::isHoliday(uint32_t date) const {
+    return std::binary_search(holidays.begin(), holidays.end(), date);
+}
+
+void AccessSchedules::setHolidays(std::vector<uint32_t>& dates) {
+    std::sort(dates.begin(), dates.end());
+    dates.erase(std::unique(dates.begin(), dates.end()), dates.end());
+    holidays.swap(dates);
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+#include <string>
+#include <vector>
+
+// Named weekly opening hours that cards can be limited to. Each schedule
+// is compiled once, when it is set, into a bitmap of 15 minute slots: 96
+// per day for the seven days of the week, plus a holiday row that takes
+// the place of the weekday on the dates in the holiday list. Deciding
+// whether a schedule allows a swipe is then a single bit test at the
+// current slot, which the card database works out once per slot.
+//
+// Only the standard library is used, so the schedule code builds and is
+// tested on a host (test_schedule.sh) as well as on the controller.
+//
+// The card database edits a copy of the published table and swaps it in,
+// so the one a swipe is reading is never changed under it.
+class AccessSchedules {
+public:
+    static constexpr uint8_t NONE = 0;            // Schedule id for no limit
+    static constexpr uint8_t MAX_SCHEDULES = 32;  // Ids run from 1 to this
+    static constexpr size_t MAX_NAME = 31;
+    static constexpr size_t MAX_HOLIDAYS = 256;
+    static constexpr uint16_t SLOT_SECONDS = 15 * 60;
+    static constexpr uint16_t SLOTS_PER_DAY = 96;
+    static constexpr uint16_t HOLIDAY_ROW = 7;    // After tm_wday's 0 (Sunday) to 6
+    static constexpr uint16_t SLOTS = (HOLIDAY_ROW + 1) * SLOTS_PER_DAY;
+
+    struct Week {
+        uint32_t bits[SLOTS / 32];  // Slot n is bit n % 32 of word n / 32
+    };
+
+    AccessSchedules();
+
+    // Compiles hours like "mon-fri 09:00-17:30;sat,sun 10:00-14:00;holiday
+    // 12:00-14:00" into a week. Rules are separated by ';', and each gives
+    // days (mon to sun, ranges in that order, or holiday) and comma
+    // separated times on 15 minute boundaries, with 24:00 for midnight at
+    // the end of a day. Days with no rule are closed; "none" closes all.
+    static bool compile(const char* hours, Week& week);
+
+    // The hours a week was compiled from, in the form compile() takes
+    static std::string describe(const Week& week);
+
+    static bool isValidName(const char* name);
+
+    // Holiday dates are local calendar dates written as YYYYMMDD numbers
+    static bool parseDate(const char* text, uint32_t& date);
+    static std::string formatDate(uint32_t date);
+
+    // The slot `now` falls in, in local time, and the times that slot
+    // starts and ends. Daylight saving changes happen on slot boundaries,
+    // so the slot holds for all of that span.
+    uint16_t slotAt(time_t now, time_t& slotStart, time_t& slotEnd) const;
+
+    // Whether schedule `id` allows a swipe in `slot`. NONE allows every
+    // slot; an id with no schedule set allows none.
+    bool allows(uint8_t id, uint16_t slot) const {
+        if (id == NONE) {
+            return true;
+        }
+        if (id > MAX_SCHEDULES || names[id - 1].empty()) {
+            return false;
+        }
+        return weeks[id - 1].bits[slot / 32] >> (slot % 32) & 1;
+    }
+
+    bool has(uint8_t id) const { return id != NONE && id <= MAX_SCHEDULES && !names[id - 1].empty(); }
+    const std::string& getName(uint8_t id) const { return names[id - 1]; }
+    const Week& getWeek(uint8_t id) const { return weeks[id - 1]; }
+    size_t size() const;
+
+    // Edits, for building a table before it is published
+    void set(uint8_t id, const std::string& name, const Week& week);
+    void remove(uint8_t id);
+
+    bool isHoliday(uint32_t date) const;
+    const std::vector<uint32_t>& getHolidays() const { return holidays; }
+    // Takes the dates, which are sorted and made unique
+    void setHolidays(std::vector<uint32_t>& dates);
+
+private:
+    Week weeks[MAX_SCHEDULES];
+    std::string names[MAX_SCHEDULES];  // Empty for an id with no schedule
+    std::vector<uint32_t> holidays;    // Sorted
+};
@@ -1,16 +1,50 @@
 #include "card_database.h"
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <esp_heap_caps.h>
+#include <functional>
 
-CardDatabase::CardDatabase() : mutex(NULL) {
+CardDatabase::CardDatabase(CardIndex::Type indexType)
+    : indexType(indexType), mutex(NULL), metadataPoolStart(0), scheduleVersion(0), currentSlot(0), slotStart(0),
+      slotEnd(0), slotVersion(0), expiriesRevoked(0), revokeFailed(false), revokeFailedAt(0), usageMutex(NULL),
+      usageDirty(false), usageSavedAt(0), usageUntracked(0), usageSaves(0), policyVersion(0), generation(0), changeLogHead(0), changeLogCount(0),
+      historyStartGeneration(0), batchWindowMs(BATCH_WINDOW_MS), batchMaxRecords(BATCH_MAX_RECORDS),
+      journalRecords(0), compactions(0), mutations(0), journalBytesWritten(0), snapshotBytesWritten(0),
+      flashCommits(0), recoveryMicros(0), journalBytesDiscarded(0), rolledBack(false), commitRateStart(0), commitRateCount(0), commitsPerSecond(0), lookups(0),
+      filterRejects(0), filterFalsePositives(0), indexMicros(0), filterUpdates(0), filterRebuilds(0),
+      writerTaskHandle(NULL) {
+    std::vector<CardKey> none;
+    current = std::make_shared<CardSet>(CardSet{std::unique_ptr<const CardIndex>(CardIndex::create(indexType, none)), 0});
+    allowedFacilities = std::make_shared<std::vector<uint16_t>>(1, LEGACY_FACILITY);
+    metadata = std::make_shared<CardMetadata>();
+    ranges = std::make_shared<CardRanges>();
+    schedules = std::make_shared<AccessSchedules>();
     mutex = xSemaphoreCreateMutex();
-    if (mutex == NULL) {
+    usageMutex = xSemaphoreCreateMutex();
+    if (mutex == NULL || usageMutex == NULL) {
         Serial.println("Error creating card database mutex");
     }
 }
 
 CardDatabase::~CardDatabase() {
+    // With the mutex held the writer task is between batches, so it can be
+    // stopped and the last batch written here instead
+    bool locked = takeMutex();
+    if (writerTaskHandle != NULL) {
+        vTaskDelete(writerTaskHandle);
+    }
+    if (locked) {
+        appendJournal();
+        writeUsage();
+        giveMutex();
+    }
     if (mutex != NULL) {
         vSemaphoreDelete(mutex);
     }
+    if (usageMutex != NULL) {
+        vSemaphoreDelete(usageMutex);
+    }
 }
 
 bool CardDatabase::begin() {
@@ -18,7 +52,85 @@ bool CardDatabase::begin() {
         Serial.println("LittleFS mount failed");
         return false;
     }
-    return initializeFile();
+    if (!takeMutex()) return false;
+
+    std::vector<CardKey> cards;
+    CuckooFilter filter;
+    CuckooFilter* savedFilter = NULL;
+    bool legacy = false;
+    bool rewrite = false;
+    uint32_t lostGeneration = 0;
+    uint32_t start = micros();
+    bool success = initializeFile(cards);
+
+    // A mapped image of the current set is used in place, so boot doesn't
+    // read the snapshot's records at all
+    CardIndex* image = success ? mapImage() : NULL;
+    if (image != NULL) {
+        // Nor is there a filter in front of it: its lookups are one probe
+        // already, and loading one would cost heap and time per card
+        resetChangeLog();
+        savedFilter = &filter;
+    } else {
+        success = success && loadSnapshot(cards, legacy, lostGeneration);
+        // The saved filter for this snapshot spares rebuilding it; journalled
+        // changes are applied to it as they are replayed
+        if (success && !legacy && loadFilter(cards.size(), filter)) {
+            savedFilter = &filter;
+        }
+        resetChangeLog();
+        success = success && replayJournal(cards, legacy, rewrite, savedFilter);
+        if (success && legacy) {
+            // Rewrite bare card numbers as composite keys once, so the legacy
+            // formats are only ever read
+            success = writeSnapshot(cards, generation);
+            Serial.print(success ? "Migrated " : "Failed to migrate ");
+            Serial.print(cards.size());
+            Serial.println(" cards to composite keys");
+        } else if (success && (rewrite || rolledBack)) {
+            // Start over from what was recovered, so nothing is appended
+            // after a bad record and the current snapshot is a good one.
+            // After a rollback the generations up to the lost snapshot's
+            // named other sets, so the recovered one gets a new one, and
+            // sync clients that saw them resync in full.
+            if (rolledBack) {
+                generation = std::max(generation, lostGeneration) + 1;
+                resetChangeLog();
+            }
+            success = writeSnapshot(cards, generation);
+            Serial.println(success ? "Rewrote card snapshot after recovery" : "Failed to rewrite card snapshot after recovery");
+        }
+        if (success) {
+            image = loadImage(cards.size());
+        }
+    }
+    recoveryMicros = micros() - start;
+    Serial.print("Card database recovery scan took ");
+    Serial.print(recoveryMicros / 1000.0f);
+    Serial.println(" ms");
+
+    success = success && loadFacilities() && loadMetadata() && loadSchedules() && loadRanges() && loadExpiries() && loadUsage();
+    if (success) {
+        publish(cards, savedFilter, image);
+        if ((savedFilter == NULL || rewrite || rolledBack) && journalRecords == 0) {
+            saveFilter();
+        }
+    } else {
+        delete image;
+    }
+
+    giveMutex();
+    if (!success) return false;
+
+    if (writerTaskHandle == NULL &&
+        xTaskCreate(writerTask, "carddb_writer", 4096, this, 1, &writerTaskHandle) != pdPASS) {
+        Serial.println("Failed to start card database writer task");
+        writerTaskHandle = NULL;
+    }
+    if (journalRecords >= COMPACT_THRESHOLD) {
+        compact();
+    }
+    return true;
 }
 
 bool CardDatabase::takeMutex() {
@@ -32,123 +144,2280 @@ void CardDatabase::giveMutex() {
     }
 }
 
-bool CardDatabase::initializeFile() {
-    if (!takeMutex()) return false;
-    
-    bool success = true;
-    if (!LittleFS.exists(DATABASE_PATH)) {
-        File file = LittleFS.open(DATABASE_PATH, FILE_WRITE);
-        if (!file) {
-            Serial.println("Failed to create card database file");
-            success = false;
+bool CardDatabase::initializeFile(std::vector<CardKey>& cards) {
+    // A temp file is a snapshot that never got renamed in, and an upload
+    // left over from a reset was never installed
+    if (LittleFS.exists(TEMP_PATH)) {
+        LittleFS.remove(TEMP_PATH);
+    }
+    if (LittleFS.exists(IMAGE_UPLOAD_PATH)) {
+        LittleFS.remove(IMAGE_UPLOAD_PATH);
+    }
+
+    // Without a snapshot but with a backup, power was lost between the
+    // two renames in saveCards(); loadSnapshot() rolls back to the backup
+    if (LittleFS.exists(DATABASE_PATH) || LittleFS.exists(BACKUP_PATH)) {
+        // A leftover text file means we lost power after the migration
+        // committed but before the old file was removed
+        if (LittleFS.exists(LEGACY_TEXT_PATH)) {
+            LittleFS.remove(LEGACY_TEXT_PATH);
         }
-        file.close();
+        return true;
     }
-    
-    giveMutex();
-    return success;
-}
 
-bool CardDatabase::addCard(unsigned long cardNumber) {
-    if (!takeMutex()) return false;
-    
-    bool success = writeCardToFile(cardNumber);
-    giveMutex();
-    return success;
-}
+    if (LittleFS.exists(LEGACY_TEXT_PATH)) {
+        return migrateTextFile(cards);
+    }
 
-bool CardDatabase::removeCard(unsigned long cardNumber) {
-    if (!takeMutex()) return false;
-    
-    bool success = removeCardFromFile(cardNumber);
-    giveMutex();
-    return success;
+    cards.clear();
+    if (!saveCards(cards, generation)) {
+        Serial.println("Failed to create card database file");
+        return false;
+    }
+    return true;
 }
 
-bool CardDatabase::hasCard(unsigned long cardNumber) {
-    if (!takeMutex()) return false;
-    
-    bool found = false;
-    File file = LittleFS.open(DATABASE_PATH, FILE_READ);
-    if (file) {
-        while (file.available()) {
-            String line = file.readStringUntil('\n');
-            if (line.toInt() == cardNumber) {
-                found = true;
-                break;
+bool CardDatabase::migrateTextFile(std::vector<CardKey>& cards) {
+    File file = LittleFS.open(LEGACY_TEXT_PATH, FILE_READ);
+    if (!file) {
+        Serial.println("Failed to open text card database for migration");
+        return false;
+    }
+
+    // Read straight into the set rather than through a CardImport, so no
+    // import limit applies to a list the old firmware already held. A line
+    // that can't be read is skipped rather than keeping the door down.
+    cards.clear();
+    char line[24];  // Longer than any card key
+    size_t lineLength = 0;
+    bool ended = false;  // Whitespace after the key
+    bool bad = false;
+    size_t skipped = 0;
+    auto endLine = [&]() {
+        line[lineLength] = '\0';
+        CardKey key;
+        // Card 0 is never issued, and older lists used it as filler, so
+        // it's dropped without counting
+        if (!bad && lineLength > 0 && parseKey(line, key)) {
+            cards.push_back(key);
+        } else if (bad || (lineLength > 0 && strspn(line, "0") != lineLength)) {
+            skipped++;
+        }
+        lineLength = 0;
+        ended = bad = false;
+    };
+    uint8_t buf[256];
+    size_t len;
+    while ((len = file.read(buf, sizeof(buf))) > 0) {
+        for (size_t i = 0; i < len; i++) {
+            char c = buf[i];
+            if (c == '\n') {
+                endLine();
+            } else if (c == ' ' || c == '\t' || c == '\r') {
+                ended = lineLength > 0;
+            } else if (ended || lineLength == sizeof(line) - 1) {
+                bad = true;
+            } else {
+                line[lineLength++] = c;
             }
         }
-        file.close();
     }
-    
-    giveMutex();
-    return found;
+    endLine();
+    file.close();
+    std::sort(cards.begin(), cards.end());
+    cards.erase(std::unique(cards.begin(), cards.end()), cards.end());
+    if (skipped > 0) {
+        Serial.print("Skipped ");
+        Serial.print(skipped);
+        Serial.println(" unreadable lines in text card database");
+    }
+
+    if (!saveCards(cards, generation)) {
+        Serial.println("Failed to write migrated card database");
+        return false;
+    }
+    LittleFS.remove(LEGACY_TEXT_PATH);
+
+    Serial.print("Migrated ");
+    Serial.print(cards.size());
+    Serial.println(" cards to binary card database");
+    return true;
+}
+
+bool CardDatabase::readHeader(File& file, FileHeader& header) {
+    // v1 headers are the later header without the trailing generation
+    header = {};
+    bool ok = file.read((uint8_t*)&header, FILE_HEADER_V1_SIZE) == FILE_HEADER_V1_SIZE &&
+              header.magic == FILE_MAGIC && header.version >= 1 && header.version <= FILE_VERSION;
+    if (ok && header.version >= 2) {
+        size_t rest = sizeof(header) - FILE_HEADER_V1_SIZE;
+        ok = file.read((uint8_t*)&header + FILE_HEADER_V1_SIZE, rest) == rest;
+    }
+    return ok && header.recordSize == (header.version < FILE_VERSION ? LEGACY_RECORD_SIZE : RECORD_SIZE);
 }
 
-String CardDatabase::getAllCards() {
-    if (!takeMutex()) return "";
-    
-    String cards;
+bool CardDatabase::readSnapshotHeader(FileHeader& header) {
     File file = LittleFS.open(DATABASE_PATH, FILE_READ);
-    if (file) {
-        while (file.available()) {
-            cards += file.readStringUntil('\n') + "\n";
+    if (!file) {
+        return false;
+    }
+    bool ok = readHeader(file, header);
+    file.close();
+    return ok;
+}
+
+bool CardDatabase::journalHasRecords(uint32_t snapshotGeneration) {
+    File file = LittleFS.open(JOURNAL_PATH, FILE_READ);
+    if (!file) {
+        return false;
+    }
+    // A journal from an older snapshot is discarded at replay; one without
+    // a current header counts as having records, so it gets replayed
+    JournalHeader header;
+    bool records = file.read((uint8_t*)&header, sizeof(header)) != sizeof(header) ||
+                   header.magic != JOURNAL_MAGIC ||
+                   (header.baseGeneration == snapshotGeneration && file.size() > sizeof(header));
+    file.close();
+    return records;
+}
+
+bool CardDatabase::loadSnapshot(std::vector<CardKey>& cards, bool& legacy, uint32_t& lostGeneration) {
+    if (loadCards(DATABASE_PATH, cards, legacy)) {
+        return true;
+    }
+
+    // The whole snapshot is checked against its CRC, so a failure means it
+    // is missing or damaged, not half-read. The backup is the set as of the
+    // snapshot before; its journal, if it is still there, replays on top.
+    FileHeader lost;
+    bool haveLost = readSnapshotHeader(lost);
+    legacy = false;
+    if (!loadCards(BACKUP_PATH, cards, legacy)) {
+        Serial.println("No readable card snapshot or backup");
+        return false;
+    }
+    rolledBack = true;
+    Serial.print("Rolled back to the card snapshot backup at generation ");
+    Serial.print(generation);
+    if (haveLost) {
+        // Its journal's records took the generations after it, which sync
+        // clients may have seen too
+        lostGeneration = lost.generation;
+        File journal = LittleFS.open(JOURNAL_PATH, FILE_READ);
+        JournalHeader header;
+        if (journal && journal.read((uint8_t*)&header, sizeof(header)) == sizeof(header) &&
+            header.magic == JOURNAL_MAGIC && header.baseGeneration == lost.generation) {
+            lostGeneration += (journal.size() - sizeof(header) + sizeof(JournalRecord) - 1) / sizeof(JournalRecord);
         }
+        journal.close();
+        Serial.print(", discarding generation ");
+        Serial.print(lost.generation);
+        Serial.print(" with ");
+        Serial.print(lost.count);
+        Serial.print(" cards");
+    }
+    Serial.println();
+    return true;
+}
+
+bool CardDatabase::loadCards(const char* path, std::vector<CardKey>& cards, bool& legacy) {
+    File file = LittleFS.open(path, FILE_READ);
+    if (!file) {
+        Serial.print("Failed to open card snapshot ");
+        Serial.println(path);
+        return false;
+    }
+
+    FileHeader header;
+    if (!readHeader(file, header)) {
+        Serial.print(path);
+        Serial.println(" has an unknown format");
         file.close();
+        return false;
     }
-    
-    giveMutex();
-    return cards;
+    bool legacyFile = header.version < FILE_VERSION;
+    generation = header.generation;
+
+    // Records are little-endian, the ESP32's native layout, so the whole
+    // set is one bulk read straight into the index. Legacy bare card
+    // numbers are read beside it and widened to keys.
+    std::vector<uint32_t> legacyCards;
+    uint8_t* records;
+    if (legacyFile) {
+        legacyCards.resize(header.count);
+        records = (uint8_t*)legacyCards.data();
+    } else {
+        cards.clear();
+        cards.resize(header.count);
+        records = (uint8_t*)cards.data();
+    }
+    size_t bytes = header.count * header.recordSize;
+    size_t got = file.read(records, bytes);
+    file.close();
+
+    if (got != bytes || crc32(0, records, bytes) != header.crc) {
+        Serial.print(path);
+        Serial.println(" is corrupt");
+        cards.clear();
+        return false;
+    }
+    if (legacyFile) {
+        cards.clear();
+        cards.reserve(legacyCards.size());
+        for (uint32_t card : legacyCards) {
+            cards.push_back(makeKey(DEFAULT_FORMAT, LEGACY_FACILITY, card));
+        }
+        legacy = true;
+    }
+
+    // Snapshots are written from the sorted index, but older writers appended
+    std::sort(cards.begin(), cards.end());
+    cards.erase(std::unique(cards.begin(), cards.end()), cards.end());
+
+    Serial.print("Loaded ");
+    Serial.print(cards.size());
+    Serial.print(" cards at generation ");
+    Serial.println(generation);
+    return true;
 }
 
-bool CardDatabase::writeCardToFile(unsigned long cardNumber) {
-    // First check if card already exists
-    if (hasCard(cardNumber)) {
-        return true;  // Card already exists, consider it a success
+bool CardDatabase::saveCards(const std::vector<CardKey>& set, uint32_t setGeneration) {
+    // Write a complete image beside the live file, flush it and rename it
+    // over the old one, so a power cut leaves either the old or the new set
+    File file = LittleFS.open(TEMP_PATH, FILE_WRITE);
+    if (!file) {
+        return false;
+    }
+
+    size_t bytes = set.size() * RECORD_SIZE;
+    FileHeader header = {FILE_MAGIC, FILE_VERSION, RECORD_SIZE, (uint32_t)set.size(),
+                         crc32(0, (const uint8_t*)set.data(), bytes), setGeneration};
+    bool ok = file.write((const uint8_t*)&header, sizeof(header)) == sizeof(header) &&
+              file.write((const uint8_t*)set.data(), bytes) == bytes;
+    file.flush();
+    file.close();
+    snapshotBytesWritten += sizeof(header) + bytes;
+
+    if (!ok) {
+        LittleFS.remove(TEMP_PATH);
+        return false;
+    }
+
+    // The set being replaced stays behind as the backup, in case the new
+    // one is later found damaged. A power cut between the renames leaves
+    // only the backup, which boot treats the same way.
+    if (LittleFS.exists(DATABASE_PATH) && !LittleFS.rename(DATABASE_PATH, BACKUP_PATH)) {
+        LittleFS.remove(TEMP_PATH);
+        return false;
     }
-    
-    File file = LittleFS.open(DATABASE_PATH, FILE_APPEND);
+    return LittleFS.rename(TEMP_PATH, DATABASE_PATH);
+}
+
+bool CardDatabase::commitFile(const char* path, const char* tempPath, const std::function<bool(File&)>& writer) {
+    // The side tables' version of saveCards(), without the backup: a power
+    // cut leaves either the old or the new file, and a temp file left over
+    // is removed by the table's loader
+    File file = LittleFS.open(tempPath, FILE_WRITE);
     if (!file) {
-        Serial.println("Failed to open card database for writing");
         return false;
     }
-    
-    file.println(String(cardNumber));
+    bool ok = writer(file);
+    file.flush();
     file.close();
-    return true;
+
+    if (!ok) {
+        LittleFS.remove(tempPath);
+        return false;
+    }
+    return LittleFS.rename(tempPath, path);
 }
 
-bool CardDatabase::removeCardFromFile(unsigned long cardNumber) {
-    String cards;
-    bool found = false;
-    
-    // Read all cards except the one to remove
-    File file = LittleFS.open(DATABASE_PATH, FILE_READ);
-    if (file) {
-        while (file.available()) {
-            String line = file.readStringUntil('\n');
-            if (line.toInt() != cardNumber) {
-                cards += line + "\n";
+bool CardDatabase::replayJournal(std::vector<CardKey>& cards, bool& legacy, bool& rewrite, CuckooFilter*& filter) {
+    journalRecords = 0;
+    if (!LittleFS.exists(JOURNAL_PATH)) {
+        return true;
+    }
+
+    File file = LittleFS.open(JOURNAL_PATH, FILE_READ);
+    if (!file) {
+        Serial.println("Failed to open card journal");
+        return false;
+    }
+
+    // Journals from before generations were tracked have no header and
+    // always apply; they, and CDJ1 journals, hold bare card numbers
+    JournalHeader header;
+    bool legacyJournal = true;
+    bool checked = false;
+    size_t headerSize = sizeof(header);
+    if (file.read((uint8_t*)&header, sizeof(header)) != sizeof(header) ||
+        (header.magic != JOURNAL_MAGIC && header.magic != UNCHECKED_JOURNAL_MAGIC &&
+         header.magic != LEGACY_JOURNAL_MAGIC)) {
+        file.seek(0);
+        headerSize = 0;
+    } else if (header.baseGeneration != generation) {
+        Serial.print("Discarding ");
+        Serial.print(file.size());
+        Serial.println(" bytes of card journal from another snapshot");
+        file.close();
+        LittleFS.remove(JOURNAL_PATH);
+        return true;
+    } else {
+        legacyJournal = header.magic == LEGACY_JOURNAL_MAGIC;
+        checked = header.magic == JOURNAL_MAGIC;
+    }
+    size_t recordSize = legacyJournal ? sizeof(LegacyJournalRecord) : sizeof(JournalRecord);
+
+    // The buffer holds a whole number of either record size. Replay stops
+    // at a partial record or one that fails its CRC; what follows it was
+    // never acknowledged as committed, or can't be trusted. Records are
+    // held back until the end of their write.
+    uint8_t buffer[32 * sizeof(JournalRecord)];
+    size_t len;
+    bool bad = false;
+    std::vector<JournalRecord> uncommitted;
+    while (!bad && (len = file.read(buffer, sizeof(buffer))) > 0) {
+        for (size_t offset = 0; offset < len; offset += recordSize) {
+            JournalRecord record;
+            if (offset + recordSize > len) {
+                bad = true;
+                break;
+            }
+            if (legacyJournal) {
+                LegacyJournalRecord old;
+                memcpy(&old, buffer + offset, sizeof(old));
+                record.card = makeKey(DEFAULT_FORMAT, LEGACY_FACILITY, old.card);
+                record.op = old.op;
             } else {
-                found = true;
+                memcpy(&record, buffer + offset, sizeof(record));
+            }
+            if (checked && record.crc != recordCrc(generation + journalRecords + uncommitted.size() + 1, record)) {
+                bad = true;
+                break;
+            }
+            uncommitted.push_back(record);
+            if (checked && !(record.flags & RECORD_COMMIT)) {
+                continue;
+            }
+
+            for (const JournalRecord& change : uncommitted) {
+                auto it = std::lower_bound(cards.begin(), cards.end(), change.card);
+                bool present = it != cards.end() && *it == change.card;
+                // A filter that fills up is dropped, and rebuilt once the set is known
+                if (change.op == JOURNAL_ADD && !present) {
+                    cards.insert(it, change.card);
+                    if (filter != NULL && !filter->add(change.card)) {
+                        filter = NULL;
+                    }
+                } else if (change.op == JOURNAL_DEL && present) {
+                    cards.erase(it);
+                    if (filter != NULL) {
+                        filter->remove(change.card);
+                    }
+                }
+                journalRecords++;
+                logChanges(change.op == JOURNAL_ADD, &change.card, 1, generation + journalRecords);
             }
+            uncommitted.clear();
         }
-        file.close();
     }
-    
-    // If card wasn't found, return success
-    if (!found) {
+    if (legacyJournal && journalRecords > 0) {
+        legacy = true;
+    }
+    size_t discarded = file.size() - headerSize - journalRecords * recordSize;
+    file.close();
+    generation += journalRecords;
+
+    Serial.print("Replayed ");
+    Serial.print(journalRecords);
+    Serial.println(" card journal records");
+    if (discarded > 0) {
+        journalBytesDiscarded = discarded;
+        Serial.print("Discarded ");
+        Serial.print(discarded);
+        Serial.println(" bytes of torn, corrupt or unfinished card journal after them");
+    }
+    // Later appends would land after the bad bytes, and CDJ2 records have
+    // no CRCs to check; either way the journal is folded in and restarted
+    rewrite = discarded > 0 || (!checked && !legacyJournal && journalRecords > 0);
+    return true;
+}
+
+uint32_t CardDatabase::recordCrc(uint32_t recordGeneration, const JournalRecord& record) {
+    // Covering the generation ties a record to its place in its journal
+    uint32_t crc = crc32(0, (const uint8_t*)&recordGeneration, sizeof(recordGeneration));
+    return crc32(crc, (const uint8_t*)&record, offsetof(JournalRecord, crc));
+}
+
+bool CardDatabase::appendJournal() {
+    if (batch.empty()) {
         return true;
     }
-    
-    // Write back all cards except the removed one
-    file = LittleFS.open(DATABASE_PATH, FILE_WRITE);
+
+    // An empty journal is started afresh on top of the current snapshot,
+    // truncating anything a failed cleanup left behind. The batch is
+    // already counted in the generation; the snapshot is from before it.
+    bool fresh = journalRecords == 0;
+    File file = LittleFS.open(JOURNAL_PATH, fresh ? FILE_WRITE : FILE_APPEND);
     if (!file) {
-        Serial.println("Failed to open card database for writing");
+        Serial.println("Failed to open card journal for writing");
         return false;
     }
-    
-    file.print(cards);
+
+    bool ok = true;
+    if (fresh) {
+        JournalHeader header = {JOURNAL_MAGIC, generation - (uint32_t)batch.size()};
+        ok = file.write((const uint8_t*)&header, sizeof(header)) == sizeof(header);
+        journalBytesWritten += sizeof(header);
+    }
+    uint32_t first = generation - batch.size() + 1;
+    for (size_t i = 0; i < batch.size(); i++) {
+        batch[i].flags = i + 1 == batch.size() ? RECORD_COMMIT : 0;
+        batch[i].crc = recordCrc(first + i, batch[i]);
+    }
+    size_t bytes = batch.size() * sizeof(JournalRecord);
+    ok = ok && file.write((const uint8_t*)batch.data(), bytes) == bytes;
     file.close();
+    if (!ok) {
+        Serial.println("Failed to append to card journal");
+        return false;
+    }
+
+    mutations += batch.size();
+    journalBytesWritten += bytes;
+    journalRecords += batch.size();
+    batch.clear();
+    countCommit();
+    if (journalRecords >= COMPACT_THRESHOLD && writerTaskHandle != NULL) {
+        xTaskNotifyGive(writerTaskHandle);
+    }
+    return true;
+}
+
+void CardDatabase::countCommit() {
+    flashCommits++;
+    uint32_t now = millis();
+    uint32_t elapsed = now - commitRateStart;
+    if (elapsed >= COMMIT_RATE_WINDOW_MS) {
+        // A window with no commits at all is only noticed by getStats()
+        commitsPerSecond = elapsed < 2 * COMMIT_RATE_WINDOW_MS ? commitRateCount * 1000.0f / elapsed : 0.0f;
+        commitRateStart = now;
+        commitRateCount = 0;
+    }
+    commitRateCount++;
+}
+
+bool CardDatabase::writeSnapshot(const std::vector<CardKey>& set, uint32_t setGeneration) {
+    if (!saveCards(set, setGeneration)) {
+        return false;
+    }
+
+    // The rename is the commit point. The old journal no longer matches the
+    // snapshot's generation, so it is dead even if it can't be removed now.
+    if (LittleFS.exists(JOURNAL_PATH) && !LittleFS.remove(JOURNAL_PATH)) {
+        Serial.println("Failed to remove card journal");
+    }
+    journalRecords = 0;
+    batch.clear();
+    compactions++;
+    countCommit();
+    return true;
+}
+
+bool CardDatabase::compact() {
+    if (!takeMutex()) return false;
+
+    bool success = true;
+    if (journalRecords >= COMPACT_THRESHOLD) {
+        std::vector<CardKey> cards;
+        getSnapshot()->index->getSortedKeys(cards);
+        success = writeSnapshot(cards, generation);
+        if (success) {
+            saveFilter();
+        } else {
+            Serial.println("Card database compaction failed");
+        }
+    }
+
+    giveMutex();
+    return success;
+}
+
+void CardDatabase::writerTask(void* arg) {
+    CardDatabase* db = static_cast<CardDatabase*>(arg);
+    for (;;) {
+        // Woken by the first change of a batch, by a long journal or a new
+        // expiry, or when the earliest expiry or the counters fall due. The
+        // batch gathers changes for one window and goes out in one write;
+        // one that fills up meanwhile has been written by its last change.
+        if (ulTaskNotifyTake(pdTRUE, std::min(db->expiryWait(), db->usageWait())) != 0) {
+            vTaskDelay(pdMS_TO_TICKS(db->batchWindowMs));
+            if (!db->flush()) {
+                xTaskNotifyGive(db->writerTaskHandle);  // Try again next window
+            }
+            db->compact();
+        }
+        // However it woke, so a steady stream of changes never holds back
+        // the counters or a due expiry
+        if (db->usageWait() == 0) {
+            db->saveUsage();
+        }
+        db->revokeExpired();
+    }
+}
+
+void CardDatabase::setBatching(uint32_t windowMs, size_t maxRecords) {
+    batchWindowMs = windowMs;
+    batchMaxRecords = std::max<size_t>(maxRecords, 1);
+}
+
+bool CardDatabase::flush() {
+    if (!takeMutex()) return false;
+    bool success = appendJournal();
+    giveMutex();
+    return success;
+}
+
+bool CardDatabase::fieldsToKey(const uint32_t* fields, size_t count, CardKey& key) {
+    uint32_t format = DEFAULT_FORMAT;
+    uint32_t facility = LEGACY_FACILITY;
+    if (count == 3) {
+        format = fields[0];
+        facility = fields[1];
+    } else if (count == 2) {
+        facility = fields[0];
+    } else if (count != 1) {
+        return false;
+    }
+    if (format > UINT16_MAX || facility > UINT16_MAX) {
+        return false;
+    }
+    key = makeKey(format, facility, fields[count - 1]);
     return true;
-} 
\ No newline at end of file
+}
+
+bool CardDatabase::parseKey(const char* text, CardKey& key) {
+    uint32_t fields[3] = {0, 0, 0};
+    size_t count = 0;
+    size_t digits = 0;
+    for (const char* p = text; ; p++) {
+        if (*p >= '0' && *p <= '9') {
+            if (fields[count] > (UINT32_MAX - 9) / 10) {
+                return false;
+            }
+            fields[count] = fields[count] * 10 + (*p - '0');
+            digits++;
+        } else if ((*p == ':' || *p == '\0') && digits > 0) {
+            count++;
+            digits = 0;
+            if (*p == '\0') {
+                break;
+            }
+            if (count == 3) {
+                return false;
+            }
+        } else {
+            return false;
+        }
+    }
+    return fieldsToKey(fields, count, key) && keyCard(key) != 0;
+}
+
+size_t CardDatabase::formatKey(CardKey key, char* buffer) {
+    char* p = buffer;
+    if (keyFormat(key) != DEFAULT_FORMAT) {
+        utoa(keyFormat(key), p, 10);
+        p += strlen(p);
+        *p++ = ':';
+    }
+    utoa(keyFacility(key), p, 10);
+    p += strlen(p);
+    *p++ = ':';
+    utoa(keyCard(key), p, 10);
+    return p + strlen(p) - buffer;
+}
+
+CardDatabase::Snapshot CardDatabase::getSnapshot() const {
+    return std::atomic_load(&current);
+}
+
+CardDatabase::Snapshot CardDatabase::getSavedSnapshot() {
+    // Sets are published with the mutex held, so none comes in between
+    if (!takeMutex()) return Snapshot();
+    Snapshot set = appendJournal() ? getSnapshot() : Snapshot();
+    giveMutex();
+    return set;
+}
+
+CardDatabase::Cursor CardDatabase::openCursor() const {
+    return Cursor(getSnapshot());
+}
+
+CardDatabase::Cursor CardDatabase::openCursor(const BucketSet& buckets) const {
+    return Cursor(getSnapshot(), buckets);
+}
+
+CardDatabase::Cursor::Cursor(Snapshot set)
+    : set(set), position(0), visited(0), filtered(false), batchCount(0), batchNext(0) {
+}
+
+CardDatabase::Cursor::Cursor(Snapshot set, const BucketSet& buckets)
+    : set(set), position(0), visited(0), buckets(buckets), filtered(true), batchCount(0), batchNext(0) {
+}
+
+bool CardDatabase::Cursor::done() const {
+    return visited >= set->size();
+}
+
+size_t CardDatabase::Cursor::read(uint8_t* buffer, size_t maxLen) {
+    size_t written = 0;
+    char line[KEY_TEXT_SIZE + 1];  // Key, newline, terminator
+    for (;;) {
+        if (batchNext == batchCount) {
+            batchCount = set->index->read(position, batch, READ_BATCH);
+            batchNext = 0;
+            if (batchCount == 0) {
+                break;
+            }
+        }
+        CardKey card = batch[batchNext];
+        if (!filtered || buckets[syncBucket(card)]) {
+            size_t len = formatKey(card, line);
+            line[len++] = '\n';
+            if (written + len > maxLen) {
+                break;
+            }
+            memcpy(buffer + written, line, len);
+            written += len;
+        }
+        batchNext++;
+        visited++;
+    }
+    return written;
+}
+
+uint64_t CardDatabase::digestOf(const CardKey* cards, size_t count) {
+    uint64_t digest = 0;
+    for (size_t i = 0; i < count; i++) {
+        digest ^= cardHash(cards[i]);
+    }
+    return digest;
+}
+
+uint64_t CardDatabase::CardSet::getDigest() const {
+    if (hasDigest) {
+        return digest;
+    }
+    uint64_t result = 0;
+    CardKey keys[64];
+    size_t position = 0;
+    size_t count;
+    while ((count = index->read(position, keys, 64)) > 0) {
+        result ^= digestOf(keys, count);
+    }
+    return result;
+}
+
+void CardDatabase::getBucketDigests(const CardSet& set, uint64_t* digests) {
+    memset(digests, 0, SYNC_BUCKETS * sizeof(uint64_t));
+    CardKey keys[64];
+    size_t position = 0;
+    size_t count;
+    while ((count = set.index->read(position, keys, 64)) > 0) {
+        for (size_t i = 0; i < count; i++) {
+            digests[syncBucket(keys[i])] ^= cardHash(keys[i]);
+        }
+    }
+}
+
+void CardDatabase::publish(std::vector<CardKey>& cards, CuckooFilter* filter, CardIndex* index, const uint64_t* digest) {
+    // Readers holding the previous snapshot keep it alive until they drop it
+    std::shared_ptr<CardSet> next = std::make_shared<CardSet>();
+    next->generation = generation;
+    // Without the keys to hand, a mapped image's digest waits until asked for
+    next->hasDigest = digest != NULL || index == NULL || !cards.empty();
+    next->digest = digest != NULL ? *digest : digestOf(cards.data(), cards.size());
+    if (filter != NULL) {
+        next->filter = std::move(*filter);
+    } else {
+        next->filter.build(cards.data(), cards.size());
+        filterRebuilds++;
+    }
+    next->index.reset(index != NULL ? index : CardIndex::create(indexType, cards));
+    cards.clear();
+    std::atomic_store(&current, Snapshot(next));
+    policyVersion++;
+}
+
+bool CardDatabase::commitChanges(JournalOp op, const std::vector<CardKey>& delta, std::vector<CardKey>& next) {
+    if (delta.empty()) {
+        return true;
+    }
+
+    bool success = true;
+    uint32_t firstGeneration = generation + 1;
+    generation += delta.size();
+    bool snapshot = delta.size() >= COMPACT_THRESHOLD;
+    if (snapshot) {
+        // Large changes skip the journal and go straight to a new snapshot,
+        // which takes any batched changes with it
+        success = writeSnapshot(next, generation);
+    } else {
+        size_t batched = batch.size();
+        for (CardKey card : delta) {
+            batch.push_back({card, op, {}});
+        }
+        if (batch.size() >= batchMaxRecords || batchWindowMs == 0 || writerTaskHandle == NULL) {
+            // A failed write leaves the batch as it was, still to be retried,
+            // and this change isn't made at all
+            success = appendJournal();
+            if (!success) {
+                batch.resize(batched);
+            }
+        } else if (batched == 0) {
+            xTaskNotifyGive(writerTaskHandle);
+        }
+    }
+
+    if (!success) {
+        generation -= delta.size();
+    } else {
+        logChanges(op == JOURNAL_ADD, delta.data(), delta.size(), firstGeneration);
+        // Adds and removes alike toggle their cards in the digest
+        Snapshot set = getSnapshot();
+        uint64_t digest = set->getDigest() ^ digestOf(delta.data(), delta.size());
+        // The new set starts from a copy of the current filter with just
+        // this change applied; it is only rebuilt when it fills up, or if
+        // the current set has none
+        CuckooFilter filter = set->filter;
+        bool updated = !filter.isEmpty();
+        for (size_t i = 0; updated && i < delta.size(); i++) {
+            updated = op == JOURNAL_ADD ? filter.add(delta[i]) : filter.remove(delta[i]);
+        }
+        if (updated) {
+            filterUpdates++;
+        }
+        publish(next, updated ? &filter : NULL, NULL, &digest);
+        if (snapshot) {
+            saveFilter();
+        }
+    }
+    return success;
+}
+
+bool CardDatabase::addCard(CardKey card) {
+    std::vector<CardKey> cards(1, card);
+    return addCards(cards);
+}
+
+bool CardDatabase::removeCard(CardKey card) {
+    std::vector<CardKey> cards(1, card);
+    return removeCards(cards);
+}
+
+bool CardDatabase::hasCard(CardKey card) {
+    Snapshot set = getSnapshot();
+    lookups++;
+    bool filtered = !set->filter.isEmpty();
+    if (filtered && !set->filter.mightContain(card)) {
+        filterRejects++;
+        return false;
+    }
+
+    uint32_t start = micros();
+    bool found = set->contains(card);
+    indexMicros += micros() - start;
+    if (!found && filtered) {
+        filterFalsePositives++;
+    }
+    return found;
+}
+
+AccessDecision CardDatabase::checkAccess(uint64_t raw, uint16_t format, uint16_t facility, uint32_t card, uint8_t door) {
+    // Read before deciding, so a change published meanwhile leaves this
+    // decision with an old stamp and the cache drops it
+    uint32_t version = policyVersion;
+    AccessDecision decision;
+    if (!accessCache.lookup(raw, format, version, decision)) {
+        if (!isFacilityAllowed(facility)) {
+            decision = AccessDecision::FACILITY_REFUSED;
+        } else if (!hasCard(makeKey(format, facility, card)) &&
+                   !std::atomic_load(&ranges)->contains(makeKey(format, facility, card))) {
+            decision = AccessDecision::NOT_ENROLLED;
+        } else {
+            decision = AccessDecision::GRANTED;
+        }
+        accessCache.insert(raw, format, version, decision);
+    }
+
+    if (decision == AccessDecision::GRANTED) {
+        // Version first, so a table swapped in meanwhile makes the next
+        // swipe work the slot out again
+        uint32_t scheduleStamp = scheduleVersion;
+        std::shared_ptr<const AccessSchedules> table = std::atomic_load(&schedules);
+        time_t now = time(NULL);
+        if (now < CLOCK_VALID_AFTER) {
+            now = 0;
+        } else if (scheduleStamp != slotVersion || now < slotStart || now >= slotEnd) {
+            currentSlot = table->slotAt(now, slotStart, slotEnd);
+            slotVersion = scheduleStamp;
+        }
+        decision = std::atomic_load(&metadata)->check(makeKey(format, facility, card), door, (uint32_t)now,
+                                                      *table, currentSlot);
+    }
+    if (decision != AccessDecision::NOT_ENROLLED && decision != AccessDecision::FACILITY_REFUSED) {
+        recordUsage(makeKey(format, facility, card));
+    }
+    return decision;
+}
+
+size_t CardDatabase::getCardCount() {
+    return getSnapshot()->size();
+}
+
+bool CardDatabase::addCards(const std::vector<CardKey>& newCards) {
+    if (!takeMutex()) return false;
+
+    Snapshot set = getSnapshot();
+    std::vector<CardKey> added;
+    for (CardKey card : newCards) {
+        if (!set->contains(card)) {
+            added.push_back(card);
+        }
+    }
+
+    // The next set is built beside the published one, which readers keep
+    // using until it is committed
+    std::vector<CardKey> merged;
+    if (!added.empty()) {
+        set->index->getSortedKeys(merged);
+        size_t middle = merged.size();
+        merged.insert(merged.end(), added.begin(), added.end());
+        std::inplace_merge(merged.begin(), merged.begin() + middle, merged.end());
+    }
+    bool success = commitChanges(JOURNAL_ADD, added, merged);
+
+    giveMutex();
+    return success;
+}
+
+bool CardDatabase::removeCards(const std::vector<CardKey>& oldCards) {
+    std::vector<CardKey> removed;
+    return removeCards(oldCards, removed);
+}
+
+bool CardDatabase::removeCards(const std::vector<CardKey>& oldCards, std::vector<CardKey>& removed) {
+    removed.clear();
+    if (!takeMutex()) return false;
+
+    Snapshot set = getSnapshot();
+    for (CardKey card : oldCards) {
+        if (set->contains(card)) {
+            removed.push_back(card);
+        }
+    }
+
+    std::vector<CardKey> remaining;
+    if (!removed.empty()) {
+        set->index->getSortedKeys(remaining);
+        remaining.erase(std::remove_if(remaining.begin(), remaining.end(), [&removed](CardKey card) {
+            return std::binary_search(removed.begin(), removed.end(), card);
+        }), remaining.end());
+    }
+    bool success = commitChanges(JOURNAL_DEL, removed, remaining);
+    if (!success) {
+        removed.clear();
+    }
+
+    giveMutex();
+    return success;
+}
+
+bool CardDatabase::replaceCards(std::vector<CardKey>& newCards) {
+    if (!takeMutex()) return false;
+
+    // Lookups only switch over once the new snapshot is committed to
+    // flash, and then all at once, so nobody sees a half-replaced set
+    bool success = writeSnapshot(newCards, generation + 1);
+    if (success) {
+        generation++;
+        publish(newCards);
+        saveFilter();
+        resetChangeLog();
+    } else {
+        Serial.println("Failed to write card database");
+    }
+
+    giveMutex();
+    return success;
+}
+
+bool CardDatabase::installImage(const char* path, const char*& error) {
+    // Checking the image and sorting its keys for the snapshot happens
+    // before taking the mutex, so lookups and other writers aren't held up
+    File file = LittleFS.open(path, FILE_READ);
+    if (!file) {
+        error = "Failed to open card image";
+        return false;
+    }
+    std::unique_ptr<PerfectHashCardIndex> index(PerfectHashCardIndex::open(CardImageMemory::load(file), true, error));
+    file.close();
+    if (!index) {
+        LittleFS.remove(path);
+        return false;
+    }
+    std::vector<CardKey> cards;
+    index->getSortedKeys(cards);
+
+    if (!takeMutex()) {
+        error = "Card database busy";
+        return false;
+    }
+
+    // With a mapped region the snapshot is written first and the image
+    // copied in after it. Otherwise the image goes in first, stamped with
+    // the generation the snapshot is about to get; if the snapshot write
+    // fails it is removed again. Either way, after a crash in between the
+    // image's generation never matches.
+    bool mapped = CardImageMemory::available(IMAGE_REGION);
+    bool success = mapped || (stampImage(path, generation + 1) && LittleFS.rename(path, IMAGE_PATH));
+    if (success && !writeSnapshot(cards, generation + 1)) {
+        if (!mapped) {
+            LittleFS.remove(IMAGE_PATH);
+        }
+        success = false;
+    }
+    if (success) {
+        std::weak_ptr<const CardSet> previous = getSnapshot();
+        generation++;
+        publish(cards, NULL, index.release());
+        saveFilter();
+        resetChangeLog();
+        if (mapped) {
+            storeMappedImage(path, previous);
+        }
+    } else {
+        error = "Failed to write card database";
+    }
+    LittleFS.remove(path);
+
+    giveMutex();
+    return success;
+}
+
+void CardDatabase::storeMappedImage(const char* path, std::weak_ptr<const CardSet> previous) {
+    // The heap copy already serves lookups, so failing here only costs RAM
+    // until the next install. The previous set may be mapped from the
+    // region about to be rewritten; wait for readers, such as a card list
+    // download, to let go of it first.
+    Snapshot old = previous.lock();
+    bool wasMapped = old && old->index->getType() == CardIndex::PERFECT &&
+                     static_cast<const PerfectHashCardIndex*>(old->index.get())->isMapped();
+    old.reset();
+    for (uint32_t waited = 0; wasMapped && !previous.expired(); waited += 10) {
+        if (waited >= IMAGE_RETIRE_TIMEOUT_MS) {
+            Serial.println("Previous card image still in use, keeping the new one in RAM");
+            return;
+        }
+        vTaskDelay(pdMS_TO_TICKS(10));
+    }
+
+    File file = LittleFS.open(path, FILE_READ);
+    PerfectHashCardIndex::ImageHeader header;
+    bool ok = file && file.read((uint8_t*)&header, sizeof(header)) == sizeof(header);
+    if (ok) {
+        header.generation = generation;
+        ok = CardImageMemory::store(IMAGE_REGION, file, PerfectHashCardIndex::IMAGE_PAGE_SIZE,
+                                    (const uint8_t*)&header, sizeof(header));
+    }
+    file.close();
+
+    const char* error = NULL;
+    PerfectHashCardIndex* index = NULL;
+    if (ok) {
+        index = PerfectHashCardIndex::open(CardImageMemory::map(IMAGE_REGION), false, error);
+    }
+    if (index == NULL || index->size() != getSnapshot()->size()) {
+        delete index;
+        Serial.println("Failed to store card image in flash, keeping it in RAM");
+        return;
+    }
+
+    // Published without a filter, as at boot, but still the same cards
+    CuckooFilter none;
+    std::vector<CardKey> cards;
+    uint64_t digest = getSnapshot()->getDigest();
+    publish(cards, &none, index, &digest);
+}
+
+bool CardDatabase::getChangesSince(uint32_t since, std::vector<Change>& changes, uint32_t& currentGeneration) {
+    changes.clear();
+    if (!takeMutex()) return false;
+
+    // Batched changes are written first, as a client that has seen their
+    // generations would diverge if a power cut lost them. The batch holds
+    // the latest generations, so if the write fails they are left out.
+    appendJournal();
+    uint32_t saved = generation - batch.size();
+    currentGeneration = saved;
+    bool available = since >= historyStartGeneration && since <= saved;
+    if (available) {
+        for (size_t i = 0; i < changeLogCount; i++) {
+            const Change& change = changeLog[(changeLogHead + i) % CHANGE_LOG_SIZE];
+            if (change.generation > since && change.generation <= saved) {
+                changes.push_back(change);
+            }
+        }
+    }
+
+    giveMutex();
+    return available;
+}
+
+void CardDatabase::logChanges(bool added, const CardKey* cards, size_t count, uint32_t firstGeneration) {
+    for (size_t i = 0; i < count; i++) {
+        if (changeLogCount == CHANGE_LOG_SIZE) {
+            // Overwrite the oldest entry; history now starts at its generation
+            historyStartGeneration = changeLog[changeLogHead].generation;
+            changeLogHead = (changeLogHead + 1) % CHANGE_LOG_SIZE;
+            changeLogCount--;
+        }
+        changeLog[(changeLogHead + changeLogCount) % CHANGE_LOG_SIZE] = {(uint32_t)(firstGeneration + i), cards[i], added};
+        changeLogCount++;
+    }
+}
+
+void CardDatabase::resetChangeLog() {
+    changeLogHead = 0;
+    changeLogCount = 0;
+    historyStartGeneration = generation;
+}
+
+bool CardDatabase::loadFilter(size_t cardCount, CuckooFilter& filter) {
+    if (LittleFS.exists(FILTER_TEMP_PATH)) {
+        LittleFS.remove(FILTER_TEMP_PATH);
+    }
+    if (!LittleFS.exists(FILTER_PATH)) {
+        return false;
+    }
+
+    File file = LittleFS.open(FILTER_PATH, FILE_READ);
+    if (!file) {
+        return false;
+    }
+
+    FilterHeader header;
+    std::vector<uint16_t> table;
+    bool ok = file.read((uint8_t*)&header, sizeof(header)) == sizeof(header) &&
+              header.magic == FILTER_MAGIC && header.generation == generation &&
+              header.cardCount == cardCount && header.slotsPerBucket == CuckooFilter::SLOTS_PER_BUCKET &&
+              header.slotCount > 0 && header.slotCount * sizeof(uint16_t) <= file.size();
+    if (ok) {
+        table.resize(header.slotCount);
+        size_t bytes = table.size() * sizeof(uint16_t);
+        ok = file.read((uint8_t*)table.data(), bytes) == bytes &&
+             crc32(0, (const uint8_t*)table.data(), bytes) == header.crc;
+    }
+    file.close();
+
+    if (!ok || !filter.assign(table) || filter.size() != cardCount) {
+        Serial.println("Saved card filter is stale, rebuilding it");
+        return false;
+    }
+    return true;
+}
+
+void CardDatabase::saveFilter() {
+    // Only called right after a snapshot write, so the filter matches it
+    Snapshot set = getSnapshot();
+    if (set->filter.isEmpty() || !set->filter.isSaveable()) {
+        LittleFS.remove(FILTER_PATH);
+        return;
+    }
+    const std::vector<uint16_t>& table = set->filter.getTable();
+    size_t bytes = table.size() * sizeof(uint16_t);
+    FilterHeader header = {FILTER_MAGIC, generation, (uint32_t)set->size(), (uint32_t)table.size(),
+                           CuckooFilter::SLOTS_PER_BUCKET, crc32(0, (const uint8_t*)table.data(), bytes)};
+
+    bool ok = commitFile(FILTER_PATH, FILTER_TEMP_PATH, [&](File& file) {
+        snapshotBytesWritten += sizeof(header) + bytes;
+        return file.write((const uint8_t*)&header, sizeof(header)) == sizeof(header) &&
+               file.write((const uint8_t*)table.data(), bytes) == bytes;
+    });
+    if (!ok) {
+        Serial.println("Failed to save card filter");
+    }
+}
+
+CardIndex* CardDatabase::mapImage() {
+    // Only the headers are read: the image was checked key by key when it
+    // was installed, and its header is written last, so a match means the
+    // whole image is there and the snapshot's records can be skipped
+    CardImageMemory* memory = CardImageMemory::map(IMAGE_REGION);
+    FileHeader header;
+    if (memory == NULL || !readSnapshotHeader(header) || header.version != FILE_VERSION || journalHasRecords(header.generation)) {
+        delete memory;
+        return NULL;
+    }
+    const char* error = NULL;
+    PerfectHashCardIndex* index = PerfectHashCardIndex::open(memory, false, error);
+    if (index == NULL || index->getHeader().generation != header.generation || index->size() != header.count) {
+        delete index;
+        return NULL;
+    }
+
+    generation = header.generation;
+    Serial.print("Mapped ");
+    Serial.print(index->size());
+    Serial.print(" cards at generation ");
+    Serial.println(generation);
+    return index;
+}
+
+CardIndex* CardDatabase::loadImage(size_t cardCount) {
+    if (!LittleFS.exists(IMAGE_PATH)) {
+        return NULL;
+    }
+
+    File file = LittleFS.open(IMAGE_PATH, FILE_READ);
+    if (!file) {
+        return NULL;
+    }
+    const char* error = NULL;
+    PerfectHashCardIndex* index = PerfectHashCardIndex::open(CardImageMemory::load(file), true, error);
+    file.close();
+
+    if (index != NULL && index->getHeader().generation == generation && index->size() == cardCount) {
+        return index;
+    }
+    delete index;
+    LittleFS.remove(IMAGE_PATH);
+    Serial.print("Discarding card image: ");
+    Serial.println(error != NULL ? error : "set has changed since it was installed");
+    return NULL;
+}
+
+bool CardDatabase::stampImage(const char* path, uint32_t imageGeneration) {
+    File file = LittleFS.open(path, "r+");
+    if (!file) {
+        return false;
+    }
+    PerfectHashCardIndex::ImageHeader header;
+    bool ok = file.read((uint8_t*)&header, sizeof(header)) == sizeof(header);
+    if (ok) {
+        header.generation = imageGeneration;
+        ok = file.seek(0) && file.write((const uint8_t*)&header, sizeof(header)) == sizeof(header);
+    }
+    file.close();
+    return ok;
+}
+
+bool CardDatabase::isFacilityAllowed(uint16_t facility) {
+    std::shared_ptr<const std::vector<uint16_t>> facilities = std::atomic_load(&allowedFacilities);
+    return std::binary_search(facilities->begin(), facilities->end(), facility);
+}
+
+std::vector<uint16_t> CardDatabase::getAllowedFacilities() {
+    return *std::atomic_load(&allowedFacilities);
+}
+
+bool CardDatabase::setAllowedFacilities(std::vector<uint16_t>& facilities) {
+    std::sort(facilities.begin(), facilities.end());
+    facilities.erase(std::unique(facilities.begin(), facilities.end()), facilities.end());
+
+    if (!takeMutex()) return false;
+
+    bool success = saveFacilities(facilities);
+    if (success) {
+        std::shared_ptr<std::vector<uint16_t>> next = std::make_shared<std::vector<uint16_t>>();
+        next->swap(facilities);
+        std::atomic_store(&allowedFacilities, std::shared_ptr<const std::vector<uint16_t>>(next));
+        policyVersion++;
+    } else {
+        Serial.println("Failed to write allowed facilities");
+    }
+
+    giveMutex();
+    return success;
+}
+
+bool CardDatabase::loadFacilities() {
+    if (LittleFS.exists(FACILITIES_TEMP_PATH)) {
+        LittleFS.remove(FACILITIES_TEMP_PATH);
+    }
+    if (!LittleFS.exists(FACILITIES_PATH)) {
+        return true;  // Keep the default
+    }
+
+    File file = LittleFS.open(FACILITIES_PATH, FILE_READ);
+    if (!file) {
+        Serial.println("Failed to open allowed facilities; keeping the default");
+        return true;
+    }
+
+    FacilityHeader header;
+    std::shared_ptr<std::vector<uint16_t>> facilities = std::make_shared<std::vector<uint16_t>>();
+    bool ok = file.read((uint8_t*)&header, sizeof(header)) == sizeof(header) &&
+              header.magic == FACILITIES_MAGIC && header.count <= UINT16_MAX + 1;
+    if (ok) {
+        facilities->resize(header.count);
+        size_t bytes = header.count * sizeof(uint16_t);
+        ok = file.read((uint8_t*)facilities->data(), bytes) == bytes &&
+             crc32(0, (const uint8_t*)facilities->data(), bytes) == header.crc;
+    }
+    file.close();
+    if (!ok) {
+        quarantine(FACILITIES_PATH, "Allowed facilities");
+        return true;  // Keep the default
+    }
+
+    std::atomic_store(&allowedFacilities, std::shared_ptr<const std::vector<uint16_t>>(facilities));
+    Serial.print("Allowed facilities: ");
+    Serial.println(facilities->size());
+    return true;
+}
+
+bool CardDatabase::saveFacilities(const std::vector<uint16_t>& facilities) {
+    size_t bytes = facilities.size() * sizeof(uint16_t);
+    FacilityHeader header = {FACILITIES_MAGIC, (uint32_t)facilities.size(),
+                             crc32(0, (const uint8_t*)facilities.data(), bytes)};
+    return commitFile(FACILITIES_PATH, FACILITIES_TEMP_PATH, [&](File& file) {
+        return file.write((const uint8_t*)&header, sizeof(header)) == sizeof(header) &&
+               file.write((const uint8_t*)facilities.data(), bytes) == bytes;
+    });
+}
+
+bool CardDatabase::setCardMetadata(const CardMetadata::Entry& entry) {
+    return updateMetadata(entry.card, &entry);
+}
+
+bool CardDatabase::removeCardMetadata(CardKey card) {
+    return updateMetadata(card, NULL);
+}
+
+bool CardDatabase::getCardMetadata(CardKey card, CardMetadata::Entry& entry) {
+    if (!takeMutex()) return false;
+
+    std::shared_ptr<const CardMetadata> table = std::atomic_load(&metadata);
+    size_t row = table->find(card);
+    bool found = row != CardMetadata::NOT_FOUND;
+    if (found) {
+        entry.card = card;
+        entry.start = table->getStarts()[row];
+        entry.expiry = table->getExpiries()[row];
+        entry.doors = table->getDoors()[row];
+        entry.schedule = table->getSchedules()[row];
+        File file = LittleFS.open(METADATA_PATH, FILE_READ);
+        readLabel(file, metadataPoolStart, table->getLabels()[row], entry.label);
+        file.close();
+    }
+
+    giveMutex();
+    return found;
+}
+
+bool CardDatabase::listCardMetadata(std::vector<CardMetadata::Entry>& entries) {
+    entries.clear();
+    if (!takeMutex()) return false;
+
+    std::shared_ptr<const CardMetadata> table = std::atomic_load(&metadata);
+    std::vector<String> labels;
+    bool success = readLabels(*table, labels);
+    if (success) {
+        entries.reserve(table->size());
+        for (size_t i = 0; i < table->size(); i++) {
+            entries.push_back({table->getCards()[i], table->getStarts()[i], table->getExpiries()[i],
+                               table->getDoors()[i], table->getSchedules()[i], labels[i]});
+        }
+    }
+
+    giveMutex();
+    return success;
+}
+
+void CardDatabase::readLabel(File& file, uint32_t poolStart, uint32_t offset, String& label) {
+    label = "";
+    char text[CardMetadata::MAX_LABEL + 1];
+    if (offset == CardMetadata::NO_LABEL || !file || !file.seek(poolStart + offset)) {
+        return;
+    }
+    size_t got = file.read((uint8_t*)text, CardMetadata::MAX_LABEL);
+    text[got] = '\0';  // A stored label ends at its own terminator before this
+    label = text;
+}
+
+bool CardDatabase::readLabels(const CardMetadata& table, std::vector<String>& labels) {
+    // The whole pool in one read; only admin views and edits come here
+    labels.assign(table.size(), String());
+    if (table.size() == 0) {
+        return true;
+    }
+
+    File file = LittleFS.open(METADATA_PATH, FILE_READ);
+    if (!file) {
+        return false;
+    }
+    MetadataHeader header;
+    std::vector<char> pool;
+    bool ok = file.read((uint8_t*)&header, sizeof(header)) == sizeof(header) &&
+              (header.magic == METADATA_MAGIC || header.magic == METADATA_MAGIC_V1) && header.count == table.size();
+    if (ok) {
+        pool.resize(header.poolBytes + 1);
+        ok = file.seek(metadataPoolStart) &&
+             file.read((uint8_t*)pool.data(), header.poolBytes) == header.poolBytes;
+        pool[header.poolBytes] = '\0';
+    }
+    file.close();
+    if (!ok) {
+        return false;
+    }
+
+    for (size_t i = 0; i < table.size(); i++) {
+        uint32_t offset = table.getLabels()[i];
+        if (offset < header.poolBytes) {
+            labels[i] = &pool[offset];
+        }
+    }
+    return true;
+}
+
+bool CardDatabase::updateMetadata(CardKey card, const CardMetadata::Entry* entry) {
+    if (!takeMutex()) return false;
+
+    // The table is rebuilt whole, with the other rows' labels carried over
+    // from the old pool, which drops labels no row points at any more
+    std::shared_ptr<const CardMetadata> table = std::atomic_load(&metadata);
+    size_t row = table->find(card);
+    std::vector<String> labels;
+    bool success = readLabels(*table, labels);
+    if (!success) {
+        Serial.println("Failed to read card labels");
+    } else if (entry != NULL && row == CardMetadata::NOT_FOUND && table->size() >= METADATA_MAX_ROWS) {
+        Serial.println("Card metadata table is full");
+        success = false;
+    }
+    if (!success || (entry == NULL && row == CardMetadata::NOT_FOUND)) {
+        giveMutex();
+        return success;
+    }
+
+    std::vector<uint64_t> cards;
+    std::vector<uint32_t> starts;
+    std::vector<uint32_t> expiryDates;
+    std::vector<uint16_t> doors;
+    std::vector<uint8_t> scheduleIds;
+    std::vector<uint32_t> offsets;
+    std::vector<char> pool;
+    auto append = [&](CardKey key, uint32_t start, uint32_t expiry, uint16_t mask, uint8_t schedule,
+                      const String& label) {
+        cards.push_back(key);
+        starts.push_back(start);
+        expiryDates.push_back(expiry);
+        doors.push_back(mask);
+        scheduleIds.push_back(schedule);
+        size_t len = std::min<size_t>(label.length(), CardMetadata::MAX_LABEL);
+        offsets.push_back(len > 0 ? pool.size() : CardMetadata::NO_LABEL);
+        if (len > 0) {
+            pool.insert(pool.end(), label.c_str(), label.c_str() + len);
+            pool.push_back('\0');
+        }
+    };
+    bool placed = entry == NULL;
+    for (size_t i = 0; i < table->size(); i++) {
+        CardKey key = table->getCards()[i];
+        if (!placed && key >= card) {
+            append(card, entry->start, entry->expiry, entry->doors, entry->schedule, entry->label);
+            placed = true;
+        }
+        if (key != card) {
+            append(key, table->getStarts()[i], table->getExpiries()[i], table->getDoors()[i],
+                   table->getSchedules()[i], labels[i]);
+        }
+    }
+    if (!placed) {
+        append(card, entry->start, entry->expiry, entry->doors, entry->schedule, entry->label);
+    }
+
+    MetadataHeader header = {METADATA_MAGIC, (uint32_t)cards.size(), (uint32_t)pool.size(), 0};
+    const std::pair<const void*, size_t> columns[] = {
+        {cards.data(), cards.size() * sizeof(uint64_t)},
+        {starts.data(), starts.size() * sizeof(uint32_t)},
+        {expiryDates.data(), expiryDates.size() * sizeof(uint32_t)},
+        {offsets.data(), offsets.size() * sizeof(uint32_t)},
+        {doors.data(), doors.size() * sizeof(uint16_t)},
+        {scheduleIds.data(), scheduleIds.size() * sizeof(uint8_t)}
+    };
+    for (const auto& column : columns) {
+        header.crc = crc32(header.crc, (const uint8_t*)column.first, column.second);
+    }
+    success = commitFile(METADATA_PATH, METADATA_TEMP_PATH, [&](File& file) {
+        bool ok = file.write((const uint8_t*)&header, sizeof(header)) == sizeof(header);
+        for (const auto& column : columns) {
+            ok = ok && file.write((const uint8_t*)column.first, column.second) == column.second;
+        }
+        return ok && file.write((const uint8_t*)pool.data(), pool.size()) == pool.size();
+    });
+
+    if (success) {
+        metadataPoolStart = sizeof(header) + header.count * METADATA_ROW_BYTES;
+        std::atomic_store(&metadata, std::shared_ptr<const CardMetadata>(
+            std::make_shared<CardMetadata>(cards, starts, expiryDates, doors, scheduleIds, offsets)));
+    } else {
+        Serial.println("Failed to write card metadata");
+    }
+
+    giveMutex();
+    return success;
+}
+
+void CardDatabase::quarantine(const char* path, const char* what) {
+    // Side tables don't hold the card set, so a damaged one shouldn't keep
+    // the door down: it's moved aside for inspection, the table starts
+    // empty, and the next change writes a fresh file
+    String badPath = path;
+    badPath += ".bad";
+    if (LittleFS.exists(badPath.c_str())) {
+        LittleFS.remove(badPath.c_str());
+    }
+    bool moved = LittleFS.rename(path, badPath.c_str());
+    Serial.print(what);
+    Serial.print(" file is corrupt; ");
+    Serial.print(moved ? "moved to " : "failed to move it to ");
+    Serial.print(badPath);
+    Serial.println(", starting without it");
+}
+
+bool CardDatabase::loadMetadata() {
+    if (LittleFS.exists(METADATA_TEMP_PATH)) {
+        LittleFS.remove(METADATA_TEMP_PATH);
+    }
+    if (!LittleFS.exists(METADATA_PATH)) {
+        return true;  // No rows
+    }
+
+    File file = LittleFS.open(METADATA_PATH, FILE_READ);
+    if (!file) {
+        Serial.println("Failed to open card metadata; starting without it");
+        return true;
+    }
+
+    // Columns only; the label pool after them stays on flash
+    MetadataHeader header;
+    std::vector<uint64_t> cards;
+    std::vector<uint32_t> starts;
+    std::vector<uint32_t> expiryDates;
+    std::vector<uint16_t> doors;
+    std::vector<uint8_t> scheduleIds;
+    std::vector<uint32_t> labels;
+    bool ok = file.read((uint8_t*)&header, sizeof(header)) == sizeof(header) &&
+              (header.magic == METADATA_MAGIC || header.magic == METADATA_MAGIC_V1) &&
+              header.count <= METADATA_MAX_ROWS;
+    uint32_t crc = 0;
+    auto column = [&](void* data, size_t bytes) {
+        ok = ok && file.read((uint8_t*)data, bytes) == bytes;
+        crc = crc32(crc, (const uint8_t*)data, bytes);
+    };
+    if (ok) {
+        cards.resize(header.count);
+        starts.resize(header.count);
+        expiryDates.resize(header.count);
+        labels.resize(header.count);
+        doors.resize(header.count);
+        scheduleIds.resize(header.count, AccessSchedules::NONE);
+        column(cards.data(), header.count * sizeof(uint64_t));
+        column(starts.data(), header.count * sizeof(uint32_t));
+        column(expiryDates.data(), header.count * sizeof(uint32_t));
+        column(labels.data(), header.count * sizeof(uint32_t));
+        column(doors.data(), header.count * sizeof(uint16_t));
+        if (header.magic == METADATA_MAGIC) {
+            column(scheduleIds.data(), header.count * sizeof(uint8_t));
+        }
+    }
+    file.close();
+    if (!ok || crc != header.crc ||
+        std::adjacent_find(cards.begin(), cards.end(), std::greater_equal<uint64_t>()) != cards.end()) {
+        quarantine(METADATA_PATH, "Card metadata");
+        return true;
+    }
+
+    metadataPoolStart = sizeof(header) + header.count *
+        (header.magic == METADATA_MAGIC ? METADATA_ROW_BYTES : METADATA_V1_ROW_BYTES);
+    std::atomic_store(&metadata, std::shared_ptr<const CardMetadata>(
+        std::make_shared<CardMetadata>(cards, starts, expiryDates, doors, scheduleIds, labels)));
+    Serial.print("Card metadata rows: ");
+    Serial.println(header.count);
+    return true;
+}
+
+std::shared_ptr<const AccessSchedules> CardDatabase::getSchedules() {
+    return std::atomic_load(&schedules);
+}
+
+bool CardDatabase::setSchedule(uint8_t id, const std::string& name, const AccessSchedules::Week& week) {
+    if (!takeMutex()) return false;
+
+    std::shared_ptr<AccessSchedules> next = std::make_shared<AccessSchedules>(*std::atomic_load(&schedules));
+    next->set(id, name, week);
+    bool success = publishSchedules(next);
+
+    giveMutex();
+    return success;
+}
+
+bool CardDatabase::removeSchedule(uint8_t id) {
+    if (!takeMutex()) return false;
+
+    std::shared_ptr<AccessSchedules> next = std::make_shared<AccessSchedules>(*std::atomic_load(&schedules));
+    next->remove(id);
+    bool success = publishSchedules(next);
+
+    giveMutex();
+    return success;
+}
+
+bool CardDatabase::setHolidays(std::vector<uint32_t>& dates) {
+    if (!takeMutex()) return false;
+
+    std::shared_ptr<AccessSchedules> next = std::make_shared<AccessSchedules>(*std::atomic_load(&schedules));
+    next->setHolidays(dates);
+    bool success = publishSchedules(next);
+
+    giveMutex();
+    return success;
+}
+
+bool CardDatabase::publishSchedules(std::shared_ptr<AccessSchedules> next) {
+    std::vector<ScheduleRecord> records;
+    for (uint8_t id = 1; id <= AccessSchedules::MAX_SCHEDULES; id++) {
+        if (next->has(id)) {
+            ScheduleRecord record = {};
+            record.id = id;
+            strncpy(record.name, next->getName(id).c_str(), AccessSchedules::MAX_NAME);
+            record.week = next->getWeek(id);
+            records.push_back(record);
+        }
+    }
+    const std::vector<uint32_t>& holidays = next->getHolidays();
+    size_t recordBytes = records.size() * sizeof(ScheduleRecord);
+    size_t holidayBytes = holidays.size() * sizeof(uint32_t);
+    ScheduleHeader header = {SCHEDULES_MAGIC, (uint32_t)records.size(), (uint32_t)holidays.size(), 0};
+    header.crc = crc32(crc32(0, (const uint8_t*)records.data(), recordBytes), (const uint8_t*)holidays.data(),
+                       holidayBytes);
+
+    bool success = commitFile(SCHEDULES_PATH, SCHEDULES_TEMP_PATH, [&](File& file) {
+        return file.write((const uint8_t*)&header, sizeof(header)) == sizeof(header) &&
+               file.write((const uint8_t*)records.data(), recordBytes) == recordBytes &&
+               file.write((const uint8_t*)holidays.data(), holidayBytes) == holidayBytes;
+    });
+    if (!success) {
+        Serial.println("Failed to write access schedules");
+        return false;
+    }
+
+    std::atomic_store(&schedules, std::shared_ptr<const AccessSchedules>(next));
+    scheduleVersion++;
+    return true;
+}
+
+bool CardDatabase::loadSchedules() {
+    if (LittleFS.exists(SCHEDULES_TEMP_PATH)) {
+        LittleFS.remove(SCHEDULES_TEMP_PATH);
+    }
+    if (!LittleFS.exists(SCHEDULES_PATH)) {
+        return true;  // No schedules or holidays
+    }
+
+    File file = LittleFS.open(SCHEDULES_PATH, FILE_READ);
+    if (!file) {
+        Serial.println("Failed to open access schedules; starting without them");
+        return true;
+    }
+
+    ScheduleHeader header;
+    std::vector<ScheduleRecord> records;
+    std::vector<uint32_t> holidays;
+    bool ok = file.read((uint8_t*)&header, sizeof(header)) == sizeof(header) && header.magic == SCHEDULES_MAGIC &&
+              header.count <= AccessSchedules::MAX_SCHEDULES && header.holidayCount <= AccessSchedules::MAX_HOLIDAYS;
+    if (ok) {
+        records.resize(header.count);
+        holidays.resize(header.holidayCount);
+        size_t recordBytes = header.count * sizeof(ScheduleRecord);
+        size_t holidayBytes = header.holidayCount * sizeof(uint32_t);
+        ok = file.read((uint8_t*)records.data(), recordBytes) == recordBytes &&
+             file.read((uint8_t*)holidays.data(), holidayBytes) == holidayBytes &&
+             crc32(crc32(0, (const uint8_t*)records.data(), recordBytes), (const uint8_t*)holidays.data(),
+                   holidayBytes) == header.crc;
+    }
+    file.close();
+
+    std::shared_ptr<AccessSchedules> table = std::make_shared<AccessSchedules>();
+    for (size_t i = 0; ok && i < records.size(); i++) {
+        ScheduleRecord& record = records[i];
+        record.name[AccessSchedules::MAX_NAME] = '\0';
+        ok = record.id != AccessSchedules::NONE && record.id <= AccessSchedules::MAX_SCHEDULES;
+        if (ok) {
+            table->set(record.id, record.name, record.week);
+        }
+    }
+    if (!ok) {
+        quarantine(SCHEDULES_PATH, "Access schedules");
+        return true;
+    }
+    table->setHolidays(holidays);
+
+    std::atomic_store(&schedules, std::shared_ptr<const AccessSchedules>(table));
+    scheduleVersion++;
+    Serial.print("Access schedules: ");
+    Serial.println(header.count);
+    return true;
+}
+
+bool CardDatabase::addCardRange(CardKey first, CardKey last) {
+    if (!takeMutex()) return false;
+    CardRanges* next = std::atomic_load(&ranges)->with(first, last);
+    if (next == NULL) {
+        Serial.println("Card range table is full");
+    }
+    bool success = next != NULL && publishRanges(next);
+    giveMutex();
+    return success;
+}
+
+bool CardDatabase::removeCardRange(CardKey first, CardKey last) {
+    if (!takeMutex()) return false;
+    CardRanges* next = std::atomic_load(&ranges)->without(first, last);
+    if (next == NULL) {
+        Serial.println("Card range table is full");
+    }
+    bool success = next != NULL && publishRanges(next);
+    giveMutex();
+    return success;
+}
+
+std::shared_ptr<const CardRanges> CardDatabase::getCardRanges() {
+    return std::atomic_load(&ranges);
+}
+
+bool CardDatabase::publishRanges(CardRanges* next) {
+    std::shared_ptr<const CardRanges> table(next);
+    size_t bytes = table->size() * sizeof(uint64_t);
+    RangeHeader header = {RANGES_MAGIC, (uint32_t)table->size(), 0};
+    header.crc = crc32(crc32(0, (const uint8_t*)table->getFirsts().data(), bytes),
+                       (const uint8_t*)table->getLasts().data(), bytes);
+
+    bool success = commitFile(RANGES_PATH, RANGES_TEMP_PATH, [&](File& file) {
+        return file.write((const uint8_t*)&header, sizeof(header)) == sizeof(header) &&
+               file.write((const uint8_t*)table->getFirsts().data(), bytes) == bytes &&
+               file.write((const uint8_t*)table->getLasts().data(), bytes) == bytes;
+    });
+    if (!success) {
+        Serial.println("Failed to write card ranges");
+        return false;
+    }
+
+    std::atomic_store(&ranges, table);
+    policyVersion++;
+    return true;
+}
+
+bool CardDatabase::loadRanges() {
+    if (LittleFS.exists(RANGES_TEMP_PATH)) {
+        LittleFS.remove(RANGES_TEMP_PATH);
+    }
+    if (!LittleFS.exists(RANGES_PATH)) {
+        return true;  // No ranges
+    }
+
+    File file = LittleFS.open(RANGES_PATH, FILE_READ);
+    if (!file) {
+        Serial.println("Failed to open card ranges; starting without them");
+        return true;
+    }
+
+    RangeHeader header;
+    std::vector<uint64_t> firsts;
+    std::vector<uint64_t> lasts;
+    bool ok = file.read((uint8_t*)&header, sizeof(header)) == sizeof(header) && header.magic == RANGES_MAGIC &&
+              header.count <= CardRanges::MAX_RANGES;
+    if (ok) {
+        firsts.resize(header.count);
+        lasts.resize(header.count);
+        size_t bytes = header.count * sizeof(uint64_t);
+        ok = file.read((uint8_t*)firsts.data(), bytes) == bytes && file.read((uint8_t*)lasts.data(), bytes) == bytes &&
+             crc32(crc32(0, (const uint8_t*)firsts.data(), bytes), (const uint8_t*)lasts.data(), bytes) == header.crc;
+    }
+    file.close();
+    for (size_t i = 0; ok && i < firsts.size(); i++) {
+        ok = firsts[i] <= lasts[i] && (i == 0 || lasts[i - 1] < firsts[i]);
+    }
+    if (!ok) {
+        quarantine(RANGES_PATH, "Card ranges");
+        return true;
+    }
+
+    std::atomic_store(&ranges, std::shared_ptr<const CardRanges>(std::make_shared<CardRanges>(firsts, lasts)));
+    Serial.print("Card ranges: ");
+    Serial.println(header.count);
+    return true;
+}
+
+void CardDatabase::setRevokeHandler(RevokeHandler handler) {
+    revokeHandler = handler;
+}
+
+bool CardDatabase::setCardExpiry(CardKey card, uint32_t expiresAt) {
+    if (!takeMutex()) return false;
+
+    std::map<CardKey, uint32_t>::iterator it = expiries.find(card);
+    uint32_t previous = it != expiries.end() ? it->second : 0;
+    bool success = true;
+    if (expiresAt != previous) {
+        if (previous == 0 && expiries.size() >= EXPIRY_MAX) {
+            Serial.println("Card expiry table is full");
+            success = false;
+        } else {
+            if (expiresAt == 0) {
+                expiries.erase(it);
+            } else {
+                expiries[card] = expiresAt;
+            }
+            success = saveExpiries();
+            if (!success) {
+                if (previous == 0) {
+                    expiries.erase(card);
+                } else {
+                    expiries[card] = previous;
+                }
+            } else if (expiresAt != 0) {
+                pushExpiry(card, expiresAt);
+            }
+        }
+    }
+
+    giveMutex();
+    // The writer task works out its sleep again
+    if (success && expiresAt != 0 && writerTaskHandle != NULL) {
+        xTaskNotifyGive(writerTaskHandle);
+    }
+    return success;
+}
+
+uint32_t CardDatabase::getCardExpiry(CardKey card) {
+    if (!takeMutex()) return 0;
+    std::map<CardKey, uint32_t>::iterator it = expiries.find(card);
+    uint32_t expiresAt = it != expiries.end() ? it->second : 0;
+    giveMutex();
+    return expiresAt;
+}
+
+std::vector<std::pair<CardDatabase::CardKey, uint32_t>> CardDatabase::listCardExpiries() {
+    std::vector<std::pair<CardKey, uint32_t>> list;
+    if (!takeMutex()) return list;
+    list.assign(expiries.begin(), expiries.end());
+    giveMutex();
+    return list;
+}
+
+bool CardDatabase::isPendingExpiry(const PendingExpiry& entry) {
+    std::map<CardKey, uint32_t>::iterator it = expiries.find(entry.card);
+    return it != expiries.end() && it->second == entry.expiresAt;
+}
+
+void CardDatabase::pushExpiry(CardKey card, uint32_t expiresAt) {
+    // Superseded entries are dropped once they outnumber the live ones
+    if (expiryHeap.size() >= 2 * expiries.size() + 16) {
+        expiryHeap.clear();
+        for (const std::pair<const CardKey, uint32_t>& expiry : expiries) {
+            expiryHeap.push_back({expiry.second, expiry.first});
+        }
+        std::make_heap(expiryHeap.begin(), expiryHeap.end(), std::greater<PendingExpiry>());
+    } else {
+        expiryHeap.push_back({expiresAt, card});
+        std::push_heap(expiryHeap.begin(), expiryHeap.end(), std::greater<PendingExpiry>());
+    }
+}
+
+TickType_t CardDatabase::expiryWait() {
+    if (!takeMutex()) return pdMS_TO_TICKS(EXPIRY_POLL_MS);
+
+    // Superseded entries on top are dropped, so the wait runs to the next
+    // expiry that still applies
+    while (!expiryHeap.empty() && !isPendingExpiry(expiryHeap.front())) {
+        std::pop_heap(expiryHeap.begin(), expiryHeap.end(), std::greater<PendingExpiry>());
+        expiryHeap.pop_back();
+    }
+    TickType_t wait = portMAX_DELAY;
+    if (!expiryHeap.empty()) {
+        time_t now = time(NULL);
+        uint32_t next = expiryHeap.front().expiresAt;
+        uint32_t sinceFailure = millis() - revokeFailedAt;
+        if (now < CLOCK_VALID_AFTER) {
+            wait = pdMS_TO_TICKS(EXPIRY_POLL_MS);
+        } else if (revokeFailed && sinceFailure < REVOKE_RETRY_MS) {
+            wait = pdMS_TO_TICKS(REVOKE_RETRY_MS - sinceFailure);
+        } else if (next <= now) {
+            wait = 0;
+        } else {
+            wait = pdMS_TO_TICKS(std::min<uint64_t>((next - now) * 1000ULL, EXPIRY_POLL_MS));
+        }
+    }
+
+    giveMutex();
+    return wait;
+}
+
+size_t CardDatabase::revokeExpired() {
+    if (!takeMutex()) return 0;
+
+    // Only the top of the heap is looked at, O(log n) per card popped
+    time_t now = time(NULL);
+    std::vector<PendingExpiry> due;
+    while (now >= CLOCK_VALID_AFTER && !expiryHeap.empty() && expiryHeap.front().expiresAt <= now &&
+           due.size() < REVOKE_BATCH) {
+        PendingExpiry top = expiryHeap.front();
+        std::pop_heap(expiryHeap.begin(), expiryHeap.end(), std::greater<PendingExpiry>());
+        expiryHeap.pop_back();
+        if (isPendingExpiry(top)) {
+            due.push_back(top);
+        }
+    }
+    giveMutex();
+    if (due.empty()) {
+        return 0;
+    }
+
+    // The cards go first, in one journal commit, then the expiries; a
+    // reboot in between just revokes them again
+    std::vector<CardKey> cards;
+    for (const PendingExpiry& expiry : due) {
+        cards.push_back(expiry.card);
+    }
+    std::sort(cards.begin(), cards.end());
+    cards.erase(std::unique(cards.begin(), cards.end()), cards.end());
+    // Cards already gone, such as removed in bulk, just lose their expiry
+    std::vector<CardKey> removed;
+    bool success = removeCards(cards, removed) && flush();
+
+    if (!takeMutex()) return 0;
+    revokeFailed = !success;
+    if (!success) {
+        // The writer task waits REVOKE_RETRY_MS before trying again
+        Serial.println("Failed to revoke expired cards");
+        revokeFailedAt = millis();
+        for (const PendingExpiry& expiry : due) {
+            pushExpiry(expiry.card, expiry.expiresAt);
+        }
+        giveMutex();
+        return 0;
+    }
+    for (const PendingExpiry& expiry : due) {
+        // Unless it was set again meanwhile
+        std::map<CardKey, uint32_t>::iterator it = expiries.find(expiry.card);
+        if (it != expiries.end() && it->second == expiry.expiresAt) {
+            expiries.erase(it);
+        }
+    }
+    if (!saveExpiries()) {
+        Serial.println("Failed to write card expiries");
+    }
+    expiriesRevoked += removed.size();
+    giveMutex();
+
+    if (revokeHandler) {
+        for (CardKey card : removed) {
+            revokeHandler(card);
+        }
+    }
+    return removed.size();
+}
+
+bool CardDatabase::saveExpiries() {
+    std::vector<ExpiryRecord> records;
+    records.reserve(expiries.size());
+    for (const std::pair<const CardKey, uint32_t>& expiry : expiries) {
+        records.push_back({expiry.first, expiry.second, 0});
+    }
+    size_t bytes = records.size() * sizeof(ExpiryRecord);
+    ExpiryHeader header = {EXPIRY_MAGIC, (uint32_t)records.size(), crc32(0, (const uint8_t*)records.data(), bytes)};
+
+    return commitFile(EXPIRY_PATH, EXPIRY_TEMP_PATH, [&](File& file) {
+        return file.write((const uint8_t*)&header, sizeof(header)) == sizeof(header) &&
+               file.write((const uint8_t*)records.data(), bytes) == bytes;
+    });
+}
+
+bool CardDatabase::loadExpiries() {
+    if (LittleFS.exists(EXPIRY_TEMP_PATH)) {
+        LittleFS.remove(EXPIRY_TEMP_PATH);
+    }
+    if (!LittleFS.exists(EXPIRY_PATH)) {
+        return true;  // No guest cards
+    }
+
+    File file = LittleFS.open(EXPIRY_PATH, FILE_READ);
+    if (!file) {
+        Serial.println("Failed to open card expiries; starting without them");
+        return true;
+    }
+
+    ExpiryHeader header;
+    std::vector<ExpiryRecord> records;
+    bool ok = file.read((uint8_t*)&header, sizeof(header)) == sizeof(header) && header.magic == EXPIRY_MAGIC &&
+              header.count <= EXPIRY_MAX;
+    if (ok) {
+        records.resize(header.count);
+        size_t bytes = header.count * sizeof(ExpiryRecord);
+        ok = file.read((uint8_t*)records.data(), bytes) == bytes &&
+             crc32(0, (const uint8_t*)records.data(), bytes) == header.crc;
+    }
+    file.close();
+    if (!ok) {
+        quarantine(EXPIRY_PATH, "Card expiry");
+        return true;
+    }
+
+    // Anything that fell due while powered off goes at the writer task's
+    // first wake
+    expiries.clear();
+    expiryHeap.clear();
+    for (const ExpiryRecord& record : records) {
+        expiries[record.card] = record.expiresAt;
+        expiryHeap.push_back({record.expiresAt, record.card});
+    }
+    std::make_heap(expiryHeap.begin(), expiryHeap.end(), std::greater<PendingExpiry>());
+    Serial.print("Card expiries pending: ");
+    Serial.println(expiries.size());
+    return true;
+}
+
+uint32_t CardDatabase::getGeneration() {
+    return getSnapshot()->generation;
+}
+
+void CardDatabase::recordUsage(CardKey card) {
+    time_t now = time(NULL);
+    if (xSemaphoreTake(usageMutex, portMAX_DELAY) != pdTRUE) return;
+    if (usage.record(card, now < CLOCK_VALID_AFTER ? 0 : (uint32_t)now)) {
+        usageDirty = true;
+    } else {
+        usageUntracked++;
+    }
+    xSemaphoreGive(usageMutex);
+}
+
+std::vector<CardUsage::Entry> CardDatabase::listCardUsage() {
+    std::vector<CardUsage::Entry> entries;
+    if (xSemaphoreTake(usageMutex, portMAX_DELAY) != pdTRUE) return entries;
+    entries.reserve(usage.size());
+    for (size_t row = 0; row < usage.size(); row++) {
+        entries.push_back(usage.getEntry(row));
+    }
+    xSemaphoreGive(usageMutex);
+    return entries;
+}
+
+bool CardDatabase::saveUsage() {
+    if (!takeMutex()) return false;
+    bool success = writeUsage();
+    giveMutex();
+    return success;
+}
+
+bool CardDatabase::writeUsage() {
+    if (xSemaphoreTake(usageMutex, portMAX_DELAY) != pdTRUE) return false;
+    if (!usageDirty) {
+        xSemaphoreGive(usageMutex);
+        return true;
+    }
+    // Cards removed since the last save go now, then the columns are
+    // copied so swipes can carry on while they're written
+    Snapshot set = getSnapshot();
+    std::shared_ptr<const CardRanges> rangeTable = std::atomic_load(&ranges);
+    usage.prune([&](CardKey card) { return set->contains(card) || rangeTable->contains(card); });
+    std::vector<uint64_t> cards = usage.getCards();
+    std::vector<uint32_t> lastSeen = usage.getLastSeen();
+    std::vector<uint32_t> counts = usage.getCounts();
+    usageDirty = false;
+    usageSavedAt = millis();
+    xSemaphoreGive(usageMutex);
+
+    UsageHeader header = {USAGE_MAGIC, (uint32_t)cards.size(), 0};
+    header.crc = crc32(crc32(crc32(0, (const uint8_t*)cards.data(), cards.size() * sizeof(uint64_t)),
+                             (const uint8_t*)lastSeen.data(), lastSeen.size() * sizeof(uint32_t)),
+                       (const uint8_t*)counts.data(), counts.size() * sizeof(uint32_t));
+
+    // In one sequential write of the three columns
+    bool success = commitFile(USAGE_PATH, USAGE_TEMP_PATH, [&](File& file) {
+        return file.write((const uint8_t*)&header, sizeof(header)) == sizeof(header) &&
+               file.write((const uint8_t*)cards.data(), cards.size() * sizeof(uint64_t)) ==
+                   cards.size() * sizeof(uint64_t) &&
+               file.write((const uint8_t*)lastSeen.data(), lastSeen.size() * sizeof(uint32_t)) ==
+                   lastSeen.size() * sizeof(uint32_t) &&
+               file.write((const uint8_t*)counts.data(), counts.size() * sizeof(uint32_t)) ==
+                   counts.size() * sizeof(uint32_t);
+    });
+    if (!success) {
+        // Tried again at the next save
+        Serial.println("Failed to write card usage");
+        usageDirty = true;
+        return false;
+    }
+    usageSaves++;
+    return true;
+}
+
+bool CardDatabase::loadUsage() {
+    if (LittleFS.exists(USAGE_TEMP_PATH)) {
+        LittleFS.remove(USAGE_TEMP_PATH);
+    }
+    if (!LittleFS.exists(USAGE_PATH)) {
+        return true;  // No swipes counted yet
+    }
+
+    File file = LittleFS.open(USAGE_PATH, FILE_READ);
+    UsageHeader header;
+    std::vector<uint64_t> cards;
+    std::vector<uint32_t> lastSeen;
+    std::vector<uint32_t> counts;
+    bool ok = file && file.read((uint8_t*)&header, sizeof(header)) == sizeof(header) &&
+              header.magic == USAGE_MAGIC && header.count <= CardUsage::MAX_ROWS;
+    if (ok) {
+        cards.resize(header.count);
+        lastSeen.resize(header.count);
+        counts.resize(header.count);
+        size_t keyBytes = header.count * sizeof(uint64_t);
+        size_t valueBytes = header.count * sizeof(uint32_t);
+        ok = file.read((uint8_t*)cards.data(), keyBytes) == keyBytes &&
+             file.read((uint8_t*)lastSeen.data(), valueBytes) == valueBytes &&
+             file.read((uint8_t*)counts.data(), valueBytes) == valueBytes &&
+             crc32(crc32(crc32(0, (const uint8_t*)cards.data(), keyBytes), (const uint8_t*)lastSeen.data(), valueBytes),
+                   (const uint8_t*)counts.data(), valueBytes) == header.crc;
+    }
+    if (file) {
+        file.close();
+    }
+    for (size_t i = 1; ok && i < cards.size(); i++) {
+        ok = cards[i - 1] < cards[i];
+    }
+    if (!ok) {
+        // Only statistics, so the door still comes up, counting afresh
+        Serial.println("Card usage file is corrupt; starting over");
+        return true;
+    }
+
+    usage.assign(cards, lastSeen, counts);
+    usageSavedAt = millis();
+    Serial.print("Card usage rows: ");
+    Serial.println(header.count);
+    return true;
+}
+
+TickType_t CardDatabase::usageWait() {
+    if (!usageDirty) {
+        return portMAX_DELAY;
+    }
+    uint32_t elapsed = millis() - usageSavedAt;
+    return elapsed >= USAGE_SAVE_MS ? 0 : pdMS_TO_TICKS(USAGE_SAVE_MS - elapsed);
+}
+
+CardDatabase::Stats CardDatabase::getStats() {
+    Stats stats = {};
+    Snapshot set = getSnapshot();
+    stats.cardCount = set->size();
+    stats.importLimit = CardImport::getLimit();
+    stats.indexType = CardIndex::typeName(set->index->getType());
+    stats.indexBytes = set->index->getMemoryUsage();
+    stats.indexProbes = set->index->getAverageProbes();
+    stats.indexMicros = indexMicros;
+    stats.generation = set->generation;
+    stats.filterSlots = set->filter.getCapacity();
+    stats.filterBytes = set->filter.getMemoryUsage();
+    stats.filterFillRatio = set->filter.getFillRatio();
+    stats.filterFalsePositiveRate = set->filter.getFalsePositiveRate();
+    stats.lookups = lookups;
+    stats.filterRejects = filterRejects;
+    stats.filterFalsePositives = filterFalsePositives;
+    stats.cacheEntries = accessCache.size();
+    stats.cacheCapacity = AccessCache::CAPACITY;
+    stats.cacheHits = accessCache.getHits();
+    stats.cacheMisses = accessCache.getMisses();
+    stats.cacheEvictions = accessCache.getEvictions();
+    stats.cacheInvalidations = accessCache.getInvalidations();
+    std::shared_ptr<const CardMetadata> table = std::atomic_load(&metadata);
+    stats.metadataRows = table->size();
+    stats.metadataBytes = table->getMemoryUsage();
+    std::shared_ptr<const CardRanges> rangeTable = std::atomic_load(&ranges);
+    stats.rangeCount = rangeTable->size();
+    stats.rangeCards = rangeTable->getCardCount();
+    stats.rangeBytes = rangeTable->getMemoryUsage();
+    std::shared_ptr<const AccessSchedules> scheduleTable = std::atomic_load(&schedules);
+    stats.scheduleCount = scheduleTable->size();
+    stats.holidayCount = scheduleTable->getHolidays().size();
+    if (!takeMutex()) return stats;
+
+    stats.journalRecords = journalRecords;
+    stats.compactions = compactions;
+    stats.mutations = mutations;
+    stats.journalBytesWritten = journalBytesWritten;
+    stats.snapshotBytesWritten = snapshotBytesWritten;
+    stats.batchedRecords = batch.size();
+    stats.flashCommits = flashCommits;
+    stats.recoveryMicros = recoveryMicros;
+    stats.journalBytesDiscarded = journalBytesDiscarded;
+    stats.rolledBack = rolledBack;
+    stats.commitsPerSecond = millis() - commitRateStart < 2 * COMMIT_RATE_WINDOW_MS ? commitsPerSecond : 0.0f;
+    stats.filterUpdates = filterUpdates;
+    stats.filterRebuilds = filterRebuilds;
+    stats.expiriesPending = expiries.size();
+    stats.expiriesRevoked = expiriesRevoked;
+
+    giveMutex();
+
+    if (xSemaphoreTake(usageMutex, portMAX_DELAY) == pdTRUE) {
+        stats.usageRows = usage.size();
+        stats.usageBytes = usage.getMemoryUsage();
+        stats.usageUntracked = usageUntracked;
+        stats.usageSaves = usageSaves;
+        xSemaphoreGive(usageMutex);
+    }
+    return stats;
+}
+
+size_t CardDatabase::CardImport::getLimit() {
+    return heap_caps_get_largest_free_block(MALLOC_CAP_8BIT) / (2 * sizeof(CardKey));
+}
+
+CardDatabase::CardImport::CardImport()
+    : format(Format::UNKNOWN), error(NULL), maxCards(getLimit()), fields{0, 0, 0}, fieldCount(0), digits(0), keyEnded(false),
+      record(0), recordBytes(0), recordSize(0), headerBytes(0), crc(0) {
+}
+
+bool CardDatabase::CardImport::fail(const char* message) {
+    if (error == NULL) {
+        error = message;
+    }
+    cards.clear();
+    return false;
+}
+
+bool CardDatabase::CardImport::push(CardKey card) {
+    if (cards.size() >= maxCards) {
+        return fail("Too many cards");
+    }
+    cards.push_back(card);
+    return true;
+}
+
+bool CardDatabase::CardImport::endLine() {
+    keyEnded = false;
+    if (digits == 0) {
+        // Blank lines are skipped; a dangling ':' is an error
+        return fieldCount == 0 || fail("Invalid card key in card list");
+    }
+
+    CardKey key;
+    bool ok = fieldsToKey(fields, fieldCount + 1, key);
+    fields[0] = fields[1] = fields[2] = 0;
+    fieldCount = 0;
+    digits = 0;
+    if (!ok) {
+        return fail("Card key out of range");
+    }
+    // Card 0 is never issued; older lists used it as filler
+    return keyCard(key) == 0 || push(key);
+}
+
+bool CardDatabase::CardImport::feed(const uint8_t* data, size_t len) {
+    static_assert(sizeof(header) == sizeof(FileHeader), "CardImport header buffer size");
+    if (error != NULL) return false;
+    if (len == 0) return true;
+
+    if (format == Format::UNKNOWN) {
+        // Binary images start with the magic, text with a digit or whitespace
+        format = data[0] == (FILE_MAGIC & 0xff) ? Format::BINARY : Format::TEXT;
+    }
+
+    size_t i = 0;
+    if (format == Format::BINARY) {
+        while (i < len && headerBytes < sizeof(header)) {
+            header[headerBytes++] = data[i++];
+            if (headerBytes == sizeof(header)) {
+                FileHeader h;
+                memcpy(&h, header, sizeof(h));
+                bool current = h.version == FILE_VERSION && h.recordSize == RECORD_SIZE;
+                bool legacy = h.version == 2 && h.recordSize == LEGACY_RECORD_SIZE;
+                if (h.magic != FILE_MAGIC || !(current || legacy)) {
+                    return fail("Unsupported card file format");
+                }
+                if (h.count > maxCards) {
+                    return fail("Too many cards");
+                }
+                recordSize = h.recordSize;
+                cards.reserve(h.count);
+            }
+        }
+        crc = crc32(crc, data + i, len - i);
+        for (; i < len; i++) {
+            record |= (uint64_t)data[i] << (8 * recordBytes);
+            if (++recordBytes == recordSize) {
+                if (recordSize == LEGACY_RECORD_SIZE) {
+                    record = makeKey(DEFAULT_FORMAT, LEGACY_FACILITY, (uint32_t)record);
+                }
+                if (!push(record)) return false;
+                record = 0;
+                recordBytes = 0;
+            }
+        }
+        return true;
+    }
+
+    // Whitespace may surround a key but ends it, so "123 456" is rejected
+    // rather than read as one card
+    for (; i < len; i++) {
+        uint8_t c = data[i];
+        if (keyEnded && (c == ':' || (c >= '0' && c <= '9'))) {
+            return fail("Invalid card key in card list");
+        }
+        if (c >= '0' && c <= '9') {
+            if (fields[fieldCount] > (UINT32_MAX - 9) / 10) {
+                return fail("Card number out of range");
+            }
+            fields[fieldCount] = fields[fieldCount] * 10 + (c - '0');
+            digits++;
+        } else if (c == ':') {
+            if (digits == 0 || fieldCount == 2) {
+                return fail("Invalid card key in card list");
+            }
+            fieldCount++;
+            digits = 0;
+        } else if (c == '\n') {
+            if (!endLine()) return false;
+        } else if (c == '\r' || c == ' ' || c == '\t') {
+            keyEnded = digits > 0 || fieldCount > 0;
+        } else {
+            return fail("Invalid character in card list");
+        }
+    }
+    return true;
+}
+
+bool CardDatabase::CardImport::finish() {
+    if (error != NULL) return false;
+
+    if (format == Format::BINARY) {
+        FileHeader h;
+        memcpy(&h, header, sizeof(h));
+        if (headerBytes < sizeof(header) || recordBytes != 0 || cards.size() != h.count) {
+            return fail("Truncated card file");
+        }
+        if (crc != h.crc) {
+            return fail("Card file CRC mismatch");
+        }
+    } else if (!endLine()) {
+        return false;
+    }
+
+    std::sort(cards.begin(), cards.end());
+    cards.erase(std::unique(cards.begin(), cards.end()), cards.end());
+    return true;
+}
@@ -4,32 +4,738 @@
 #include <LittleFS.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <atomic>
+#include <bitset>
+#include <functional>
+#include <map>
+#include <memory>
+#include <vector>
+#include "access_cache.h"
+#include "card_index.h"
+#include "card_metadata.h"
+#include "card_ranges.h"
+#include "card_usage.h"
+#include "crc32.h"
+#include "cuckoo_filter.h"
 
 class CardDatabase {
 public:
-    CardDatabase();
+    // The index type picks how the card set is held in RAM for lookups;
+    // the on-flash format is the same for all of them
+    explicit CardDatabase(CardIndex::Type indexType = CardIndex::SORTED);
     ~CardDatabase();
 
     // Initialize the database
     bool begin();
 
+    // Cards are keyed on the Wiegand format (bit count), facility code and
+    // card number packed into one 64-bit value, so the same card number on
+    // two facilities' badge stock never collides and a lookup is a single
+    // probe. The text form is "facility:card" for 26-bit cards and
+    // "format:facility:card" otherwise; a bare card number means a 26-bit
+    // card from LEGACY_FACILITY, which is what databases from before
+    // composite keys are migrated to.
+    typedef uint64_t CardKey;
+    static constexpr uint16_t DEFAULT_FORMAT = 26;
+    static constexpr uint16_t LEGACY_FACILITY = 198;
+    static constexpr size_t KEY_TEXT_SIZE = 24;  // "65535:65535:4294967295" and terminator
+
+    static CardKey makeKey(uint16_t format, uint16_t facility, uint32_t card) {
+        return ((uint64_t)format << 48) | ((uint64_t)facility << 32) | card;
+    }
+    static uint16_t keyFormat(CardKey key) { return key >> 48; }
+    static uint16_t keyFacility(CardKey key) { return key >> 32; }
+    static uint32_t keyCard(CardKey key) { return (uint32_t)key; }
+
+    // Text conversion; formatKey's buffer must hold KEY_TEXT_SIZE bytes and
+    // it returns the length written
+    static bool parseKey(const char* text, CardKey& key);
+    static size_t formatKey(CardKey key, char* buffer);
+
+    // Immutable view of the card set. Lookups load the current snapshot
+    // through an atomically swapped shared_ptr and never take the mutex, so
+    // admin traffic can't stall or fail a swipe; writers build the next set
+    // off to the side and publish it once it is committed to flash. A
+    // snapshot stays valid for as long as someone holds it.
+    struct CardSet {
+        std::unique_ptr<const CardIndex> index;
+        uint32_t generation;
+        CuckooFilter filter;  // Holds the same keys; checked before the index unless empty
+
+        // See getDigest(); a set mapped from a card image at boot is
+        // published without one, and it is worked out from the index on
+        // request until the set next changes
+        uint64_t digest;
+        bool hasDigest;
+
+        bool contains(CardKey card) const { return index->contains(card); }
+        size_t size() const { return index->size(); }
+        uint64_t getDigest() const;
+    };
+    typedef std::shared_ptr<const CardSet> Snapshot;
+    Snapshot getSnapshot() const;
+
+    // The current set once every change in it is on flash, for reporting
+    // its generation: one only in RAM could be given to other changes
+    // after a power cut. Empty if the journal write fails.
+    Snapshot getSavedSnapshot();
+
+    // Order-independent digest of a card set: the XOR of cardHash() over
+    // its keys. Each add or remove folds its card in or out of the previous
+    // set's digest, so keeping it costs nothing per change. Sets with the
+    // same digest and count hold the same cards, which lets a sync tool
+    // skip a device whose digest already matches its card file's
+    // (tools/card_image.py digest computes the same value).
+    static uint64_t cardHash(CardKey card) { return CardIndex::mix(card); }
+    static uint64_t digestOf(const CardKey* cards, size_t count);
+
+    // The digest split up, for finding where two sets that have drifted
+    // apart differ. Each card falls in one of SYNC_BUCKETS buckets by the
+    // top bits of its cardHash(), and buckets are grouped SYNC_GROUP_SIZE
+    // at a time; a bucket's or group's digest is the XOR over its cards,
+    // so the groups' digests XOR to the set's. A client compares group
+    // digests, then the buckets of the groups that differ, then fetches
+    // just those buckets' cards. Groups are small so that a few percent of
+    // drift still leaves most of them matching.
+    static constexpr size_t SYNC_BUCKETS = 1024;
+    static constexpr size_t SYNC_GROUP_SIZE = 4;
+    static constexpr size_t SYNC_GROUPS = SYNC_BUCKETS / SYNC_GROUP_SIZE;
+    typedef std::bitset<SYNC_BUCKETS> BucketSet;
+
+    static size_t syncBucket(CardKey card) { return cardHash(card) >> 54; }
+
+    // Fills SYNC_BUCKETS digests in one pass over the set
+    static void getBucketDigests(const CardSet& set, uint64_t* digests);
+
+    // Formats a snapshot as text, one card key per line in index order, a
+    // buffer at a time. Only whole lines are emitted, so memory stays
+    // bounded by the caller's buffer however many cards there are, and the
+    // listing is consistent even if the set changes while it is being sent.
+    // A cursor given a bucket set lists only the cards in those buckets.
+    class Cursor {
+    public:
+        explicit Cursor(Snapshot set);
+        Cursor(Snapshot set, const BucketSet& buckets);
+
+        // Fills up to maxLen bytes; returns 0 once done() or if not even
+        // one line fits
+        size_t read(uint8_t* buffer, size_t maxLen);
+        bool done() const;
+
+    private:
+        // Keys are read from the index a block at a time, so a compressed
+        // index decodes each block once rather than once per key
+        static constexpr size_t READ_BATCH = BlockCardIndex::BLOCK_SIZE;
+
+        Snapshot set;
+        size_t position;  // Index read position, past the batch
+        size_t visited;   // Keys listed or skipped
+        BucketSet buckets;
+        bool filtered;
+        CardKey batch[READ_BATCH];
+        size_t batchCount;  // Keys read into batch
+        size_t batchNext;   // First key in batch not yet listed or skipped
+    };
+    Cursor openCursor() const;
+    Cursor openCursor(const BucketSet& buckets) const;
+
     // Card management functions
-    bool addCard(unsigned long cardNumber);
-    bool removeCard(unsigned long cardNumber);
-    bool hasCard(unsigned long cardNumber);
-    String getAllCards();
+    bool addCard(CardKey card);
+    bool removeCard(CardKey card);
+    bool hasCard(CardKey card);
+    size_t getCardCount();
+    uint32_t getGeneration();
+
+    // The door's decision for a swipe at reader `door`: the facility must
+    // be allowed, the card enrolled or in a granted range, and its
+    // metadata row, if it has one, must allow the reader, the current date
+    // and the current slot of its schedule. The facility and card checks
+    // are cached by the swipe's raw Wiegand value and bit count until the
+    // card set, the ranges or the allowed facilities change, so repeat
+    // swipes skip both; the metadata check is cheap and depends on the
+    // time, so it is made every swipe. The schedule slot is worked out
+    // from local time once per 15 minutes. Call from the reader loop only.
+    AccessDecision checkAccess(uint64_t raw, uint16_t format, uint16_t facility, uint32_t card, uint8_t door);
+
+    // Per-card start and expiry dates, reader mask and label; see
+    // CardMetadata. Rows are kept apart from the card set and outlive
+    // removes and replaces, until deleted. Each change rewrites the table
+    // on flash and swaps it in for lookups atomically. Dates are only
+    // checked once the clock has been set over NTP.
+    bool setCardMetadata(const CardMetadata::Entry& entry);
+    bool removeCardMetadata(CardKey card);
+    bool getCardMetadata(CardKey card, CardMetadata::Entry& entry);  // False if the card has no row
+    bool listCardMetadata(std::vector<CardMetadata::Entry>& entries);
+
+    // Weekly schedules that metadata rows refer to by id, and the holiday
+    // dates on which their holiday hours apply; see AccessSchedules. Held
+    // in RAM, persisted separately from the cards, and swapped in for
+    // swipes atomically on each change. Like dates, schedules are only
+    // checked once the clock has been set.
+    std::shared_ptr<const AccessSchedules> getSchedules();
+    bool setSchedule(uint8_t id, const std::string& name, const AccessSchedules::Week& week);
+    bool removeSchedule(uint8_t id);
+    bool setHolidays(std::vector<uint32_t>& dates);  // YYYYMMDD local dates
+
+    // Grants for whole runs of card numbers on one format and facility;
+    // see CardRanges. They are kept apart from the card set, so they aren't
+    // listed, synced or counted with it, and checkAccess() only searches
+    // them for cards the set doesn't have. Each change rewrites the table
+    // on flash and swaps it in atomically. False if the table would
+    // overflow or can't be saved.
+    bool addCardRange(CardKey first, CardKey last);
+    bool removeCardRange(CardKey first, CardKey last);
+    std::shared_ptr<const CardRanges> getCardRanges();
+
+    // Guest cards: a card can be given a time, in seconds since the epoch,
+    // at which it is removed from the set. Pending expiries are kept in a
+    // min-heap, so the writer task sleeps until the earliest one and never
+    // scans the rest. Cards that fall due together are removed in one
+    // journal commit, and those that were still enrolled are passed to the
+    // revoke handler. Expiries are persisted separately from the cards and
+    // wait for the clock to be set. An expiry of 0 clears one; removing the
+    // card doesn't.
+    typedef std::function<void(CardKey card)> RevokeHandler;
+    void setRevokeHandler(RevokeHandler handler);  // Before begin()
+    bool setCardExpiry(CardKey card, uint32_t expiresAt);
+    uint32_t getCardExpiry(CardKey card);  // 0 if none
+    std::vector<std::pair<CardKey, uint32_t>> listCardExpiries();  // In card order
+    size_t revokeExpired();  // Revokes what is due now; returns how many cards were removed
+
+    // Swipe counts and last-seen times of the cards checkAccess() finds
+    // enrolled or in a range, whatever the decision; see CardUsage. They
+    // are counted in RAM and written to flash in one write by the writer
+    // task at most every USAGE_SAVE_MS while they change, so swipes since
+    // the last save are lost with power. Rows of cards no longer enrolled
+    // or in a range are dropped at each save.
+    std::vector<CardUsage::Entry> listCardUsage();  // In card order
+    bool saveUsage();  // Saves now if anything changed
+
+    // Facility codes whose cards are looked up at all; a swipe from any
+    // other facility is refused outright. Held in RAM and persisted
+    // separately from the cards. Until set it is just LEGACY_FACILITY.
+    bool isFacilityAllowed(uint16_t facility);
+    std::vector<uint16_t> getAllowedFacilities();
+    bool setAllowedFacilities(std::vector<uint16_t>& facilities);
+
+    // Bulk changes, each written to flash in one go. newCards must be
+    // sorted and de-duplicated, as produced by CardImport::finish().
+    // replaceCards swaps the whole set atomically, on flash and in RAM.
+    bool addCards(const std::vector<CardKey>& newCards);
+    bool removeCards(const std::vector<CardKey>& oldCards);
+    bool replaceCards(std::vector<CardKey>& newCards);
+
+    // Replaces the set with the cards in a perfect hash image built by
+    // tools/card_image.py and uploaded to IMAGE_UPLOAD_PATH, and serves
+    // lookups straight from the image until the set next changes. The
+    // image is checked key by key first; on failure the set is untouched
+    // and `error` says why. If there is an IMAGE_REGION it is then copied
+    // there and used in place (see CardImageMemory), so it costs no heap
+    // and later boots skip loading the card set.
+    static constexpr const char* IMAGE_UPLOAD_PATH = "/card_image.upload";
+    bool installImage(const char* path, const char*& error);
+
+    // Adds and removes take effect for lookups at once, but are written to
+    // the journal in batches: a batch is committed a window after its first
+    // change, or as soon as it holds maxRecords changes, so a burst of
+    // admin calls costs one flash write rather than one each. A window of 0
+    // writes every change before returning. Set before begin().
+    void setBatching(uint32_t windowMs, size_t maxRecords);
+
+    // Flush barrier: writes the pending batch now, so every change made
+    // before the call survives a power cut once it returns true. Callers
+    // that report a change as saved call it first.
+    bool flush();
+
+    // One card added or removed, tagged with the generation it produced
+    struct Change {
+        uint32_t generation;
+        CardKey card;
+        bool added;
+    };
+
+    // Changes after generation `since`, oldest first, up to the last one on
+    // flash, which is `currentGeneration`. Returns false if the bounded
+    // history no longer reaches back that far (or `since` is ahead of this
+    // device), in which case the caller needs a full resync.
+    bool getChangesSince(uint32_t since, std::vector<Change>& changes, uint32_t& currentGeneration);
+
+    // Incremental parser for a streamed card list, either one card key per
+    // line in text form or the binary database format (current or v2, whose
+    // bare card numbers are imported as legacy keys). feed() accepts the
+    // stream split at any byte; finish() validates, sorts and de-duplicates.
+    // An import takes at most getLimit() cards, as of when it was started.
+    class CardImport {
+    public:
+        // Half the largest free heap block, in cards, so a text list can
+        // still double its buffer as it grows
+        static size_t getLimit();
+
+        CardImport();
+        bool feed(const uint8_t* data, size_t len);
+        bool finish();
+        const char* getError() const { return error; }
+
+        std::vector<CardKey> cards;
+
+    private:
+        enum class Format { UNKNOWN, TEXT, BINARY };
+
+        Format format;
+        const char* error;
+        size_t maxCards;
+        uint32_t fields[3];   // Text key being assembled, one field per ':'
+        size_t fieldCount;    // Completed fields on the current line
+        size_t digits;        // Digits seen in the current field
+        bool keyEnded;        // Whitespace after the key on the current line
+        uint64_t record;      // Binary record being assembled
+        size_t recordBytes;
+        uint16_t recordSize;  // From the binary header
+        uint8_t header[20];   // Binary FileHeader, collected before any records
+        size_t headerBytes;
+        uint32_t crc;
+
+        bool push(CardKey card);
+        bool endLine();
+        bool fail(const char* message);
+    };
+
+    // Journal and write amplification counters
+    struct Stats {
+        size_t cardCount;
+        size_t importLimit;             // Most cards an import started now would take
+        uint32_t generation;            // Bumped once per card added or removed, and per replace
+        size_t journalRecords;          // Mutations not yet folded into the snapshot
+        size_t batchedRecords;          // Mutations in RAM waiting for the next journal write
+        uint32_t compactions;           // Snapshot rewrites since boot
+        uint32_t mutations;             // Journal records appended since boot
+        uint32_t journalBytesWritten;   // Bytes appended to the journal since boot
+        uint32_t snapshotBytesWritten;  // Bytes written by snapshot rewrites since boot
+        uint32_t flashCommits;          // Journal writes and snapshot rewrites since boot
+        float commitsPerSecond;         // Flash commits over the last rate window
+
+        // Recovery scan at boot
+        uint32_t recoveryMicros;        // Checking the snapshot and replaying the journal
+        uint32_t journalBytesDiscarded; // Torn or corrupt journal tail dropped
+        bool rolledBack;                // The snapshot was unreadable and its backup was used
+
+        // In-RAM index
+        const char* indexType;
+        size_t indexBytes;
+        float indexProbes;              // Mean probes per successful lookup
+        uint32_t indexMicros;           // Time spent searching the index since boot
+
+        // Cuckoo filter in front of hasCard()
+        size_t filterSlots;
+        size_t filterBytes;
+        float filterFillRatio;
+        float filterFalsePositiveRate;  // Expected, from the fill ratio
+        uint32_t lookups;               // hasCard() calls since boot
+        uint32_t filterRejects;         // Answered by the filter alone
+        uint32_t filterFalsePositives;  // Passed the filter, not in the index
+        uint32_t filterUpdates;         // Sets published by updating the previous filter
+        uint32_t filterRebuilds;        // Sets published with a filter built from scratch
+
+        // Decision cache in front of checkAccess()
+        size_t cacheEntries;
+        size_t cacheCapacity;
+        uint32_t cacheHits;
+        uint32_t cacheMisses;
+        uint32_t cacheEvictions;
+        uint32_t cacheInvalidations;    // Times a card set or facility change emptied it
+
+        // Metadata columns in RAM; labels stay on flash
+        size_t metadataRows;
+        size_t metadataBytes;
+
+        size_t scheduleCount;
+        size_t holidayCount;
+
+        size_t rangeCount;
+        uint64_t rangeCards;            // Cards covered by the ranges
+        size_t rangeBytes;
+
+        size_t expiriesPending;
+        uint32_t expiriesRevoked;       // Cards removed by their expiry since boot
+
+        size_t usageRows;
+        size_t usageBytes;
+        uint32_t usageUntracked;        // Swipes not counted because the table was full
+        uint32_t usageSaves;            // Usage writes since boot
+    };
+    Stats getStats();
 
 private:
-    // File path
-    static constexpr const char* DATABASE_PATH = "/card_database";
+    // File paths
+    static constexpr const char* DATABASE_PATH = "/card_database.bin";
+    static constexpr const char* TEMP_PATH = "/card_database.tmp";
+    static constexpr const char* BACKUP_PATH = "/card_database.bak";  // The snapshot before the current one
+    static constexpr const char* LEGACY_TEXT_PATH = "/card_database";  // One decimal card per line
+    static constexpr const char* JOURNAL_PATH = "/card_journal";
+    static constexpr const char* FACILITIES_PATH = "/allowed_facilities";
+    static constexpr const char* FACILITIES_TEMP_PATH = "/allowed_facilities.tmp";
+    static constexpr const char* METADATA_PATH = "/card_metadata.bin";
+    static constexpr const char* METADATA_TEMP_PATH = "/card_metadata.tmp";
+    static constexpr const char* SCHEDULES_PATH = "/access_schedules.bin";
+    static constexpr const char* SCHEDULES_TEMP_PATH = "/access_schedules.tmp";
+    static constexpr const char* RANGES_PATH = "/card_ranges.bin";
+    static constexpr const char* RANGES_TEMP_PATH = "/card_ranges.tmp";
+    static constexpr const char* USAGE_PATH = "/card_usage.bin";
+    static constexpr const char* USAGE_TEMP_PATH = "/card_usage.tmp";
+    static constexpr const char* EXPIRY_PATH = "/card_expiry.bin";
+    static constexpr const char* EXPIRY_TEMP_PATH = "/card_expiry.tmp";
+    static constexpr const char* FILTER_PATH = "/card_filter.bin";
+    static constexpr const char* FILTER_TEMP_PATH = "/card_filter.tmp";
+    static constexpr const char* IMAGE_PATH = "/card_image.bin";  // Used when there's no IMAGE_REGION
+    static constexpr const char* IMAGE_REGION = "cardimg";
+
+    // On-flash format: a FileHeader followed by `count` little-endian records
+    static constexpr uint32_t FILE_MAGIC = 0x31424443;  // "CDB1"
+    static constexpr uint16_t FILE_VERSION = 3;  // v1 had no generation field, v1 and v2 bare card numbers
+    static constexpr uint16_t RECORD_SIZE = sizeof(CardKey);
+    static constexpr uint16_t LEGACY_RECORD_SIZE = sizeof(uint32_t);
+
+    struct FileHeader {
+        uint32_t magic;
+        uint16_t version;
+        uint16_t recordSize;
+        uint32_t count;
+        uint32_t crc;         // CRC32 of the record bytes
+        uint32_t generation;  // Generation of the card set this snapshot holds
+    };
+    static_assert(sizeof(FileHeader) == 20, "FileHeader must match the on-flash layout");
+    static constexpr size_t FILE_HEADER_V1_SIZE = 16;
 
-    // Mutex for file access synchronization
+    // Mutations are appended to the journal and replayed over the snapshot
+    // at boot; the snapshot is only rewritten when the journal grows past
+    // COMPACT_THRESHOLD records
+    static constexpr size_t COMPACT_THRESHOLD = 512;
+
+    // Default batching; see setBatching()
+    static constexpr uint32_t BATCH_WINDOW_MS = 200;
+    static constexpr size_t BATCH_MAX_RECORDS = 64;
+
+    // commitsPerSecond is the count over the last complete window
+    static constexpr uint32_t COMMIT_RATE_WINDOW_MS = 10000;
+
+    // The journal starts with the generation of the snapshot it applies to,
+    // so a journal orphaned by a replace or compaction is never replayed.
+    // Each record carries a CRC over its own generation, card and op, so a
+    // torn or corrupt tail, or a record left from an older journal, ends
+    // replay there. The last record of each write is flagged, and only
+    // whole writes are replayed, so a batch is all or nothing.
+    static constexpr uint32_t JOURNAL_MAGIC = 0x334A4443;  // "CDJ3"
+    static constexpr uint32_t UNCHECKED_JOURNAL_MAGIC = 0x324A4443;  // "CDJ2", records without CRCs
+    static constexpr uint32_t LEGACY_JOURNAL_MAGIC = 0x314A4443;  // "CDJ1", bare card numbers
+
+    struct JournalHeader {
+        uint32_t magic;
+        uint32_t baseGeneration;
+    };
+
+    enum JournalOp : uint8_t {
+        JOURNAL_ADD = 1,
+        JOURNAL_DEL = 2
+    };
+
+    static constexpr uint8_t RECORD_COMMIT = 0x01;  // Last record of a write
+
+    struct JournalRecord {
+        CardKey card;
+        uint8_t op;
+        uint8_t flags;  // This and crc are zero in CDJ2 journals
+        uint8_t reserved[2];
+        uint32_t crc;
+    };
+    static_assert(sizeof(JournalRecord) == 16, "JournalRecord must match the on-flash layout");
+
+    struct LegacyJournalRecord {
+        uint32_t card;
+        uint8_t op;
+        uint8_t reserved[3];
+    };
+    static_assert(sizeof(LegacyJournalRecord) == 8, "LegacyJournalRecord must match the on-flash layout");
+
+    // Allowed facilities file: a FacilityHeader followed by `count`
+    // little-endian uint16 codes
+    static constexpr uint32_t FACILITIES_MAGIC = 0x31464443;  // "CDF1"
+
+    struct FacilityHeader {
+        uint32_t magic;
+        uint32_t count;
+        uint32_t crc;
+    };
+
+    // Metadata file: a MetadataHeader, then each CardMetadata column in
+    // turn, `count` entries each, then the label pool of NUL-terminated
+    // strings. Only the columns are read at boot, so only they are covered
+    // by the CRC. "CDM1" files have no schedule column; they load with no
+    // schedules and are rewritten as "CDM2" on the next change.
+    static constexpr uint32_t METADATA_MAGIC = 0x324D4443;  // "CDM2"
+    static constexpr uint32_t METADATA_MAGIC_V1 = 0x314D4443;  // "CDM1"
+    static constexpr size_t METADATA_MAX_ROWS = 16384;
+    static constexpr size_t METADATA_ROW_BYTES =
+        sizeof(uint64_t) + 3 * sizeof(uint32_t) + sizeof(uint16_t) + sizeof(uint8_t);
+    static constexpr size_t METADATA_V1_ROW_BYTES = METADATA_ROW_BYTES - sizeof(uint8_t);
+
+    struct MetadataHeader {
+        uint32_t magic;
+        uint32_t count;
+        uint32_t poolBytes;
+        uint32_t crc;  // CRC32 of the columns
+    };
+
+    // Schedules file: a ScheduleHeader, `count` ScheduleRecords, then
+    // `holidayCount` uint32 YYYYMMDD dates
+    static constexpr uint32_t SCHEDULES_MAGIC = 0x31534443;  // "CDS1"
+
+    struct ScheduleHeader {
+        uint32_t magic;
+        uint32_t count;
+        uint32_t holidayCount;
+        uint32_t crc;  // CRC32 of the records and dates
+    };
+
+    struct ScheduleRecord {
+        uint8_t id;
+        char name[AccessSchedules::MAX_NAME + 1];  // NUL-terminated
+        uint8_t reserved[3];
+        AccessSchedules::Week week;
+    };
+    static_assert(sizeof(ScheduleRecord) == 132, "ScheduleRecord must match the on-flash layout");
+
+    // Ranges file: a RangeHeader, then the `count` range starts and the
+    // `count` range ends, as card keys
+    static constexpr uint32_t RANGES_MAGIC = 0x31524443;  // "CDR1"
+
+    struct RangeHeader {
+        uint32_t magic;
+        uint32_t count;
+        uint32_t crc;  // CRC32 of the starts and ends
+    };
+
+    // Usage file: a UsageHeader, then the `count` cards, last-seen times
+    // and swipe counts, as columns
+    static constexpr uint32_t USAGE_MAGIC = 0x31554443;  // "CDU1"
+    static constexpr uint32_t USAGE_SAVE_MS = 5 * 60 * 1000;
+
+    struct UsageHeader {
+        uint32_t magic;
+        uint32_t count;
+        uint32_t crc;  // CRC32 of the three columns
+    };
+
+    // Expiry file: an ExpiryHeader, then `count` ExpiryRecords in card order
+    static constexpr uint32_t EXPIRY_MAGIC = 0x31454443;  // "CDE1"
+    static constexpr size_t EXPIRY_MAX = 4096;
+    static constexpr size_t REVOKE_BATCH = BATCH_MAX_RECORDS;  // Most cards revoked per commit
+    static constexpr uint32_t EXPIRY_POLL_MS = 60000;  // Longest sleep, for clock changes
+    static constexpr uint32_t REVOKE_RETRY_MS = 1000;  // After a failed revoke
+
+    struct ExpiryHeader {
+        uint32_t magic;
+        uint32_t count;
+        uint32_t crc;  // CRC32 of the records
+    };
+
+    struct ExpiryRecord {
+        uint64_t card;
+        uint32_t expiresAt;
+        uint32_t reserved;
+    };
+    static_assert(sizeof(ExpiryRecord) == 16, "ExpiryRecord must match the on-flash layout");
+
+    // time() values before this mean the clock hasn't been set yet
+    static constexpr time_t CLOCK_VALID_AFTER = 1577836800;  // 2020-01-01
+
+    // Saved filter: a FilterHeader followed by the filter's fingerprint
+    // table. It is written with each snapshot and only loaded for the
+    // snapshot it matches, so a missing or stale file just means a rebuild.
+    // Journalled adds and removes are applied to it at replay.
+    static constexpr uint32_t FILTER_MAGIC = 0x31464343;  // "CCF1"; "CBF1" files held a Bloom filter
+
+    struct FilterHeader {
+        uint32_t magic;
+        uint32_t generation;  // Generation of the snapshot it matches
+        uint32_t cardCount;
+        uint32_t slotCount;
+        uint32_t slotsPerBucket;
+        uint32_t crc;         // CRC32 of the table
+    };
+
+    // An installed card image is kept with its header's generation set to
+    // the snapshot written alongside it, and only used while that is still
+    // the current generation; any later change makes it stale.
+    static constexpr uint32_t IMAGE_RETIRE_TIMEOUT_MS = 5000;  // Wait for readers of a mapped image being replaced
+
+    // Recent changes kept in RAM for delta sync, as a ring buffer. Journal
+    // replay refills it at boot; a replace can't be expressed as deltas, so
+    // it clears it.
+    static constexpr size_t CHANGE_LOG_SIZE = 512;
+
+    CardIndex::Type indexType;
+
+    // Serializes writers and guards the journal state below; lookups don't
+    // take it
     SemaphoreHandle_t mutex;
 
-    // Helper functions
+    // The published card set, loaded once in begin(). The files are only
+    // used for persistence. Always accessed with std::atomic_load/store.
+    Snapshot current;
+
+    // Sorted allowed facility codes, swapped the same way
+    std::shared_ptr<const std::vector<uint16_t>> allowedFacilities;
+
+    // Metadata table matching METADATA_PATH, swapped the same way; label
+    // reads go through the file, so they take the mutex
+    std::shared_ptr<const CardMetadata> metadata;
+    uint32_t metadataPoolStart;  // Offset of the label pool in METADATA_PATH; under the mutex
+
+    // Range grants matching RANGES_PATH, swapped the same way
+    std::shared_ptr<const CardRanges> ranges;
+
+    // Schedule table matching SCHEDULES_PATH, swapped the same way, and
+    // bumped after each swap
+    std::shared_ptr<const AccessSchedules> schedules;
+    std::atomic<uint32_t> scheduleVersion;
+
+    // The schedule slot of recent swipes and the span of time it covers,
+    // for the schedule version it was worked out with. Only checkAccess()
+    // uses these, from the reader loop.
+    uint16_t currentSlot;
+    time_t slotStart;
+    time_t slotEnd;
+    uint32_t slotVersion;
+
+    // Pending expiries by card, matching EXPIRY_PATH, and a min-heap of
+    // them by time. A changed or cleared expiry leaves its old heap entry
+    // behind, to be skipped when it reaches the top. Both under the mutex.
+    struct PendingExpiry {
+        uint32_t expiresAt;
+        CardKey card;
+        bool operator>(const PendingExpiry& other) const { return expiresAt > other.expiresAt; }
+    };
+    std::map<CardKey, uint32_t> expiries;
+    std::vector<PendingExpiry> expiryHeap;
+    RevokeHandler revokeHandler;
+    uint32_t expiriesRevoked;
+    bool revokeFailed;
+    uint32_t revokeFailedAt;  // millis()
+
+    // Swipe counters, changed in place by checkAccess() and written out by
+    // the writer task. The table is under usageMutex, which is only ever
+    // held for work in RAM, so a swipe never waits on flash; a writer
+    // holding the mutex may take it, never the other way round. The save
+    // timing is atomic so the writer task can check it without either.
+    SemaphoreHandle_t usageMutex;
+    CardUsage usage;
+    std::atomic<bool> usageDirty;          // Changed since the last save
+    std::atomic<uint32_t> usageSavedAt;    // millis() of the last save
+    uint32_t usageUntracked;
+    uint32_t usageSaves;
+
+    // Bumped after each new card set, range table or facility list is
+    // published; cached decisions are stamped with the version read before
+    // making them
+    std::atomic<uint32_t> policyVersion;
+    AccessCache accessCache;
+
+    // Generation of the published set; the on-flash snapshot's generation
+    // plus one per journal record. Writer side, guarded by the mutex.
+    uint32_t generation;
+
+    // Change history ring; holds every change after historyStartGeneration
+    Change changeLog[CHANGE_LOG_SIZE];
+    size_t changeLogHead;   // Index of the oldest entry
+    size_t changeLogCount;
+    uint32_t historyStartGeneration;
+
+    // Changes already published but not yet in the journal, oldest first;
+    // a snapshot write takes them with it
+    std::vector<JournalRecord> batch;
+    uint32_t batchWindowMs;
+    size_t batchMaxRecords;
+
+    // Journal state and counters reported by getStats()
+    size_t journalRecords;
+    uint32_t compactions;
+    uint32_t mutations;
+    uint32_t journalBytesWritten;
+    uint32_t snapshotBytesWritten;
+    uint32_t flashCommits;
+    uint32_t recoveryMicros;
+    uint32_t journalBytesDiscarded;
+    bool rolledBack;
+    uint32_t commitRateStart;      // millis() at the start of the current window
+    uint32_t commitRateCount;      // Commits in the current window
+    float commitsPerSecond;        // Rate over the previous window
+
+    // Lookup counters, bumped without the mutex
+    std::atomic<uint32_t> lookups;
+    std::atomic<uint32_t> filterRejects;
+    std::atomic<uint32_t> filterFalsePositives;
+    std::atomic<uint32_t> indexMicros;
+
+    // Filter maintenance counters, writer side
+    uint32_t filterUpdates;
+    uint32_t filterRebuilds;
+
+    // Background task that writes each batch once its window is up, folds
+    // the journal into a new snapshot once it is long enough, and revokes
+    // cards as their expiries fall due
+    TaskHandle_t writerTaskHandle;
+    static void writerTask(void* arg);
+
+    // Helper functions (callers hold the mutex)
     bool takeMutex();
     void giveMutex();
-    bool initializeFile();
-    bool writeCardToFile(unsigned long cardNumber);
-    bool removeCardFromFile(unsigned long cardNumber);
-}; 
\ No newline at end of file
+    bool initializeFile(std::vector<CardKey>& cards);
+    bool migrateTextFile(std::vector<CardKey>& cards);
+    bool loadCards(const char* path, std::vector<CardKey>& cards, bool& legacy);
+    bool loadSnapshot(std::vector<CardKey>& cards, bool& legacy, uint32_t& lostGeneration);
+    static bool readHeader(File& file, FileHeader& header);
+    bool readSnapshotHeader(FileHeader& header);
+    bool journalHasRecords(uint32_t snapshotGeneration);
+    bool saveCards(const std::vector<CardKey>& set, uint32_t setGeneration);
+    static bool commitFile(const char* path, const char* tempPath, const std::function<bool(File&)>& writer);
+    bool replayJournal(std::vector<CardKey>& cards, bool& legacy, bool& rewrite, CuckooFilter*& filter);
+    static uint32_t recordCrc(uint32_t recordGeneration, const JournalRecord& record);
+    bool appendJournal();
+    void countCommit();
+    bool writeSnapshot(const std::vector<CardKey>& set, uint32_t setGeneration);
+    bool compact();
+    bool commitChanges(JournalOp op, const std::vector<CardKey>& delta, std::vector<CardKey>& next);
+    bool removeCards(const std::vector<CardKey>& oldCards, std::vector<CardKey>& removed);
+    void publish(std::vector<CardKey>& cards, CuckooFilter* filter = NULL, CardIndex* index = NULL,
+                 const uint64_t* digest = NULL);
+    bool loadFilter(size_t cardCount, CuckooFilter& filter);
+    void saveFilter();
+    CardIndex* mapImage();
+    CardIndex* loadImage(size_t cardCount);
+    void storeMappedImage(const char* path, std::weak_ptr<const CardSet> previous);
+    bool stampImage(const char* path, uint32_t imageGeneration);
+    void logChanges(bool added, const CardKey* cards, size_t count, uint32_t firstGeneration);
+    void resetChangeLog();
+    bool loadFacilities();
+    bool saveFacilities(const std::vector<uint16_t>& facilities);
+    static void quarantine(const char* path, const char* what);
+    bool loadMetadata();
+    bool updateMetadata(CardKey card, const CardMetadata::Entry* entry);
+    bool readLabels(const CardMetadata& table, std::vector<String>& labels);
+    static void readLabel(File& file, uint32_t poolStart, uint32_t offset, String& label);
+    bool loadSchedules();
+    bool loadRanges();
+    bool publishRanges(CardRanges* next);
+    bool loadExpiries();
+    bool saveExpiries();
+    bool isPendingExpiry(const PendingExpiry& entry);
+    void pushExpiry(CardKey card, uint32_t expiresAt);
+    TickType_t expiryWait();
+    void recordUsage(CardKey card);
+    bool loadUsage();
+    bool writeUsage();
+    TickType_t usageWait();
+    bool publishSchedules(std::shared_ptr<AccessSchedules> next);
+    static bool fieldsToKey(const uint32_t* fields, size_t count, CardKey& key);
+};
@@ -0,0 +1,140 @@
+#include "card_image_memory.h"
+#ifdef ESP_PLATFORM
+#include <spi_flash_mmap.h>
+#else
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+CardImageMemory* CardImageMemory::load(File& file) {
+    CardImageMemory* memory = new CardImageMemory();
+    memory->heap.resize((file.size() + sizeof(uint64_t) - 1) / sizeof(uint64_t));
+    memory->bytes = (const uint8_t*)memory->heap.data();
+    memory->length = file.size();
+    if (file.read((uint8_t*)memory->heap.data(), memory->length) != memory->length) {
+        delete memory;
+        return NULL;
+    }
+    return memory;
+}
+
+#ifdef ESP_PLATFORM
+
+static const esp_partition_t* findRegion(const char* region) {
+    return esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, region);
+}
+
+CardImageMemory::~CardImageMemory() {
+    if (mapped) {
+        esp_partition_munmap(handle);
+    }
+}
+
+bool CardImageMemory::available(const char* region) {
+    return findRegion(region) != NULL;
+}
+
+CardImageMemory* CardImageMemory::map(const char* region) {
+    const esp_partition_t* partition = findRegion(region);
+    if (partition == NULL) {
+        return NULL;
+    }
+    CardImageMemory* memory = new CardImageMemory();
+    const void* bytes;
+    if (esp_partition_mmap(partition, 0, partition->size, ESP_PARTITION_MMAP_DATA, &bytes, &memory->handle) != ESP_OK) {
+        Serial.println("Failed to map card image partition");
+        delete memory;
+        return NULL;
+    }
+    memory->bytes = (const uint8_t*)bytes;
+    memory->length = partition->size;
+    memory->mapped = true;
+    return memory;
+}
+
+bool CardImageMemory::store(const char* region, File& source, size_t bodyOffset, const uint8_t* header, size_t headerSize) {
+    const esp_partition_t* partition = findRegion(region);
+    size_t size = source.size();
+    if (partition == NULL || size > partition->size || headerSize > bodyOffset) {
+        return false;
+    }
+    size_t eraseSize = (size + SPI_FLASH_SEC_SIZE - 1) / SPI_FLASH_SEC_SIZE * SPI_FLASH_SEC_SIZE;
+    if (esp_partition_erase_range(partition, 0, eraseSize) != ESP_OK || !source.seek(bodyOffset)) {
+        return false;
+    }
+
+    uint8_t buffer[512];
+    size_t offset = bodyOffset;
+    while (offset < size) {
+        size_t len = source.read(buffer, sizeof(buffer));
+        if (len == 0 || esp_partition_write(partition, offset, buffer, len) != ESP_OK) {
+            return false;
+        }
+        offset += len;
+    }
+    return esp_partition_write(partition, 0, header, headerSize) == ESP_OK;
+}
+
+#else
+
+CardImageMemory::~CardImageMemory() {
+    if (mapped) {
+        munmap((void*)bytes, length);
+    }
+}
+
+bool CardImageMemory::available(const char* region) {
+    (void)region;
+    return true;  // store() creates the file
+}
+
+CardImageMemory* CardImageMemory::map(const char* region) {
+    int fd = open(region, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat info;
+    void* bytes = MAP_FAILED;
+    if (fstat(fd, &info) == 0 && info.st_size > 0) {
+        bytes = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);  // The mapping outlives the descriptor
+    if (bytes == MAP_FAILED) {
+        return NULL;
+    }
+    CardImageMemory* memory = new CardImageMemory();
+    memory->bytes = (const uint8_t*)bytes;
+    memory->length = info.st_size;
+    memory->mapped = true;
+    return memory;
+}
+
+bool CardImageMemory::store(const char* region, File& source, size_t bodyOffset, const uint8_t* header, size_t headerSize) {
+    // A file is replaced by rename rather than rewritten, so mappings of
+    // the old one stay valid; the header-last order is kept regardless
+    String temp = String(region) + ".tmp";
+    FILE* file = fopen(temp.c_str(), "wb");
+    if (file == NULL || headerSize > bodyOffset || !source.seek(bodyOffset)) {
+        if (file != NULL) fclose(file);
+        return false;
+    }
+
+    bool ok = fseek(file, bodyOffset, SEEK_SET) == 0;
+    uint8_t buffer[512];
+    size_t len;
+    while (ok && (len = source.read(buffer, sizeof(buffer))) > 0) {
+        ok = fwrite(buffer, 1, len, file) == len;
+    }
+    ok = ok && fseek(file, 0, SEEK_SET) == 0 && fwrite(header, 1, headerSize, file) == headerSize;
+    ok = fclose(file) == 0 && ok;
+    if (!ok || rename(temp.c_str(), region) != 0) {
+        remove(temp.c_str());
+        return false;
+    }
+    return true;
+}
+
+#endif
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <Arduino.h>
+#include <FS.h>
+#include <vector>
+#ifdef ESP_PLATFORM
+#include <esp_partition.h>
+#endif
+
+// Read-only bytes of a card image, either mapped from a raw flash region
+// or read into heap. Installed images are kept in the region so lookups
+// run on them in place and boot doesn't copy the card set anywhere. On
+// the ESP32 the region is a data partition mapped with esp_partition_mmap;
+// in a host build it is a file of the same name mapped with POSIX mmap.
+//
+// The partition is optional; without it images are read from LittleFS
+// into heap instead. To enable it, add a line like this to partitions.csv:
+//   cardimg,  data, 0x40,  ,  1M
+class CardImageMemory {
+public:
+    ~CardImageMemory();
+
+    // Whole region, mapped; NULL if there is no such region
+    static CardImageMemory* map(const char* region);
+
+    // Whole file, copied into heap
+    static CardImageMemory* load(File& file);
+
+    static bool available(const char* region);
+
+    // Replaces the region's contents with `source` from `bodyOffset` on,
+    // at the same offsets, then writes `header` at the start. Until the
+    // last step the region holds no valid header, so a power cut leaves
+    // an image that is rejected rather than a torn one. Nothing may have
+    // the region mapped while it is written.
+    static bool store(const char* region, File& source, size_t bodyOffset, const uint8_t* header, size_t headerSize);
+
+    const uint8_t* data() const { return bytes; }
+    size_t size() const { return length; }
+    bool isMapped() const { return mapped; }
+
+private:
+    const uint8_t* bytes;
+    size_t length;
+    bool mapped;
+    std::vector<uint64_t> heap;  // Keeps heap copies 8-byte aligned
+#ifdef ESP_PLATFORM
+    esp_partition_mmap_handle_t handle;
+#endif
+
+    CardImageMemory() : bytes(NULL), length(0), mapped(false) {}
+};
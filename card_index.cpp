@@ -0,0 +1,329 @@
+#include "card_index.h"
+#include "crc32.h"
+#include <algorithm>
+#include <math.h>
+
+CardIndex* CardIndex::create(Type type, std::vector<uint64_t>& keys) {
+    switch (type) {
+        case HASH:
+            return new HashCardIndex(keys);
+        case BLOCK:
+            return new BlockCardIndex(keys);
+        case SORTED:
+        case PERFECT:
+        default:
+            return new SortedCardIndex(keys);
+    }
+}
+
+uint64_t CardIndex::mix(uint64_t key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return key;
+}
+
+const char* CardIndex::typeName(Type type) {
+    switch (type) {
+        case HASH: return "hash";
+        case BLOCK: return "block";
+        case PERFECT: return "perfect";
+        case SORTED: return "sorted";
+        default: return "unknown";
+    }
+}
+
+SortedCardIndex::SortedCardIndex(std::vector<uint64_t>& source) {
+    keys.swap(source);
+    keys.shrink_to_fit();
+}
+
+bool SortedCardIndex::contains(uint64_t key) const {
+    return std::binary_search(keys.begin(), keys.end(), key);
+}
+
+float SortedCardIndex::getAverageProbes() const {
+    return keys.empty() ? 0.0f : log2f(keys.size()) + 1;
+}
+
+size_t SortedCardIndex::read(size_t& position, uint64_t* out, size_t count) const {
+    size_t n = position < keys.size() ? std::min(count, keys.size() - position) : 0;
+    std::copy(keys.begin() + position, keys.begin() + position + n, out);
+    position += n;
+    return n;
+}
+
+void SortedCardIndex::getSortedKeys(std::vector<uint64_t>& out) const {
+    out = keys;
+}
+
+HashCardIndex::HashCardIndex(const std::vector<uint64_t>& keys)
+    : mask(0), count(keys.size()), hasZero(false), totalProbes(0) {
+    size_t capacity = 16;
+    while (capacity * MAX_LOAD_NUMERATOR < keys.size() * MAX_LOAD_DENOMINATOR) {
+        capacity *= 2;
+    }
+    slots.assign(capacity, 0);
+    mask = capacity - 1;
+
+    for (uint64_t key : keys) {
+        if (key == 0) {
+            hasZero = true;
+            continue;
+        }
+        size_t slot = mix(key) & mask;
+        totalProbes++;
+        while (slots[slot] != 0) {
+            slot = (slot + 1) & mask;
+            totalProbes++;
+        }
+        slots[slot] = key;
+    }
+}
+
+bool HashCardIndex::contains(uint64_t key) const {
+    if (key == 0) {
+        return hasZero;
+    }
+    // The table is never full, so every probe sequence ends at an empty slot
+    for (size_t slot = mix(key) & mask; ; slot = (slot + 1) & mask) {
+        if (slots[slot] == key) return true;
+        if (slots[slot] == 0) return false;
+    }
+}
+
+float HashCardIndex::getAverageProbes() const {
+    size_t stored = count - (hasZero ? 1 : 0);
+    return stored > 0 ? (float)totalProbes / stored : 0.0f;
+}
+
+size_t HashCardIndex::read(size_t& position, uint64_t* out, size_t count) const {
+    // Positions are slot numbers; one past the table stands for key 0
+    size_t n = 0;
+    while (n < count && position < slots.size()) {
+        if (slots[position] != 0) {
+            out[n++] = slots[position];
+        }
+        position++;
+    }
+    if (n < count && position == slots.size()) {
+        if (hasZero) {
+            out[n++] = 0;
+        }
+        position++;
+    }
+    return n;
+}
+
+void HashCardIndex::getSortedKeys(std::vector<uint64_t>& keys) const {
+    keys.clear();
+    keys.reserve(count);
+    if (hasZero) {
+        keys.push_back(0);
+    }
+    for (uint64_t key : slots) {
+        if (key != 0) {
+            keys.push_back(key);
+        }
+    }
+    std::sort(keys.begin(), keys.end());
+}
+
+BlockCardIndex::BlockCardIndex(const std::vector<uint64_t>& keys) : count(keys.size()) {
+    size_t blocks = (keys.size() + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    firstKeys.reserve(blocks);
+    offsets.reserve(blocks);
+    for (size_t i = 0; i < keys.size(); i++) {
+        if (i % BLOCK_SIZE == 0) {
+            firstKeys.push_back(keys[i]);
+            offsets.push_back(data.size());
+            continue;
+        }
+        uint64_t gap = keys[i] - keys[i - 1];
+        while (gap >= 0x80) {
+            data.push_back((gap & 0x7f) | 0x80);
+            gap >>= 7;
+        }
+        data.push_back(gap);
+    }
+    data.shrink_to_fit();
+}
+
+uint64_t BlockCardIndex::readVarint(const uint8_t*& p) {
+    uint64_t value = 0;
+    for (int shift = 0; ; shift += 7) {
+        uint8_t byte = *p++;
+        value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return value;
+    }
+}
+
+const uint8_t* BlockCardIndex::blockEnd(size_t block) const {
+    return data.data() + (block + 1 < offsets.size() ? offsets[block + 1] : data.size());
+}
+
+bool BlockCardIndex::contains(uint64_t key) const {
+    // Last block starting at or below the key
+    auto it = std::upper_bound(firstKeys.begin(), firstKeys.end(), key);
+    if (it == firstKeys.begin()) {
+        return false;
+    }
+    size_t block = it - firstKeys.begin() - 1;
+
+    uint64_t current = firstKeys[block];
+    const uint8_t* p = data.data() + offsets[block];
+    const uint8_t* end = blockEnd(block);
+    while (current < key && p < end) {
+        current += readVarint(p);
+    }
+    return current == key;
+}
+
+size_t BlockCardIndex::getMemoryUsage() const {
+    return firstKeys.capacity() * sizeof(uint64_t) + offsets.capacity() * sizeof(uint32_t) + data.capacity();
+}
+
+float BlockCardIndex::getAverageProbes() const {
+    // Block search, then on average half a block of gaps decoded
+    if (count == 0) return 0.0f;
+    size_t perBlock = std::min(count, BLOCK_SIZE);
+    return log2f(firstKeys.size()) + 1 + (perBlock - 1) / 2.0f;
+}
+
+size_t BlockCardIndex::read(size_t& position, uint64_t* out, size_t n) const {
+    // Positions are key ordinals; decode from the start of their block
+    size_t copied = 0;
+    while (copied < n && position < count) {
+        size_t block = position / BLOCK_SIZE;
+        uint64_t current = firstKeys[block];
+        const uint8_t* p = data.data() + offsets[block];
+        for (size_t i = block * BLOCK_SIZE; i < position; i++) {
+            current += readVarint(p);
+        }
+        const uint8_t* end = blockEnd(block);
+        out[copied++] = current;
+        position++;
+        while (copied < n && p < end) {
+            current += readVarint(p);
+            out[copied++] = current;
+            position++;
+        }
+    }
+    return copied;
+}
+
+void BlockCardIndex::getSortedKeys(std::vector<uint64_t>& keys) const {
+    keys.resize(count);
+    size_t position = 0;
+    read(position, keys.data(), count);
+}
+
+size_t PerfectHashCardIndex::pilotBytes(const ImageHeader& header) {
+    return (header.bucketCount * sizeof(uint16_t) + IMAGE_PAGE_SIZE - 1) / IMAGE_PAGE_SIZE * IMAGE_PAGE_SIZE;
+}
+
+size_t PerfectHashCardIndex::imageSize(const ImageHeader& header) {
+    return IMAGE_PAGE_SIZE + pilotBytes(header) + (size_t)header.slotCount * sizeof(uint64_t);
+}
+
+PerfectHashCardIndex* PerfectHashCardIndex::open(CardImageMemory* memory, bool verify, const char*& error) {
+    if (memory == NULL) {
+        error = "Failed to read card image";
+        return NULL;
+    }
+    std::unique_ptr<PerfectHashCardIndex> index(new PerfectHashCardIndex());
+    index->memory.reset(memory);
+    ImageHeader& header = index->header;
+    if (memory->size() < IMAGE_PAGE_SIZE) {
+        error = "Not a card image";
+        return NULL;
+    }
+    memcpy(&header, memory->data(), sizeof(header));
+    if (header.magic != IMAGE_MAGIC || header.version != IMAGE_VERSION || header.headerSize != sizeof(header)) {
+        error = "Not a card image";
+        return NULL;
+    }
+
+    // A mapped partition may be larger than the image in it; 64-bit math
+    // so huge counts can't wrap into a plausible size
+    uint64_t slotBytes = (uint64_t)header.slotCount * sizeof(uint64_t);
+    if (header.bucketCount == 0 || header.slotCount < header.keyCount || header.slotCount == 0 ||
+        IMAGE_PAGE_SIZE + pilotBytes(header) + slotBytes > memory->size() ||
+        (!memory->isMapped() && imageSize(header) != memory->size())) {
+        error = "Card image size mismatch";
+        return NULL;
+    }
+    const uint8_t* body = memory->data() + IMAGE_PAGE_SIZE;
+    index->pilots = (const uint16_t*)body;
+    index->slots = (const uint64_t*)(body + pilotBytes(header));
+    if (!verify) {
+        return index.release();
+    }
+
+    if (crc32(0, body, imageSize(header) - IMAGE_PAGE_SIZE) != header.crc) {
+        error = "Card image CRC mismatch";
+        return NULL;
+    }
+
+    // Every stored key must be where a lookup will look for it
+    size_t keys = 0;
+    for (size_t slot = 0; slot < header.slotCount; slot++) {
+        uint64_t key = index->slots[slot];
+        if (key == 0) continue;
+        if (index->slotFor(key) != slot) {
+            error = "Card image key in the wrong slot";
+            return NULL;
+        }
+        keys++;
+    }
+    if (keys != header.keyCount) {
+        error = "Card image key count mismatch";
+        return NULL;
+    }
+    return index.release();
+}
+
+size_t PerfectHashCardIndex::slotFor(uint64_t key) const {
+    // Bucket from the high half of the hash, then the pilot scrambles the
+    // hash into a slot; both ranges are mapped with a multiply-shift. The
+    // pilot is mixed in rather than XORed onto the slot bits, which would
+    // keep a bucket's keys in the same pattern for every pilot and leave
+    // small tables only a few hundred placements to try.
+    uint64_t hash = mix(key + header.seed * 0x9e3779b97f4a7c15ULL);
+    uint32_t bucket = ((hash >> 32) * header.bucketCount) >> 32;
+    uint32_t scrambled = (uint32_t)mix(hash ^ pilots[bucket]);
+    return ((uint64_t)scrambled * header.slotCount) >> 32;
+}
+
+bool PerfectHashCardIndex::contains(uint64_t key) const {
+    return key != 0 && slots[slotFor(key)] == key;
+}
+
+size_t PerfectHashCardIndex::getMemoryUsage() const {
+    // Heap only; a mapped image takes address space, not RAM
+    return memory->isMapped() ? 0 : memory->size();
+}
+
+size_t PerfectHashCardIndex::read(size_t& position, uint64_t* out, size_t count) const {
+    size_t n = 0;
+    while (n < count && position < header.slotCount) {
+        if (slots[position] != 0) {
+            out[n++] = slots[position];
+        }
+        position++;
+    }
+    return n;
+}
+
+void PerfectHashCardIndex::getSortedKeys(std::vector<uint64_t>& keys) const {
+    keys.clear();
+    keys.reserve(header.keyCount);
+    for (size_t slot = 0; slot < header.slotCount; slot++) {
+        if (slots[slot] != 0) {
+            keys.push_back(slots[slot]);
+        }
+    }
+    std::sort(keys.begin(), keys.end());
+}
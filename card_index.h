@@ -0,0 +1,182 @@
+#pragma once
+
+#include <Arduino.h>
+#include <memory>
+#include <vector>
+#include "card_image_memory.h"
+
+// In-RAM lookup structure for a card set's 64-bit keys. Indexes are built
+// once from a sorted, de-duplicated key list and never modified, so they
+// can be shared by concurrent readers without locking.
+class CardIndex {
+public:
+    enum Type : uint8_t {
+        SORTED,  // Sorted array, binary search; 8 bytes per card
+        HASH,    // Open addressing with linear probing; O(1) lookups, ~11-21 bytes per card
+        BLOCK,   // Delta-varint compressed blocks; ~2 bytes per card for dense card runs
+        PERFECT  // Minimal perfect hash image built offline; one probe, ~4 bits over 8 bytes per card
+    };
+
+    // Builds an index of the given type from `keys`, which must be sorted
+    // and de-duplicated. The vector may be consumed. PERFECT indexes can
+    // only be loaded from an image, so asking for one builds a SORTED index.
+    static CardIndex* create(Type type, std::vector<uint64_t>& keys);
+    static const char* typeName(Type type);
+
+    virtual ~CardIndex() {}
+
+    virtual Type getType() const = 0;
+    virtual bool contains(uint64_t key) const = 0;
+    virtual size_t size() const = 0;
+    virtual size_t getMemoryUsage() const = 0;
+
+    // Mean slots or comparisons touched by a lookup for a key in the set
+    virtual float getAverageProbes() const = 0;
+
+    // Copies up to `count` keys into `out`, starting from `position`, and
+    // advances it; returns the number copied, 0 at the end. Start from a
+    // position of 0. Keys come in index order, which for a hash index is
+    // not ascending.
+    virtual size_t read(size_t& position, uint64_t* out, size_t count) const = 0;
+
+    // Replaces `keys` with every key in ascending order
+    virtual void getSortedKeys(std::vector<uint64_t>& keys) const = 0;
+
+    // MurmurHash3 fmix64; keys from one facility differ only in the low
+    // bits. Also hashes cards into the card set digest.
+    static uint64_t mix(uint64_t key);
+};
+
+class SortedCardIndex : public CardIndex {
+public:
+    explicit SortedCardIndex(std::vector<uint64_t>& keys);
+
+    Type getType() const override { return SORTED; }
+    bool contains(uint64_t key) const override;
+    size_t size() const override { return keys.size(); }
+    size_t getMemoryUsage() const override { return keys.capacity() * sizeof(uint64_t); }
+    float getAverageProbes() const override;
+    size_t read(size_t& position, uint64_t* out, size_t count) const override;
+    void getSortedKeys(std::vector<uint64_t>& keys) const override;
+
+private:
+    std::vector<uint64_t> keys;
+};
+
+class HashCardIndex : public CardIndex {
+public:
+    // Table sizes are powers of two kept at most 3/4 full
+    static constexpr size_t MAX_LOAD_NUMERATOR = 3;
+    static constexpr size_t MAX_LOAD_DENOMINATOR = 4;
+
+    explicit HashCardIndex(const std::vector<uint64_t>& keys);
+
+    Type getType() const override { return HASH; }
+    bool contains(uint64_t key) const override;
+    size_t size() const override { return count; }
+    size_t getMemoryUsage() const override { return slots.size() * sizeof(uint64_t); }
+    float getAverageProbes() const override;
+    size_t read(size_t& position, uint64_t* out, size_t count) const override;
+    void getSortedKeys(std::vector<uint64_t>& keys) const override;
+
+private:
+    // A zero slot is empty; key 0 itself, if present, is kept aside
+    std::vector<uint64_t> slots;
+    size_t mask;
+    size_t count;
+    bool hasZero;
+    uint64_t totalProbes;  // Summed over every key at build time
+};
+
+class BlockCardIndex : public CardIndex {
+public:
+    // Keys per block; a lookup decodes at most one block
+    static constexpr size_t BLOCK_SIZE = 64;
+
+    explicit BlockCardIndex(const std::vector<uint64_t>& keys);
+
+    Type getType() const override { return BLOCK; }
+    bool contains(uint64_t key) const override;
+    size_t size() const override { return count; }
+    size_t getMemoryUsage() const override;
+    float getAverageProbes() const override;
+    size_t read(size_t& position, uint64_t* out, size_t count) const override;
+    void getSortedKeys(std::vector<uint64_t>& keys) const override;
+
+private:
+    // Each block's first key is kept whole in firstKeys and binary
+    // searched; the rest are LEB128 varint gaps from the previous key,
+    // starting at offsets[block] in data
+    std::vector<uint64_t> firstKeys;
+    std::vector<uint32_t> offsets;
+    std::vector<uint8_t> data;
+    size_t count;
+
+    const uint8_t* blockEnd(size_t block) const;
+    static uint64_t readVarint(const uint8_t*& p);
+};
+
+// Read-only table built offline by tools/card_image.py. Keys are spread
+// over `bucketCount` buckets by hash, and each bucket has a 16-bit pilot
+// chosen by the builder so that its keys land in distinct slots of a
+// table about 1% larger than the key count. A lookup is two hashes, one
+// pilot read and one compare of the full key in the slot, so unlike a
+// fingerprint table it never accepts a card that isn't enrolled.
+//
+// Lookups run directly on the image bytes, which are usually mapped from
+// flash. Image layout, little-endian, in IMAGE_PAGE_SIZE pages: an
+// ImageHeader alone in the first page, `bucketCount` uint16 pilots from
+// the second, then `slotCount` uint64 keys from the next page boundary,
+// with 0 marking an empty slot. The CRC covers everything after the
+// header page, so the device can stamp the generation, and the header
+// page can be written on its own after the rest.
+class PerfectHashCardIndex : public CardIndex {
+public:
+    static constexpr uint32_t IMAGE_MAGIC = 0x314D4943;  // "CIM1"
+    static constexpr uint16_t IMAGE_VERSION = 3;  // v2 XORed pilots onto the slot bits, v1 wasn't page aligned
+    static constexpr size_t IMAGE_PAGE_SIZE = 4096;  // Flash sector size
+
+    struct ImageHeader {
+        uint32_t magic;
+        uint16_t version;
+        uint16_t headerSize;
+        uint32_t keyCount;
+        uint32_t slotCount;
+        uint32_t bucketCount;
+        uint32_t seed;
+        uint32_t generation;  // Set by the device when the image is installed
+        uint32_t crc;
+    };
+    static_assert(sizeof(ImageHeader) == 32, "ImageHeader must match the image layout");
+
+    // Takes ownership of `memory` and checks the image header against it.
+    // With `verify`, also checks the CRC and that every key sits in the
+    // slot its hash selects, which reads the whole image; without it,
+    // opening costs the same for any size. Returns NULL with `error` set
+    // if a check fails.
+    static PerfectHashCardIndex* open(CardImageMemory* memory, bool verify, const char*& error);
+
+    // Size of the image a header describes
+    static size_t imageSize(const ImageHeader& header);
+
+    Type getType() const override { return PERFECT; }
+    bool contains(uint64_t key) const override;
+    size_t size() const override { return header.keyCount; }
+    size_t getMemoryUsage() const override;
+    float getAverageProbes() const override { return header.keyCount > 0 ? 1.0f : 0.0f; }
+    size_t read(size_t& position, uint64_t* out, size_t count) const override;
+    void getSortedKeys(std::vector<uint64_t>& keys) const override;
+
+    const ImageHeader& getHeader() const { return header; }
+    bool isMapped() const { return memory->isMapped(); }
+
+private:
+    ImageHeader header;
+    std::unique_ptr<CardImageMemory> memory;
+    const uint16_t* pilots;
+    const uint64_t* slots;
+
+    PerfectHashCardIndex() : pilots(NULL), slots(NULL) {}
+    static size_t pilotBytes(const ImageHeader& header);
+    size_t slotFor(uint64_t key) const;
+};
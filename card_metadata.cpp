@@ -0,0 +1,45 @@
+#include "card_metadata.h"
+#include <algorithm>
+
+CardMetadata::CardMetadata(std::vector<uint64_t>& cards, std::vector<uint32_t>& starts,
+                           std::vector<uint32_t>& expiries, std::vector<uint16_t>& doors,
+                           std::vector<uint8_t>& schedules, std::vector<uint32_t>& labels) {
+    this->cards.swap(cards);
+    this->starts.swap(starts);
+    this->expiries.swap(expiries);
+    this->doors.swap(doors);
+    this->schedules.swap(schedules);
+    this->labels.swap(labels);
+}
+
+size_t CardMetadata::find(uint64_t card) const {
+    std::vector<uint64_t>::const_iterator it = std::lower_bound(cards.begin(), cards.end(), card);
+    return it != cards.end() && *it == card ? it - cards.begin() : NOT_FOUND;
+}
+
+AccessDecision CardMetadata::check(uint64_t card, uint8_t door, uint32_t now, const AccessSchedules& table,
+                                   uint16_t slot) const {
+    size_t row = find(card);
+    if (row == NOT_FOUND) {
+        return AccessDecision::GRANTED;
+    }
+    if (door >= 16 || !(doors[row] & (1 << door))) {
+        return AccessDecision::DOOR_REFUSED;
+    }
+    if (now != 0 && starts[row] != 0 && now < starts[row]) {
+        return AccessDecision::NOT_YET_VALID;
+    }
+    if (now != 0 && expiries[row] != 0 && now >= expiries[row]) {
+        return AccessDecision::EXPIRED;
+    }
+    if (now != 0 && !table.allows(schedules[row], slot)) {
+        return AccessDecision::OUTSIDE_SCHEDULE;
+    }
+    return AccessDecision::GRANTED;
+}
+
+size_t CardMetadata::getMemoryUsage() const {
+    return cards.capacity() * sizeof(uint64_t) + starts.capacity() * sizeof(uint32_t) +
+           expiries.capacity() * sizeof(uint32_t) + doors.capacity() * sizeof(uint16_t) +
+           schedules.capacity() * sizeof(uint8_t) + labels.capacity() * sizeof(uint32_t);
+}
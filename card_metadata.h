@@ -0,0 +1,69 @@
+#pragma once
+
+#include <Arduino.h>
+#include <vector>
+#include "access_cache.h"
+#include "access_schedule.h"
+
+// Per-card limits and labels, held beside the card index as a column
+// store: a sorted card key column and one parallel fixed-width array per
+// field. A swipe's check binary searches the key column and reads one
+// entry each of the start, expiry, door and schedule columns, and nothing
+// else.
+// Labels aren't in RAM at all; each row holds an offset into a string
+// pool the card database leaves on flash and reads only for admin views.
+//
+// Cards without a row have no limits. A change to one row rebuilds the
+// columns into a new table, which the card database swaps in for the old.
+class CardMetadata {
+public:
+    static constexpr uint16_t ALL_DOORS = 0xFFFF;
+    static constexpr uint32_t NO_LABEL = UINT32_MAX;
+    static constexpr size_t MAX_LABEL = 63;  // Bytes, without the terminator
+    static constexpr size_t NOT_FOUND = SIZE_MAX;
+
+    // One row with its label, for admin views and edits
+    struct Entry {
+        uint64_t card;
+        uint32_t start;   // Seconds since the epoch; 0 for no start date
+        uint32_t expiry;  // First second the card is refused; 0 for never
+        uint16_t doors;   // Bit n allows reader n
+        uint8_t schedule; // AccessSchedules id, or AccessSchedules::NONE
+        String label;
+    };
+
+    CardMetadata() {}
+
+    // Takes the columns, which must all be the same length, with `cards`
+    // sorted and unique; labels are pool offsets or NO_LABEL
+    CardMetadata(std::vector<uint64_t>& cards, std::vector<uint32_t>& starts,
+                 std::vector<uint32_t>& expiries, std::vector<uint16_t>& doors,
+                 std::vector<uint8_t>& schedules, std::vector<uint32_t>& labels);
+
+    // The decision for an enrolled card swiped at reader `door` at time
+    // `now`, in seconds since the epoch, which is in `slot` of the
+    // schedule table. A `now` of 0 means the clock isn't set, and skips the
+    // date and schedule checks.
+    AccessDecision check(uint64_t card, uint8_t door, uint32_t now, const AccessSchedules& table,
+                         uint16_t slot) const;
+
+    size_t find(uint64_t card) const;
+    size_t size() const { return cards.size(); }
+    size_t getMemoryUsage() const;
+
+    // Columns, for persisting the table and reading rows back
+    const std::vector<uint64_t>& getCards() const { return cards; }
+    const std::vector<uint32_t>& getStarts() const { return starts; }
+    const std::vector<uint32_t>& getExpiries() const { return expiries; }
+    const std::vector<uint16_t>& getDoors() const { return doors; }
+    const std::vector<uint8_t>& getSchedules() const { return schedules; }
+    const std::vector<uint32_t>& getLabels() const { return labels; }
+
+private:
+    std::vector<uint64_t> cards;
+    std::vector<uint32_t> starts;
+    std::vector<uint32_t> expiries;
+    std::vector<uint16_t> doors;
+    std::vector<uint8_t> schedules;
+    std::vector<uint32_t> labels;
+};
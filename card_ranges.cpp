@@ -0,0 +1,74 @@
+#include "card_ranges.h"
+#include <algorithm>
+
+CardRanges::CardRanges(std::vector<uint64_t>& firsts, std::vector<uint64_t>& lasts) {
+    this->firsts.swap(firsts);
+    this->lasts.swap(lasts);
+}
+
+bool CardRanges::contains(uint64_t card) const {
+    // The last range starting at or before the card
+    std::vector<uint64_t>::const_iterator it = std::upper_bound(firsts.begin(), firsts.end(), card);
+    return it != firsts.begin() && card <= lasts[it - firsts.begin() - 1];
+}
+
+CardRanges* CardRanges::with(uint64_t first, uint64_t last) const {
+    // Ranges either side are copied; those overlapping or touching the new
+    // one on the same facility are folded into it
+    std::vector<uint64_t> newFirsts;
+    std::vector<uint64_t> newLasts;
+    size_t i = 0;
+    for (; i < size() && lasts[i] < first && !(lasts[i] + 1 == first && lasts[i] >> 32 == first >> 32); i++) {
+        newFirsts.push_back(firsts[i]);
+        newLasts.push_back(lasts[i]);
+    }
+    for (; i < size() && (firsts[i] <= last || (firsts[i] == last + 1 && firsts[i] >> 32 == last >> 32)); i++) {
+        first = std::min(first, firsts[i]);
+        last = std::max(last, lasts[i]);
+    }
+    newFirsts.push_back(first);
+    newLasts.push_back(last);
+    newFirsts.insert(newFirsts.end(), firsts.begin() + i, firsts.end());
+    newLasts.insert(newLasts.end(), lasts.begin() + i, lasts.end());
+    if (newFirsts.size() > MAX_RANGES) {
+        return NULL;
+    }
+    return new CardRanges(newFirsts, newLasts);
+}
+
+CardRanges* CardRanges::without(uint64_t first, uint64_t last) const {
+    std::vector<uint64_t> newFirsts;
+    std::vector<uint64_t> newLasts;
+    for (size_t i = 0; i < size(); i++) {
+        if (lasts[i] < first || firsts[i] > last) {
+            newFirsts.push_back(firsts[i]);
+            newLasts.push_back(lasts[i]);
+            continue;
+        }
+        // Whatever sticks out either side is kept
+        if (firsts[i] < first) {
+            newFirsts.push_back(firsts[i]);
+            newLasts.push_back(first - 1);
+        }
+        if (lasts[i] > last) {
+            newFirsts.push_back(last + 1);
+            newLasts.push_back(lasts[i]);
+        }
+    }
+    if (newFirsts.size() > MAX_RANGES) {
+        return NULL;
+    }
+    return new CardRanges(newFirsts, newLasts);
+}
+
+uint64_t CardRanges::getCardCount() const {
+    uint64_t count = 0;
+    for (size_t i = 0; i < size(); i++) {
+        count += lasts[i] - firsts[i] + 1;
+    }
+    return count;
+}
+
+size_t CardRanges::getMemoryUsage() const {
+    return (firsts.capacity() + lasts.capacity()) * sizeof(uint64_t);
+}
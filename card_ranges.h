@@ -0,0 +1,43 @@
+#pragma once
+
+#include <Arduino.h>
+#include <vector>
+
+// Grants for whole runs of card numbers, such as a tenant's batch of
+// badges, as sorted, non-overlapping intervals of card keys. A range never
+// spans two formats or facilities, so in key order it is one facility's
+// cards from `first` to `last`. A lookup is one binary search over the
+// range starts, and memory goes with the number of ranges, not the cards
+// in them.
+//
+// with() and without() return a changed copy rather than editing the
+// table, so swipes can keep reading the published one meanwhile.
+class CardRanges {
+public:
+    static constexpr size_t MAX_RANGES = 1024;
+
+    CardRanges() {}
+
+    // Takes the columns, which must be the same length, sorted by start
+    // and non-overlapping, with each first <= last
+    CardRanges(std::vector<uint64_t>& firsts, std::vector<uint64_t>& lasts);
+
+    bool contains(uint64_t card) const;
+
+    // The table with [first, last] added, merged with any range it
+    // overlaps or touches on the same facility, or taken out, which can
+    // split a range in two. Both keys must be on the same format and
+    // facility. Null if the result would have more than MAX_RANGES.
+    CardRanges* with(uint64_t first, uint64_t last) const;
+    CardRanges* without(uint64_t first, uint64_t last) const;
+
+    size_t size() const { return firsts.size(); }
+    uint64_t getCardCount() const;  // Cards covered by all ranges
+    size_t getMemoryUsage() const;
+    const std::vector<uint64_t>& getFirsts() const { return firsts; }
+    const std::vector<uint64_t>& getLasts() const { return lasts; }
+
+private:
+    std::vector<uint64_t> firsts;
+    std::vector<uint64_t> lasts;
+};
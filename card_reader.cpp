@@ -12,7 +12,7 @@ CardReader::CardReader(ADS7828& adc, uint8_t data0Pin, uint8_t data1Pin,
                       bool ignoreParityErrors)
     : adc(adc), data0Pin(data0Pin), data1Pin(data1Pin),
       fuseFeedbackChannel(fuseFeedbackChannel), currentChannel(currentChannel),
-      bitw(0), timeout(0), bitcnt(0), decodedCardId(0), decodedSiteCode(0), firstBitTime(0), waitingForRise(false),
+      bitw(0), timeout(0), bitcnt(0), decodedCardId(0), decodedSiteCode(0), decodedFormat(0), decodedRaw(0), firstBitTime(0), waitingForRise(false),
       currentBitPin(0), ignoreParityErrors(ignoreParityErrors),
       currentBufferIndex(0), currentBufferCount(0) {
     
@@ -167,6 +167,8 @@ void CardReader::decodeCard() {
     // Extract card info and store in class variables
     decodedSiteCode = (bitwtmp >> 17) & 0x0000ff;
     decodedCardId = (bitwtmp >> 1) & 0x0ffff;
+    decodedFormat = bitcnttmp;
+    decodedRaw = bitwtmp;
     
     // Create and store the burst data
     lastBurst.data = bitwtmp;
@@ -190,6 +192,14 @@ unsigned int CardReader::getSiteCode() {
     return decodedSiteCode;
 }
 
+unsigned int CardReader::getCardFormat() {
+    return decodedFormat;
+}
+
+unsigned long long CardReader::getRawData() {
+    return decodedRaw;
+}
+
 float CardReader::getCurrent() const {
     // Return the rolling average (buffer updated via update() method)
     return calculateAverageCurrent();
@@ -54,6 +54,8 @@ public:
     bool isCardPresent() const;
     long getCardId();
     unsigned int getSiteCode();
+    unsigned int getCardFormat();  // Bit count of the last decoded card
+    unsigned long long getRawData();  // Undecoded bits of the last card, parity included
     void decodeCard();
     float getCurrent() const;
     bool isFuseGood() const;
@@ -81,6 +83,8 @@ private:
     // Decoded card information
     unsigned long int decodedCardId;
     unsigned int decodedSiteCode;
+    unsigned int decodedFormat;
+    unsigned long long decodedRaw;
     
     // Timing tracking
     unsigned long firstBitTime;     // Time of first falling edge
@@ -0,0 +1,34 @@
+#include "card_usage.h"
+#include <algorithm>
+
+bool CardUsage::record(uint64_t card, uint32_t now) {
+    std::vector<uint64_t>::iterator it = std::lower_bound(cards.begin(), cards.end(), card);
+    size_t row = it - cards.begin();
+    if (it == cards.end() || *it != card) {
+        if (cards.size() >= MAX_ROWS) {
+            return false;
+        }
+        cards.insert(it, card);
+        lastSeen.insert(lastSeen.begin() + row, 0);
+        counts.insert(counts.begin() + row, 0);
+    }
+    if (now != 0) {
+        lastSeen[row] = now;
+    }
+    if (counts[row] != UINT32_MAX) {
+        counts[row]++;
+    }
+    return true;
+}
+
+void CardUsage::assign(std::vector<uint64_t>& cards, std::vector<uint32_t>& lastSeen,
+                       std::vector<uint32_t>& counts) {
+    this->cards.swap(cards);
+    this->lastSeen.swap(lastSeen);
+    this->counts.swap(counts);
+}
+
+size_t CardUsage::getMemoryUsage() const {
+    return cards.capacity() * sizeof(uint64_t) + lastSeen.capacity() * sizeof(uint32_t) +
+           counts.capacity() * sizeof(uint32_t);
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <Arduino.h>
+#include <vector>
+
+// Swipe counts and last-seen times per card, for finding members who have
+// stopped coming without reading the access log. Held as a column store
+// like CardMetadata: a sorted card key column and parallel last-seen and
+// count arrays. Only cards that have been swiped have a row, so a swipe
+// costs a binary search, plus an insert the first time a card is seen.
+//
+// Unlike the other tables this one is changed in place on every swipe, so
+// the caller serializes all access to it.
+class CardUsage {
+public:
+    static constexpr size_t MAX_ROWS = 16384;
+
+    struct Entry {
+        uint64_t card;
+        uint32_t lastSeen;  // Seconds since the epoch; 0 if only seen before the clock was set
+        uint32_t count;     // Swipes
+    };
+
+    CardUsage() {}
+
+    // Counts a swipe of `card` at `now`, in seconds since the epoch, or 0
+    // if the clock isn't set, which leaves the last-seen time alone. False
+    // if the card has no row and the table is full.
+    bool record(uint64_t card, uint32_t now);
+
+    // Takes the columns, which must all be the same length, with `cards`
+    // sorted and unique
+    void assign(std::vector<uint64_t>& cards, std::vector<uint32_t>& lastSeen, std::vector<uint32_t>& counts);
+
+    // Drops the rows of cards `keep` returns false for; returns how many
+    template <typename Keep>
+    size_t prune(Keep keep) {
+        size_t kept = 0;
+        for (size_t i = 0; i < cards.size(); i++) {
+            if (keep(cards[i])) {
+                cards[kept] = cards[i];
+                lastSeen[kept] = lastSeen[i];
+                counts[kept] = counts[i];
+                kept++;
+            }
+        }
+        size_t dropped = cards.size() - kept;
+        cards.resize(kept);
+        lastSeen.resize(kept);
+        counts.resize(kept);
+        return dropped;
+    }
+
+    size_t size() const { return cards.size(); }
+    size_t getMemoryUsage() const;
+    Entry getEntry(size_t row) const { return Entry{cards[row], lastSeen[row], counts[row]}; }
+
+    // Columns, for persisting the table
+    const std::vector<uint64_t>& getCards() const { return cards; }
+    const std::vector<uint32_t>& getLastSeen() const { return lastSeen; }
+    const std::vector<uint32_t>& getCounts() const { return counts; }
+
+private:
+    std::vector<uint64_t> cards;
+    std::vector<uint32_t> lastSeen;
+    std::vector<uint32_t> counts;
+};
@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// CRC-32 (IEEE 802.3), chained through `crc`: start from 0 and pass the
+// previous result to continue a running CRC. Checks the card store's
+// files and card images. Only needs the C library, so the modules that
+// use it build on a host too.
+uint32_t crc32(uint32_t crc, const uint8_t* data, size_t len);
@@ -0,0 +1,178 @@
+#include "cuckoo_filter.h"
+#include <algorithm>
+
+CuckooFilter::CuckooFilter()
+    : mask(0), count(0), hasVictim(false), victimBucket(0), victimFingerprint(0) {
+}
+
+uint64_t CuckooFilter::mix(uint64_t key) {
+    // splitmix64 finalizer; composite keys differ mostly in their low bits
+    key ^= key >> 30;
+    key *= 0xbf58476d1ce4e5b9ULL;
+    key ^= key >> 27;
+    key *= 0x94d049bb133111ebULL;
+    key ^= key >> 31;
+    return key;
+}
+
+uint32_t CuckooFilter::bucketsFor(size_t count) {
+    // Powers of two, so the alternate bucket is an XOR; never empty
+    uint32_t buckets = 1;
+    while (buckets * SLOTS_PER_BUCKET * BUILD_LOAD < count * 16) {
+        buckets *= 2;
+    }
+    return buckets;
+}
+
+size_t CuckooFilter::altBucket(size_t bucket, uint16_t fingerprint) const {
+    // Its own inverse, so either bucket leads to the other
+    return (bucket ^ (fingerprint * 0x5bd1e995UL)) & mask;
+}
+
+void CuckooFilter::locate(uint64_t key, size_t& bucket1, size_t& bucket2, uint16_t& fingerprint) const {
+    uint64_t hash = mix(key);
+    fingerprint = hash >> 48;
+    if (fingerprint == 0) {
+        fingerprint = 1;
+    }
+    bucket1 = hash & mask;
+    bucket2 = altBucket(bucket1, fingerprint);
+}
+
+bool CuckooFilter::insertInto(size_t bucket, uint16_t fingerprint) {
+    uint16_t* slots = &table[bucket * SLOTS_PER_BUCKET];
+    for (size_t i = 0; i < SLOTS_PER_BUCKET; i++) {
+        if (slots[i] == 0) {
+            slots[i] = fingerprint;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool CuckooFilter::removeFrom(size_t bucket, uint16_t fingerprint) {
+    uint16_t* slots = &table[bucket * SLOTS_PER_BUCKET];
+    for (size_t i = 0; i < SLOTS_PER_BUCKET; i++) {
+        if (slots[i] == fingerprint) {
+            slots[i] = 0;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool CuckooFilter::bucketHas(size_t bucket, uint16_t fingerprint) const {
+    const uint16_t* slots = &table[bucket * SLOTS_PER_BUCKET];
+    for (size_t i = 0; i < SLOTS_PER_BUCKET; i++) {
+        if (slots[i] == fingerprint) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void CuckooFilter::build(const uint64_t* keys, size_t n) {
+    for (uint32_t buckets = bucketsFor(n); ; buckets *= 2) {
+        table.assign(buckets * SLOTS_PER_BUCKET, 0);
+        mask = buckets - 1;
+        count = 0;
+        hasVictim = false;
+        size_t added = 0;
+        while (added < n && add(keys[added])) {
+            added++;
+        }
+        // An unlucky placement at the build load just means one size up
+        if (added == n && !hasVictim) {
+            return;
+        }
+    }
+}
+
+bool CuckooFilter::add(uint64_t key) {
+    if (table.empty() || hasVictim || (count + 1) * 16 > table.size() * MAX_LOAD) {
+        return false;
+    }
+
+    size_t bucket1, bucket2;
+    uint16_t fingerprint;
+    locate(key, bucket1, bucket2, fingerprint);
+    count++;
+    if (insertInto(bucket1, fingerprint) || insertInto(bucket2, fingerprint)) {
+        return true;
+    }
+
+    // Both buckets full: evict a fingerprint to its other bucket, and so
+    // on down the chain. Slot choice just needs to vary between kicks.
+    size_t bucket = (fingerprint & 1) ? bucket1 : bucket2;
+    for (size_t kick = 0; kick < MAX_KICKS; kick++) {
+        size_t slot = (fingerprint + kick) % SLOTS_PER_BUCKET;
+        std::swap(fingerprint, table[bucket * SLOTS_PER_BUCKET + slot]);
+        bucket = altBucket(bucket, fingerprint);
+        if (insertInto(bucket, fingerprint)) {
+            return true;
+        }
+    }
+    // The key is in; the last evicted fingerprint waits aside
+    hasVictim = true;
+    victimBucket = bucket;
+    victimFingerprint = fingerprint;
+    return true;
+}
+
+bool CuckooFilter::remove(uint64_t key) {
+    if (table.empty()) {
+        return false;
+    }
+
+    size_t bucket1, bucket2;
+    uint16_t fingerprint;
+    locate(key, bucket1, bucket2, fingerprint);
+    if (removeFrom(bucket1, fingerprint) || removeFrom(bucket2, fingerprint)) {
+        count--;
+        // A slot just opened up; give it to the waiting fingerprint
+        if (hasVictim && (insertInto(victimBucket, victimFingerprint) ||
+                          insertInto(altBucket(victimBucket, victimFingerprint), victimFingerprint))) {
+            hasVictim = false;
+        }
+        return true;
+    }
+    if (hasVictim && victimFingerprint == fingerprint && (victimBucket == bucket1 || victimBucket == bucket2)) {
+        hasVictim = false;
+        count--;
+        return true;
+    }
+    return false;
+}
+
+bool CuckooFilter::mightContain(uint64_t key) const {
+    if (table.empty()) {
+        return false;
+    }
+
+    size_t bucket1, bucket2;
+    uint16_t fingerprint;
+    locate(key, bucket1, bucket2, fingerprint);
+    return bucketHas(bucket1, fingerprint) || bucketHas(bucket2, fingerprint) ||
+           (hasVictim && victimFingerprint == fingerprint && (victimBucket == bucket1 || victimBucket == bucket2));
+}
+
+float CuckooFilter::getFillRatio() const {
+    return table.empty() ? 0.0f : (float)count / table.size();
+}
+
+float CuckooFilter::getFalsePositiveRate() const {
+    // A miss is compared against the fingerprints in two buckets
+    return 2 * SLOTS_PER_BUCKET * getFillRatio() / 65535.0f;
+}
+
+bool CuckooFilter::assign(std::vector<uint16_t>& newTable) {
+    size_t buckets = newTable.size() / SLOTS_PER_BUCKET;
+    if (buckets == 0 || (buckets & (buckets - 1)) != 0 || newTable.size() != buckets * SLOTS_PER_BUCKET) {
+        return false;
+    }
+    table.swap(newTable);
+    mask = buckets - 1;
+    count = table.size() - std::count(table.begin(), table.end(), 0);
+    hasVictim = false;
+    return true;
+}
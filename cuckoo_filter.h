@@ -0,0 +1,77 @@
+#pragma once
+
+#include <Arduino.h>
+#include <vector>
+
+// Cuckoo filter over 64-bit card keys. A miss is definite, so lookups for
+// cards that were never enrolled stop here without touching the index; a
+// hit still has to be confirmed against it. Each key leaves a 16-bit
+// fingerprint in one of two 4-slot buckets, which can be removed again,
+// so the filter follows card adds and revocations instead of being
+// rebuilt for each change. The false positive rate is below 0.015% at
+// any fill.
+//
+// Only keys that were added may be removed, and each key only once; the
+// card database guarantees both. The filter is copyable, so a new card
+// set can start from the previous set's filter.
+class CuckooFilter {
+public:
+    static constexpr size_t SLOTS_PER_BUCKET = 4;
+    static constexpr size_t MAX_KICKS = 500;
+
+    // build() sizes the table to at most BUILD_LOAD full, and add() stops
+    // accepting keys past MAX_LOAD, where inserts start to need long
+    // eviction chains; both in sixteenths
+    static constexpr size_t BUILD_LOAD = 12;
+    static constexpr size_t MAX_LOAD = 15;
+
+    CuckooFilter();
+
+    // Table size build() picks for `count` keys, in buckets
+    static uint32_t bucketsFor(size_t count);
+
+    // Size the filter for `count` keys and insert them all
+    void build(const uint64_t* keys, size_t count);
+
+    // Returns false if the filter is full, in which case it is unchanged
+    // and has to be rebuilt larger to take the key
+    bool add(uint64_t key);
+    bool remove(uint64_t key);
+    bool mightContain(uint64_t key) const;
+
+    // An empty filter has no table at all and is never consulted
+    bool isEmpty() const { return table.empty(); }
+    size_t size() const { return count; }
+    size_t getCapacity() const { return table.size(); }
+    size_t getMemoryUsage() const { return table.size() * sizeof(uint16_t); }
+
+    // Fraction of slots in use, and the false positive rate that implies
+    float getFillRatio() const;
+    float getFalsePositiveRate() const;
+
+    // Raw fingerprint table, for persisting the filter; assign() takes
+    // ownership of a table and returns false if it isn't one this class
+    // could have produced. A filter holding an evicted fingerprint outside
+    // the table can't be saved this way; isSaveable() says so.
+    const std::vector<uint16_t>& getTable() const { return table; }
+    bool assign(std::vector<uint16_t>& table);
+    bool isSaveable() const { return !hasVictim; }
+
+private:
+    std::vector<uint16_t> table;  // 0 marks an empty slot
+    size_t mask;                  // Bucket count - 1
+    size_t count;
+
+    // A fingerprint evicted by an insert that ran out of kicks; the filter
+    // takes no more keys while it is held
+    bool hasVictim;
+    size_t victimBucket;
+    uint16_t victimFingerprint;
+
+    static uint64_t mix(uint64_t key);
+    size_t altBucket(size_t bucket, uint16_t fingerprint) const;
+    void locate(uint64_t key, size_t& bucket1, size_t& bucket2, uint16_t& fingerprint) const;
+    bool insertInto(size_t bucket, uint16_t fingerprint);
+    bool removeFrom(size_t bucket, uint16_t fingerprint);
+    bool bucketHas(size_t bucket, uint16_t fingerprint) const;
+};
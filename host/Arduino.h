@@ -0,0 +1,139 @@
+#pragma once
+
+// Host stand-ins for the parts of the Arduino core the card store uses,
+// so its modules build and run under g++ for the test_*.sh scripts. Only
+// what those modules call is here; none of it is used on the controller.
+
+#include <chrono>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <thread>
+
+#define IRAM_ATTR
+#define PROGMEM
+
+class String {
+public:
+    String() {}
+    String(const char* text) : s(text ? text : "") {}
+    String(const std::string& text) : s(text) {}
+    String(char c) : s(1, c) {}
+    String(int value) : s(std::to_string(value)) {}
+    String(unsigned value) : s(std::to_string(value)) {}
+    String(long value) : s(std::to_string(value)) {}
+    String(unsigned long value) : s(std::to_string(value)) {}
+    String(long long value) : s(std::to_string(value)) {}
+    String(unsigned long long value) : s(std::to_string(value)) {}
+    String(double value, int decimals = 2) {
+        char text[32];
+        snprintf(text, sizeof(text), "%.*f", decimals, value);
+        s = text;
+    }
+
+    unsigned length() const { return s.size(); }
+    const char* c_str() const { return s.c_str(); }
+    bool isEmpty() const { return s.empty(); }
+    long toInt() const { return atol(s.c_str()); }
+    bool reserve(unsigned size) { s.reserve(size); return true; }
+    bool concat(const char* text, unsigned length) { s.append(text, length); return true; }
+    char operator[](unsigned i) const { return s[i]; }
+
+    String& operator+=(const String& other) { s += other.s; return *this; }
+    String& operator+=(const char* other) { s += other; return *this; }
+    String& operator+=(char c) { s += c; return *this; }
+    friend String operator+(const String& a, const String& b) { return String(a.s + b.s); }
+    friend String operator+(const String& a, const char* b) { return String(a.s + b); }
+    friend String operator+(const char* a, const String& b) { return String(a + b.s); }
+    bool operator==(const String& other) const { return s == other.s; }
+    bool operator==(const char* other) const { return s == other; }
+    bool operator!=(const char* other) const { return s != other; }
+
+    int indexOf(char c, unsigned from = 0) const { return position(s.find(c, from)); }
+    int indexOf(const char* text, unsigned from = 0) const { return position(s.find(text, from)); }
+    String substring(unsigned start) const { return String(s.substr(start)); }
+    String substring(unsigned start, unsigned end) const { return String(s.substr(start, end - start)); }
+    bool startsWith(const char* prefix) const { return s.compare(0, strlen(prefix), prefix) == 0; }
+    bool equals(const char* other) const { return s == other; }
+    void trim() {
+        size_t start = s.find_first_not_of(" \t\r\n");
+        s = start == std::string::npos ? "" : s.substr(start, s.find_last_not_of(" \t\r\n") - start + 1);
+    }
+
+private:
+    std::string s;
+    static int position(size_t found) { return found == std::string::npos ? -1 : (int)found; }
+};
+
+class Print {
+public:
+    virtual ~Print() {}
+    virtual size_t write(const uint8_t* data, size_t length) = 0;
+    size_t write(uint8_t c) { return write(&c, 1); }
+    size_t print(const String& text) { return write((const uint8_t*)text.c_str(), text.length()); }
+    size_t print(const char* text) { return write((const uint8_t*)text, strlen(text)); }
+    template <typename T> size_t print(T value) { return print(String(value)); }
+    size_t println() { return print("\n"); }
+    template <typename T> size_t println(T value) { return print(value) + println(); }
+    size_t printf(const char* format, ...) {
+        char text[512];
+        va_list args;
+        va_start(args, format);
+        vsnprintf(text, sizeof(text), format, args);
+        va_end(args);
+        return print(text);
+    }
+};
+
+class Stream : public Print {
+public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+};
+
+// Serial output goes to stdout, or nowhere once muted, for benchmarks
+// that would drown in the store's boot messages
+class HardwareSerial : public Print {
+public:
+    bool muted = false;
+    void begin(unsigned long) {}
+    size_t write(const uint8_t* data, size_t length) override {
+        return muted ? length : fwrite(data, 1, length, stdout);
+    }
+};
+extern HardwareSerial Serial;
+
+inline unsigned long millis() {
+    using namespace std::chrono;
+    static steady_clock::time_point start = steady_clock::now();
+    return duration_cast<milliseconds>(steady_clock::now() - start).count();
+}
+
+inline unsigned long micros() {
+    using namespace std::chrono;
+    static steady_clock::time_point start = steady_clock::now();
+    return duration_cast<microseconds>(steady_clock::now() - start).count();
+}
+
+// From the controller's C library; glibc has no utoa()
+inline char* utoa(unsigned value, char* buffer, int base) {
+    char digits[33];
+    int count = 0;
+    do {
+        digits[count++] = "0123456789abcdefghijklmnopqrstuvwxyz"[value % base];
+        value /= base;
+    } while (value != 0);
+    for (int i = 0; i < count; i++) {
+        buffer[i] = digits[count - 1 - i];
+    }
+    buffer[count] = '\0';
+    return buffer;
+}
+
+inline void delay(unsigned long ms) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
@@ -0,0 +1,120 @@
+#pragma once
+
+// Host stand-in for the Arduino FS API, backed by a directory: path
+// "/x" opens "<root>/x". Writes can be cut off after a byte budget to
+// simulate a power cut; from then on nothing else reaches the disk, as
+// on a controller that has lost power.
+
+#include <Arduino.h>
+#include <memory>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define FILE_READ "r"
+#define FILE_WRITE "w"
+#define FILE_APPEND "a"
+
+enum SeekMode { SeekSet = SEEK_SET, SeekCur = SEEK_CUR, SeekEnd = SEEK_END };
+
+namespace fs {
+
+// Bytes still allowed to reach the disk, or -1 for no limit
+extern long hostWriteBudget;
+// Set once the budget runs out
+extern bool hostPowerLost;
+
+class File : public Stream {
+public:
+    File() {}
+    explicit File(FILE* file) : file(file, fclose) {}
+
+    explicit operator bool() const { return (bool)file; }
+
+    size_t write(const uint8_t* data, size_t length) override {
+        if (!file || hostPowerLost) {
+            return 0;
+        }
+        if (hostWriteBudget >= 0) {
+            if ((long)length > hostWriteBudget) {
+                length = hostWriteBudget;
+                hostPowerLost = true;
+            }
+            hostWriteBudget -= length;
+        }
+        return fwrite(data, 1, length, file.get());
+    }
+    using Print::write;
+
+    int read() override { return file ? fgetc(file.get()) : -1; }
+    size_t read(uint8_t* data, size_t length) { return file ? fread(data, 1, length, file.get()) : 0; }
+    int available() override { return size() - position(); }
+    size_t position() { return file ? ftell(file.get()) : 0; }
+    size_t size() {
+        if (!file) {
+            return 0;
+        }
+        long current = ftell(file.get());
+        fseek(file.get(), 0, SEEK_END);
+        long end = ftell(file.get());
+        fseek(file.get(), current, SEEK_SET);
+        return end;
+    }
+    bool seek(uint32_t position, SeekMode mode = SeekSet) { return file && fseek(file.get(), position, mode) == 0; }
+    void flush() {
+        if (file) {
+            fflush(file.get());
+        }
+    }
+    void close() { file.reset(); }
+
+    String readStringUntil(char terminator) {
+        std::string text;
+        int c;
+        while ((c = read()) >= 0 && c != terminator) {
+            text += (char)c;
+        }
+        return String(text);
+    }
+
+private:
+    std::shared_ptr<FILE> file;
+};
+
+class FS {
+public:
+    std::string root = ".";
+
+    bool begin(bool formatOnFail = false) {
+        (void)formatOnFail;
+        return true;
+    }
+    File open(const char* path, const char* mode = FILE_READ) {
+        bool reading = strcmp(mode, FILE_READ) == 0;
+        if (hostPowerLost && !reading) {
+            return File();
+        }
+        const char* hostMode = reading                        ? "rb"
+                               : strcmp(mode, FILE_WRITE) == 0 ? "wb"
+                               : strcmp(mode, "r+") == 0       ? "r+b"
+                                                               : "ab";
+        FILE* file = fopen((root + path).c_str(), hostMode);
+        return file ? File(file) : File();
+    }
+    File open(const String& path, const char* mode = FILE_READ) { return open(path.c_str(), mode); }
+    bool exists(const char* path) {
+        struct stat info;
+        return stat((root + path).c_str(), &info) == 0;
+    }
+    bool exists(const String& path) { return exists(path.c_str()); }
+    bool remove(const char* path) { return !hostPowerLost && unlink((root + path).c_str()) == 0; }
+    bool rename(const char* from, const char* to) {
+        return !hostPowerLost && ::rename((root + from).c_str(), (root + to).c_str()) == 0;
+    }
+    size_t totalBytes() { return 1 << 20; }
+    size_t usedBytes() { return 0; }
+};
+
+}  // namespace fs
+
+using fs::File;
+using fs::FS;
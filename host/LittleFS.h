@@ -0,0 +1,8 @@
+#pragma once
+
+// Host stand-in for the LittleFS mount, a directory set by its root
+// member; see FS.h
+
+#include <FS.h>
+
+extern fs::FS LittleFS;
@@ -0,0 +1,18 @@
+#pragma once
+
+// Host stand-ins for the FreeRTOS calls the card store makes. Tasks are
+// threads and ticks are milliseconds. See task.h and semphr.h.
+
+#include <cstdint>
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned UBaseType_t;
+
+#define pdTRUE 1
+#define pdFALSE 0
+#define pdPASS 1
+#define pdFAIL 0
+#define portMAX_DELAY 0xFFFFFFFFu
+#define portTICK_PERIOD_MS 1
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
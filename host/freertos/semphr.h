@@ -0,0 +1,34 @@
+#pragma once
+
+// Mutexes are std::timed_mutex, not recursive, as xSemaphoreCreateMutex()
+// makes them on the controller. Deleting one leaks it, because a deleted
+// task may still be blocked on it.
+
+#include "FreeRTOS.h"
+#include "task.h"
+#include <mutex>
+
+typedef std::timed_mutex* SemaphoreHandle_t;
+
+inline SemaphoreHandle_t xSemaphoreCreateMutex() {
+    return new std::timed_mutex();
+}
+
+inline void vSemaphoreDelete(SemaphoreHandle_t mutex) {
+    (void)mutex;
+}
+
+inline BaseType_t xSemaphoreTake(SemaphoreHandle_t mutex, TickType_t ticks) {
+    hostBlock();
+    bool taken = ticks == portMAX_DELAY ? (mutex->lock(), true) : mutex->try_lock_for(std::chrono::milliseconds(ticks));
+    if (taken && hostCurrentTask()->deleted) {
+        mutex->unlock();
+    }
+    hostUnblock();
+    return taken ? pdTRUE : pdFALSE;
+}
+
+inline BaseType_t xSemaphoreGive(SemaphoreHandle_t mutex) {
+    mutex->unlock();
+    return pdTRUE;
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+// A task is a detached thread with a notification count. A thread can't
+// be stopped from outside, so vTaskDelete() waits for the task to reach
+// a blocking call, and the call unwinds the task and ends its thread
+// instead of returning; on the controller it would have been stopped
+// wherever it was, so either way it never runs again once vTaskDelete()
+// returns. HostTasks are never freed, as a deleted task's thread may
+// still be blocked on its own.
+
+#include "FreeRTOS.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+struct HostTask {
+    std::mutex lock;
+    std::condition_variable woken;
+    uint32_t notifications = 0;
+    std::atomic<bool> deleted{false};
+    std::atomic<bool> blocked{false};  // In a blocking call, or stopped
+};
+
+// Thrown from a blocking call of a deleted task; caught where its thread
+// started
+struct HostTaskDeleted {};
+
+typedef HostTask* TaskHandle_t;
+typedef void (*TaskFunction_t)(void*);
+
+inline HostTask*& hostThreadTask() {
+    static thread_local HostTask* task = NULL;
+    return task;
+}
+
+// The calling thread's task; threads not started by xTaskCreate() share
+// one, like code running in the Arduino loop task
+inline HostTask* hostCurrentTask() {
+    static HostTask* loopTask = new HostTask();
+    HostTask* task = hostThreadTask();
+    return task != NULL ? task : loopTask;
+}
+
+// Around each blocking call; leaving one stops the task if it was
+// deleted meanwhile
+inline void hostBlock() {
+    hostCurrentTask()->blocked = true;
+}
+
+inline void hostUnblock() {
+    HostTask* task = hostCurrentTask();
+    task->blocked = false;
+    if (task->deleted) {
+        task->blocked = true;
+        throw HostTaskDeleted();
+    }
+}
+
+inline BaseType_t xTaskCreate(TaskFunction_t function, const char* name, uint32_t stackDepth, void* parameter,
+                              UBaseType_t priority, TaskHandle_t* handle) {
+    (void)name;
+    (void)stackDepth;
+    (void)priority;
+    HostTask* task = new HostTask();
+    std::thread([function, parameter, task]() {
+        hostThreadTask() = task;
+        try {
+            function(parameter);
+        } catch (const HostTaskDeleted&) {
+        }
+    }).detach();
+    if (handle != NULL) {
+        *handle = task;
+    }
+    return pdPASS;
+}
+
+inline void vTaskDelete(TaskHandle_t task) {
+    if (task == NULL || task == hostCurrentTask()) {
+        hostCurrentTask()->deleted = true;
+        hostUnblock();
+    }
+    task->deleted = true;
+    while (!task->blocked) {
+        std::this_thread::yield();
+    }
+}
+
+inline TaskHandle_t xTaskGetCurrentTaskHandle() {
+    return hostCurrentTask();
+}
+
+inline void vTaskDelay(TickType_t ticks) {
+    hostBlock();
+    std::this_thread::sleep_for(std::chrono::milliseconds(ticks));
+    hostUnblock();
+}
+
+inline void xTaskNotifyGive(TaskHandle_t task) {
+    {
+        std::lock_guard<std::mutex> guard(task->lock);
+        task->notifications++;
+    }
+    task->woken.notify_all();
+}
+
+inline uint32_t ulTaskNotifyTake(BaseType_t clearOnExit, TickType_t ticks) {
+    HostTask* task = hostCurrentTask();
+    hostBlock();
+    uint32_t count;
+    {
+        std::unique_lock<std::mutex> guard(task->lock);
+        auto notified = [task]() { return task->notifications > 0; };
+        if (ticks == portMAX_DELAY) {
+            task->woken.wait(guard, notified);
+        } else {
+            task->woken.wait_for(guard, std::chrono::milliseconds(ticks), notified);
+        }
+        count = task->notifications;
+        task->notifications = clearOnExit || count == 0 ? 0 : count - 1;
+    }
+    hostUnblock();
+    return count;
+}
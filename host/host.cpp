@@ -0,0 +1,10 @@
+#include <Arduino.h>
+#include <LittleFS.h>
+
+HardwareSerial Serial;
+fs::FS LittleFS;
+
+namespace fs {
+long hostWriteBudget = -1;
+bool hostPowerLost = false;
+}  // namespace fs
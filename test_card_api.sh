@@ -0,0 +1,282 @@
+#!/bin/bash
+
+# Base URL and auth
+BASE_URL="http://192.168.1.89"  # Change this to your ESP32's IP
+AUTH="admin:esp32"
+
+# Colors for output
+GREEN='\033[0;32m'
+RED='\033[0;31m'
+BLUE='\033[0;34m'
+NC='\033[0m' # No Color
+
+echo "Testing Card API Endpoints"
+echo "=========================="
+
+# Function to print response with a header
+print_response() {
+    local header=$1
+    local response=$2
+    echo -e "\n${BLUE}$header${NC}"
+    echo "----------------------------------------"
+    echo "$response"
+    echo "----------------------------------------"
+}
+
+# Test PUT /card
+echo -e "\n${GREEN}Testing PUT /card/12345${NC}"
+response=$(curl -s -X PUT -u $AUTH "$BASE_URL/card/12345")
+print_response "Response:" "$response"
+
+# Test GET /cards
+echo -e "\n${GREEN}Testing GET /cards${NC}"
+response=$(curl -s -u $AUTH "$BASE_URL/cards")
+print_response "Response:" "$response"
+
+# Test DELETE /card
+echo -e "\n${GREEN}Testing DELETE /card/12345${NC}"
+response=$(curl -s -X DELETE -u $AUTH "$BASE_URL/card/12345")
+print_response "Response:" "$response"
+
+# Test PUT /card with a facility code
+echo -e "\n${GREEN}Testing PUT /card?number=42:777${NC}"
+response=$(curl -s -X PUT -u $AUTH "$BASE_URL/card?number=42:777")
+print_response "Response:" "$response"
+
+# Test DELETE /card with a facility code
+echo -e "\n${GREEN}Testing DELETE /card?number=42:777${NC}"
+response=$(curl -s -X DELETE -u $AUTH "$BASE_URL/card?number=42:777")
+print_response "Response:" "$response"
+
+# Test PUT /card waiting for the change to reach flash
+echo -e "\n${GREEN}Testing PUT /card?number=42:778&sync${NC}"
+response=$(curl -s -X PUT -u $AUTH "$BASE_URL/card?number=42:778&sync")
+print_response "Response:" "$response"
+
+# Test DELETE /card waiting for the change to reach flash
+echo -e "\n${GREEN}Testing DELETE /card?number=42:778&sync${NC}"
+response=$(curl -s -X DELETE -u $AUTH "$BASE_URL/card?number=42:778&sync")
+print_response "Response:" "$response"
+
+# Test GET /facilities
+echo -e "\n${GREEN}Testing GET /facilities${NC}"
+response=$(curl -s -u $AUTH "$BASE_URL/facilities")
+print_response "Response:" "$response"
+
+# Test PUT /facilities
+echo -e "\n${GREEN}Testing PUT /facilities?codes=198,42${NC}"
+response=$(curl -s -X PUT -u $AUTH "$BASE_URL/facilities?codes=198,42")
+print_response "Response:" "$response"
+
+# Test PUT /cards (bulk add)
+echo -e "\n${GREEN}Testing PUT /cards?mode=add${NC}"
+response=$(printf '1001\n1002\n1003\n1002\n' | curl -s -X PUT -u $AUTH \
+    -H "Content-Type: application/octet-stream" \
+    --data-binary @- \
+    "$BASE_URL/cards?mode=add")
+print_response "Response:" "$response"
+
+# Test PUT /cards/image
+echo -e "\n${GREEN}Testing PUT /cards/image${NC}"
+image=$(mktemp)
+printf '1001\n42:1002\n35:7:1003\n' > "${image}.txt"
+python3 "$(dirname "$0")/tools/card_image.py" build "${image}.txt" "$image" > /dev/null
+response=$(curl -s -X PUT -u $AUTH \
+    -H "Content-Type: application/octet-stream" \
+    --data-binary @"$image" \
+    "$BASE_URL/cards/image")
+print_response "Response:" "$response"
+rm -f "$image" "${image}.txt"
+
+# Test GET /cards/changes
+echo -e "\n${GREEN}Testing GET /cards/changes?since=0${NC}"
+response=$(curl -s -u $AUTH "$BASE_URL/cards/changes?since=0")
+print_response "Response:" "$response"
+
+echo -e "\n${GREEN}Testing GET /cards/changes?since=abc (rejected)${NC}"
+response=$(curl -s -u $AUTH "$BASE_URL/cards/changes?since=abc")
+print_response "Response:" "$response"
+
+# Test PUT /card with an expiry
+echo -e "\n${GREEN}Testing PUT /card with expires${NC}"
+response=$(curl -s -X PUT -u $AUTH "$BASE_URL/card?number=198:777&expires=$(($(date +%s) + 3600))")
+print_response "Response:" "$response"
+
+echo -e "\n${GREEN}Testing GET /cards/expiring${NC}"
+response=$(curl -s -u $AUTH "$BASE_URL/cards/expiring")
+print_response "Response:" "$response"
+
+echo -e "\n${GREEN}Testing DELETE /card (cancels the expiry)${NC}"
+response=$(curl -s -X DELETE -u $AUTH "$BASE_URL/card?number=198:777")
+print_response "Response:" "$response"
+
+# Test GET /cards/usage
+echo -e "\n${GREEN}Testing GET /cards/usage${NC}"
+response=$(curl -s -u $AUTH "$BASE_URL/cards/usage")
+print_response "Response:" "$response"
+
+echo -e "\n${GREEN}Testing GET /cards/usage?before=...${NC}"
+response=$(curl -s -u $AUTH "$BASE_URL/cards/usage?before=$(($(date +%s) - 86400))")
+print_response "Response:" "$response"
+
+# Test card ranges
+echo -e "\n${GREEN}Testing PUT /cards/range${NC}"
+response=$(curl -s -X PUT -u $AUTH "$BASE_URL/cards/range?first=198:2000&last=198:2099")
+print_response "Response:" "$response"
+
+echo -e "\n${GREEN}Testing GET /cards/range${NC}"
+response=$(curl -s -u $AUTH "$BASE_URL/cards/range")
+print_response "Response:" "$response"
+
+echo -e "\n${GREEN}Testing DELETE /cards/range${NC}"
+response=$(curl -s -X DELETE -u $AUTH "$BASE_URL/cards/range?first=198:2000&last=198:2099")
+print_response "Response:" "$response"
+
+# Test GET /cards/digest
+echo -e "\n${GREEN}Testing GET /cards/digest${NC}"
+response=$(curl -s -u $AUTH "$BASE_URL/cards/digest")
+print_response "Response:" "$response"
+
+# Test GET /cards/buckets
+echo -e "\n${GREEN}Testing GET /cards/buckets${NC}"
+response=$(curl -s -u $AUTH "$BASE_URL/cards/buckets")
+print_response "Response:" "$response"
+
+echo -e "\n${GREEN}Testing GET /cards/buckets?groups=0,255${NC}"
+response=$(curl -s -u $AUTH "$BASE_URL/cards/buckets?groups=0,255")
+print_response "Response:" "$response"
+
+echo -e "\n${GREEN}Testing GET /cards/buckets?cards=0,1,1023${NC}"
+response=$(curl -s -u $AUTH "$BASE_URL/cards/buckets?cards=0,1,1023")
+print_response "Response:" "$response"
+
+# Test schedules and holidays
+echo -e "\n${GREEN}Testing PUT /schedules${NC}"
+response=$(curl -s -X PUT -u $AUTH -G --data-urlencode "id=1" --data-urlencode "name=test" \
+    --data-urlencode "hours=mon-fri 09:00-17:00;holiday 10:00-12:00" "$BASE_URL/schedules")
+print_response "Response:" "$response"
+
+echo -e "\n${GREEN}Testing GET /schedules${NC}"
+response=$(curl -s -u $AUTH "$BASE_URL/schedules")
+print_response "Response:" "$response"
+
+echo -e "\n${GREEN}Testing PUT /holidays${NC}"
+response=$(curl -s -X PUT -u $AUTH "$BASE_URL/holidays?dates=2026-12-25,2027-01-01")
+print_response "Response:" "$response"
+
+# Test card metadata
+echo -e "\n${GREEN}Testing PUT /cards/meta${NC}"
+response=$(curl -s -X PUT -u $AUTH "$BASE_URL/cards/meta?number=1001&expiry=1893456000&doors=1&schedule=1&label=Test%20Member")
+print_response "Response:" "$response"
+
+echo -e "\n${GREEN}Testing GET /cards/meta?number=1001${NC}"
+response=$(curl -s -u $AUTH "$BASE_URL/cards/meta?number=1001")
+print_response "Response:" "$response"
+
+echo -e "\n${GREEN}Testing GET /cards/meta${NC}"
+response=$(curl -s -u $AUTH "$BASE_URL/cards/meta")
+print_response "Response:" "$response"
+
+echo -e "\n${GREEN}Testing DELETE /cards/meta${NC}"
+response=$(curl -s -X DELETE -u $AUTH "$BASE_URL/cards/meta?number=1001")
+print_response "Response:" "$response"
+
+echo -e "\n${GREEN}Testing DELETE /schedules${NC}"
+response=$(curl -s -X DELETE -u $AUTH "$BASE_URL/schedules?id=1")
+print_response "Response:" "$response"
+
+echo -e "\n${GREEN}Testing PUT /holidays (clear)${NC}"
+response=$(curl -s -X PUT -u $AUTH "$BASE_URL/holidays?dates=")
+print_response "Response:" "$response"
+
+# Test PUT /cards (bulk remove)
+echo -e "\n${GREEN}Testing PUT /cards?mode=remove${NC}"
+response=$(printf '1001\n1002\n1003\n' | curl -s -X PUT -u $AUTH \
+    -H "Content-Type: application/octet-stream" \
+    --data-binary @- \
+    "$BASE_URL/cards?mode=remove")
+print_response "Response:" "$response"
+
+# Test GET /diagnostics/carddb
+echo -e "\n${GREEN}Testing GET /diagnostics/carddb${NC}"
+response=$(curl -s -u $AUTH "$BASE_URL/diagnostics/carddb")
+print_response "Response:" "$response"
+
+# Test error cases
+echo -e "\n${GREEN}Testing error cases:${NC}"
+
+# Test invalid card number
+echo -e "\n${RED}Testing invalid card number${NC}"
+response=$(curl -s -X PUT -u $AUTH "$BASE_URL/card/abc")
+print_response "Response:" "$response"
+
+# Test invalid composite card
+echo -e "\n${RED}Testing invalid composite card${NC}"
+response=$(curl -s -X PUT -u $AUTH "$BASE_URL/card?number=70000:1")
+print_response "Response:" "$response"
+
+# Test invalid facility code
+echo -e "\n${RED}Testing invalid facility code${NC}"
+response=$(curl -s -X PUT -u $AUTH "$BASE_URL/facilities?codes=198,x")
+print_response "Response:" "$response"
+
+# Test invalid bucket list
+echo -e "\n${RED}Testing invalid bucket list${NC}"
+response=$(curl -s -u $AUTH "$BASE_URL/cards/buckets?cards=1024")
+print_response "Response:" "$response"
+
+# Test invalid card metadata
+echo -e "\n${RED}Testing invalid door mask${NC}"
+response=$(curl -s -X PUT -u $AUTH "$BASE_URL/cards/meta?number=1001&doors=70000")
+print_response "Response:" "$response"
+
+# Test invalid schedule hours
+echo -e "\n${RED}Testing invalid schedule hours${NC}"
+response=$(curl -s -X PUT -u $AUTH "$BASE_URL/schedules?id=1&name=test&hours=mon%2009:10-10:00")
+print_response "Response:" "$response"
+
+# Test invalid card range
+echo -e "\n${RED}Testing card range across facilities${NC}"
+response=$(curl -s -X PUT -u $AUTH "$BASE_URL/cards/range?first=198:1&last=199:1")
+print_response "Response:" "$response"
+
+# Test invalid usage cutoff
+echo -e "\n${RED}Testing invalid usage cutoff${NC}"
+response=$(curl -s -u $AUTH "$BASE_URL/cards/usage?before=yesterday")
+print_response "Response:" "$response"
+
+# Test invalid expiry
+echo -e "\n${RED}Testing invalid expires${NC}"
+response=$(curl -s -X PUT -u $AUTH "$BASE_URL/card?number=198:777&expires=soon")
+print_response "Response:" "$response"
+
+# Test invalid bulk body
+echo -e "\n${RED}Testing invalid bulk body${NC}"
+response=$(printf '1001\nnot-a-card\n' | curl -s -X PUT -u $AUTH \
+    -H "Content-Type: application/octet-stream" \
+    --data-binary @- \
+    "$BASE_URL/cards?mode=add")
+print_response "Response:" "$response"
+
+# Test invalid card image
+echo -e "\n${RED}Testing invalid card image${NC}"
+response=$(printf 'not an image' | curl -s -X PUT -u $AUTH \
+    -H "Content-Type: application/octet-stream" \
+    --data-binary @- \
+    "$BASE_URL/cards/image")
+print_response "Response:" "$response"
+
+# Test invalid bulk mode
+echo -e "\n${RED}Testing invalid bulk mode${NC}"
+response=$(printf '1001\n' | curl -s -X PUT -u $AUTH \
+    -H "Content-Type: application/octet-stream" \
+    --data-binary @- \
+    "$BASE_URL/cards?mode=merge")
+print_response "Response:" "$response"
+
+# Test missing authentication
+echo -e "\n${RED}Testing missing authentication${NC}"
+response=$(curl -s "$BASE_URL/cards")
+print_response "Response:" "$response"
+
+echo -e "\nTests completed!"
@@ -0,0 +1,340 @@
+#!/bin/bash
+
+# Builds the card indexes on the host and benchmarks them: probe counts,
+# lookup time and memory per card for each in-RAM index type, how well
+# the block index compresses dense and sparse card sets, opening a
+# perfect hash image mapped in place against reading it into heap, and
+# the sorted index against the line-by-line file scan it replaced. Checks
+# every index finds each of its cards and none of the others on the way.
+# Needs g++ and python3 (tools/card_image.py builds the images, which
+# takes about a minute at 100000 cards); no hardware. Timings are the host's, so compare the types
+# with each other rather than with the controller.
+
+DIR="$(cd "$(dirname "$0")" && pwd)"
+WORK=$(mktemp -d)
+trap "rm -rf '$WORK'" EXIT
+
+# Colors for output
+GREEN='\033[0;32m'
+RED='\033[0;31m'
+NC='\033[0m' # No Color
+
+echo "Benchmarking card indexes"
+echo "========================="
+
+cat > "$WORK/bench.cpp" <<'EOF'
+#include "card_image_memory.h"
+#include "card_index.h"
+#include <FS.h>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <set>
+#include <stdio.h>
+
+static int failures = 0;
+static std::mt19937_64 rng(7);
+
+static void check(bool ok, const char* what) {
+    if (!ok) {
+        printf("\033[0;31m✗\033[0m %s\n", what);
+        failures++;
+    }
+}
+
+// `count` distinct 26-bit cards spread over some facilities, sorted
+static std::vector<uint64_t> randomCards(size_t count, unsigned facilities = 4) {
+    std::set<uint64_t> cards;
+    while (cards.size() < count) {
+        cards.insert((uint64_t)26 << 48 | (uint64_t)(100 + rng() % facilities) << 32 | (1 + rng() % 0xFFFFF));
+    }
+    return std::vector<uint64_t>(cards.begin(), cards.end());
+}
+
+// Keys like `cards` that aren't among them
+static std::vector<uint64_t> strangers(const std::vector<uint64_t>& cards) {
+    std::vector<uint64_t> others;
+    while (others.size() < cards.size()) {
+        uint64_t key = (uint64_t)26 << 48 | (uint64_t)(100 + rng() % 4) << 32 | (1 + rng() % 0xFFFFF);
+        if (!std::binary_search(cards.begin(), cards.end(), key)) {
+            others.push_back(key);
+        }
+    }
+    return others;
+}
+
+// Mean nanoseconds per lookup of `keys`, shuffled, and how many were found
+static double timeLookups(const CardIndex& index, std::vector<uint64_t> keys, size_t& found) {
+    std::shuffle(keys.begin(), keys.end(), rng);
+    found = 0;
+    const int rounds = 5;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int round = 0; round < rounds; round++) {
+        for (uint64_t key : keys) {
+            found += index.contains(key);
+        }
+    }
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    found /= rounds;
+    return elapsed.count() / (rounds * keys.size());
+}
+
+struct Result {
+    double bytesPerCard;
+    float probes;
+    double hitNanos;
+    double missNanos;
+};
+
+static Result measure(CardIndex::Type type, const std::vector<uint64_t>& cards, const std::vector<uint64_t>& others) {
+    std::vector<uint64_t> keys = cards;
+    CardIndex* index = CardIndex::create(type, keys);
+    Result result;
+    size_t found;
+    result.hitNanos = timeLookups(*index, cards, found);
+    check(found == cards.size(), "every card is found");
+    result.missNanos = timeLookups(*index, others, found);
+    check(found == 0, "no stranger is found");
+    std::vector<uint64_t> back;
+    index->getSortedKeys(back);
+    check(back == cards, "the index gives back its cards");
+    result.bytesPerCard = (double)index->getMemoryUsage() / cards.size();
+    result.probes = index->getAverageProbes();
+    delete index;
+    return result;
+}
+
+// The hash index doubles its table to stay at most 3/4 full, so card
+// counts between two doublings sweep its load factor
+static void benchmarkLoadFactors() {
+    printf("\nAcross hash load factors (131072 slots)\n");
+    printf("%-7s %-6s %8s %10s %8s %8s\n", "cards", "index", "load", "bytes/card", "probes", "hit ns");
+    const size_t SLOTS = 131072;
+    for (double load : {0.40, 0.50, 0.60, 0.70, 0.75}) {
+        std::vector<uint64_t> cards = randomCards((size_t)(SLOTS * load));
+        std::vector<uint64_t> others = strangers(cards);
+        for (CardIndex::Type type : {CardIndex::SORTED, CardIndex::HASH, CardIndex::BLOCK}) {
+            Result result = measure(type, cards, others);
+            char loadText[8] = "-";
+            if (type == CardIndex::HASH) {
+                snprintf(loadText, sizeof(loadText), "%.2f", load);
+            }
+            printf("%-7zu %-6s %8s %10.2f %8.2f %8.1f  (miss %.1f ns)\n", cards.size(), CardIndex::typeName(type),
+                   loadText, result.bytesPerCard, result.probes, result.hitNanos, result.missNanos);
+        }
+    }
+}
+
+// Badges are usually issued in runs, so real sets are denser than random
+// ones; the block index's gaps, and so its size, follow the density
+static void benchmarkCompression() {
+    printf("\nCompression at 100000 cards\n");
+    printf("%-22s %-6s %10s %8s %8s\n", "cards", "index", "bytes/card", "hit ns", "miss ns");
+    const size_t COUNT = 100000;
+    std::vector<uint64_t> runs;
+    for (uint64_t card = 1; runs.size() < COUNT; card++) {
+        // Batches of 500 numbers with every tenth badge never handed out
+        if (card % 10 != 0) {
+            runs.push_back((uint64_t)26 << 48 | (uint64_t)(100 + card / 50000) << 32 | card % 50000);
+        }
+        if (card % 500 == 0) {
+            card += 200;
+        }
+    }
+    std::sort(runs.begin(), runs.end());
+    runs.erase(std::unique(runs.begin(), runs.end()), runs.end());
+    struct Set {
+        const char* name;
+        std::vector<uint64_t> cards;
+    } sets[] = {
+        {"issued in runs", runs},
+        {"random, 1 facility", randomCards(COUNT, 1)},
+        {"random, 64 facilities", randomCards(COUNT, 64)},
+    };
+    for (const Set& set : sets) {
+        std::vector<uint64_t> others = strangers(set.cards);
+        for (CardIndex::Type type : {CardIndex::SORTED, CardIndex::HASH, CardIndex::BLOCK}) {
+            Result result = measure(type, set.cards, others);
+            printf("%-22s %-6s %10.2f %8.1f %8.1f\n", set.name, CardIndex::typeName(type), result.bytesPerCard,
+                   result.hitNanos, result.missNanos);
+        }
+    }
+}
+
+// An image card file as the script wrote it, sorted
+static std::vector<uint64_t> readCards(const std::string& path) {
+    std::vector<uint64_t> cards;
+    FILE* file = fopen(path.c_str(), "r");
+    unsigned format, facility;
+    unsigned long card;
+    while (file != NULL && fscanf(file, "%u:%u:%lu", &format, &facility, &card) == 3) {
+        cards.push_back((uint64_t)format << 48 | (uint64_t)facility << 32 | card);
+    }
+    if (file != NULL) fclose(file);
+    std::sort(cards.begin(), cards.end());
+    return cards;
+}
+
+// Installs each image the way the device does, into a region file with
+// the header written last, then opens it mapped without verifying, which
+// should cost the same at any size, against reading the image into heap
+// and checking it whole as when there's no region
+static void benchmarkMappedImages(const char* workDir) {
+    printf("\nPerfect hash images, mapped against read into heap\n");
+    printf("%-7s %12s %14s %8s %8s\n", "cards", "map+open us", "load+verify us", "hit ns", "miss ns");
+    fs::FS files;
+    files.root = workDir;
+    for (size_t count : {1000, 10000, 100000}) {
+        std::string name = "/cards-" + std::to_string(count);
+        std::string region = workDir + name + ".region";
+        std::vector<uint64_t> cards = readCards(workDir + name + ".txt");
+        check(cards.size() == count, "the card file is read back");
+
+        File file = files.open((name + ".img").c_str(), FILE_READ);
+        PerfectHashCardIndex::ImageHeader header;
+        bool stored = file && file.read((uint8_t*)&header, sizeof(header)) == sizeof(header);
+        if (stored) {
+            header.generation = 1;
+            stored = CardImageMemory::store(region.c_str(), file, PerfectHashCardIndex::IMAGE_PAGE_SIZE,
+                                            (const uint8_t*)&header, sizeof(header));
+        }
+        file.close();
+        check(stored, "the image is stored in its region");
+        if (!stored) {
+            continue;
+        }
+
+        const char* error = NULL;
+        const int opens = 20;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (int i = 0; i < opens; i++) {
+            delete PerfectHashCardIndex::open(CardImageMemory::map(region.c_str()), false, error);
+        }
+        std::chrono::duration<double, std::micro> mapping = std::chrono::steady_clock::now() - start;
+
+        start = std::chrono::steady_clock::now();
+        for (int i = 0; i < opens; i++) {
+            file = files.open((name + ".img").c_str(), FILE_READ);
+            delete PerfectHashCardIndex::open(CardImageMemory::load(file), true, error);
+            file.close();
+        }
+        std::chrono::duration<double, std::micro> loading = std::chrono::steady_clock::now() - start;
+
+        PerfectHashCardIndex* index = PerfectHashCardIndex::open(CardImageMemory::map(region.c_str()), false, error);
+        check(index != NULL && index->isMapped(), "the stored image opens mapped");
+        if (index == NULL) {
+            continue;
+        }
+        check(index->getHeader().generation == 1, "the stored header is the device's");
+        size_t found;
+        double hitNanos = timeLookups(*index, cards, found);
+        check(found == cards.size(), "every card is found");
+        double missNanos = timeLookups(*index, strangers(cards), found);
+        check(found == 0, "no stranger is found");
+        std::vector<uint64_t> back;
+        index->getSortedKeys(back);
+        check(back == cards, "the index gives back its cards");
+        delete index;
+        printf("%-7zu %12.1f %14.1f %8.1f %8.1f\n", count, mapping.count() / opens, loading.count() / opens,
+               hitNanos, missNanos);
+    }
+}
+
+// The lookup hasCard() used to make: read the text card file a line at a
+// time until the card turns up. Held the database mutex all the way.
+static bool scanFile(fs::FS& files, unsigned long card) {
+    bool found = false;
+    File file = files.open("/cards.txt", FILE_READ);
+    while (file.available()) {
+        String line = file.readStringUntil('\n');
+        if ((unsigned long)line.toInt() == card) {
+            found = true;
+            break;
+        }
+    }
+    file.close();
+    return found;
+}
+
+// Before and after the in-RAM index, for a swipe of an enrolled card
+// (anywhere in the file) and of an unknown one (the whole file)
+static void benchmarkFileScan(const char* workDir) {
+    printf("\nFile scan against the sorted index\n");
+    printf("%-7s %14s %14s %12s\n", "cards", "scan hit us", "scan miss us", "sorted ns");
+    fs::FS files;
+    files.root = workDir;
+    for (size_t count : {100, 1000, 10000, 50000}) {
+        // One facility, so the file can hold bare card numbers as it did
+        std::vector<uint64_t> cards = randomCards(count, 1);
+        std::vector<uint64_t> shuffled = cards;
+        std::shuffle(shuffled.begin(), shuffled.end(), rng);
+        File file = files.open("/cards.txt", FILE_WRITE);
+        for (uint64_t key : shuffled) {
+            file.println(String((unsigned long)(key & 0xFFFFFFFF)));
+        }
+        file.close();
+
+        const int scans = 20;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        int found = 0;
+        for (int i = 0; i < scans; i++) {
+            found += scanFile(files, shuffled[rng() % shuffled.size()] & 0xFFFFFFFF);
+        }
+        std::chrono::duration<double, std::micro> hit = std::chrono::steady_clock::now() - start;
+        check(found == scans, "the file scan finds enrolled cards");
+        start = std::chrono::steady_clock::now();
+        for (int i = 0; i < scans; i++) {
+            found -= scanFile(files, 0xFFFFFFFF);
+        }
+        std::chrono::duration<double, std::micro> miss = std::chrono::steady_clock::now() - start;
+        check(found == scans, "the file scan rejects unknown cards");
+
+        std::vector<uint64_t> keys = cards;
+        CardIndex* index = CardIndex::create(CardIndex::SORTED, keys);
+        size_t hits;
+        double sortedNanos = timeLookups(*index, cards, hits);
+        check(hits == cards.size(), "every card is found");
+        delete index;
+        printf("%-7zu %14.1f %14.1f %12.1f\n", cards.size(), hit.count() / scans, miss.count() / scans, sortedNanos);
+    }
+}
+
+int main(int argc, char** argv) {
+    (void)argc;
+    benchmarkFileScan(argv[1]);
+    benchmarkLoadFactors();
+    benchmarkCompression();
+    benchmarkMappedImages(argv[1]);
+    return failures == 0 ? 0 : 1;
+}
+EOF
+
+# Image card sets, four facilities like randomCards() in the benchmark
+for COUNT in 1000 10000 100000; do
+    python3 - "$COUNT" > "$WORK/cards-$COUNT.txt" <<'PYEOF'
+import random, sys
+random.seed(int(sys.argv[1]))
+cards = set()
+while len(cards) < int(sys.argv[1]):
+    cards.add((100 + random.randrange(4), random.randint(1, 0xFFFFF)))
+for facility, card in sorted(cards):
+    print("26:%d:%d" % (facility, card))
+PYEOF
+    if ! python3 "$DIR/tools/card_image.py" build "$WORK/cards-$COUNT.txt" "$WORK/cards-$COUNT.img" > /dev/null; then
+        echo -e "${RED}Couldn't build a card image of $COUNT cards${NC}"
+        exit 1
+    fi
+done
+
+if ! g++ -std=gnu++11 -O2 -Wall -Wextra -I"$DIR/host" -I"$DIR" "$WORK/bench.cpp" "$DIR/card_index.cpp" \
+        "$DIR/card_image_memory.cpp" "$DIR/crc32.cpp" "$DIR/host/host.cpp" -o "$WORK/bench"; then
+    echo -e "${RED}Build failed${NC}"
+    exit 1
+fi
+
+if "$WORK/bench" "$WORK"; then
+    echo -e "\n${GREEN}All index checks passed${NC}"
+else
+    echo -e "\n${RED}Index checks failed${NC}"
+    exit 1
+fi
@@ -0,0 +1,101 @@
+#!/bin/bash
+
+# Runs update_cards.sh --reconcile against a local stand-in device
+# (tools/card_device_sim.py) whose cards have drifted from the card file by
+# 1%, 10% and 50%, checks the device ends up with exactly the file's cards,
+# and compares the bytes transferred with a full --replace upload, which
+# reconcile should never exceed by more than 2%.
+# Needs python3 and curl; no hardware.
+
+PORT=${PORT:-8089}
+CARDS=${CARDS:-10000}
+DIR="$(cd "$(dirname "$0")" && pwd)"
+BASE_URL="http://127.0.0.1:${PORT}"
+WORK=$(mktemp -d)
+
+# Colors for output
+GREEN='\033[0;32m'
+RED='\033[0;31m'
+BLUE='\033[0;34m'
+NC='\033[0m' # No Color
+
+python3 "$DIR/tools/card_device_sim.py" --port "$PORT" 2>/dev/null &
+SIM=$!
+trap "kill $SIM 2>/dev/null; rm -rf '$WORK'" EXIT
+for i in $(seq 50); do
+    curl -s "$BASE_URL/sim/stats" > /dev/null && break
+    sleep 0.1
+done
+
+echo "Testing card set reconciliation against a stand-in device"
+echo "========================================================="
+
+# Distinct random cards across a few facilities, and the same set with
+# `percent` of them swapped for cards the file doesn't have
+python3 - "$CARDS" > "$WORK/cards.txt" <<'EOF'
+import random, sys
+random.seed(1)
+cards = set()
+while len(cards) < int(sys.argv[1]):
+    cards.add("%d:%d" % (random.choice((198, 42, 7)), random.randrange(1, 1 << 20)))
+print("\n".join(sorted(cards)))
+EOF
+
+drift() {
+    python3 - "$1" "$WORK/cards.txt" <<'EOF'
+import random, sys
+random.seed(2)
+cards = open(sys.argv[2]).read().split()
+swapped = len(cards) * int(sys.argv[1]) // 100
+random.shuffle(cards)
+print("\n".join(cards[swapped:] + ["%d:%d" % (198, (1 << 20) + i) for i in range(swapped)]))
+EOF
+}
+
+# Requests and bytes up and down since the last reset
+sim_stats() {
+    curl -s "$BASE_URL/sim/stats" | awk '{ printf "%s ", $2 }'
+}
+
+run_update() {
+    bash "$DIR/update_cards.sh" -i "127.0.0.1:${PORT}" -u test -p test -f "$WORK/cards.txt" "$@" > "$WORK/update.log" 2>&1
+}
+
+expected=$(python3 "$DIR/tools/card_image.py" digest "$WORK/cards.txt")
+failed=0
+
+printf "\n${BLUE}%-6s %-10s %10s %12s %12s %10s${NC}\n" "drift" "method" "requests" "bytes up" "bytes down" "total"
+for percent in 1 10 50; do
+    for method in reconcile replace; do
+        drift "$percent" | curl -s -X PUT --data-binary @- "$BASE_URL/cards?mode=replace" > /dev/null
+        curl -s -X POST "$BASE_URL/sim/reset" > /dev/null
+        if [ "$method" = "reconcile" ]; then
+            run_update -R
+        else
+            run_update -r -F
+        fi
+        read requests up down <<< "$(sim_stats)"
+        printf "%-6s %-10s %10d %12d %12d %10d\n" "${percent}%" "$method" "$requests" "$up" "$down" $((up + down))
+
+        actual=$(curl -s "$BASE_URL/cards/digest" | grep -v '^generation')
+        if [ "$actual" != "$expected" ]; then
+            echo -e "${RED}✗ Device doesn't match the card file after ${method} at ${percent}% drift${NC}"
+            cat "$WORK/update.log"
+            failed=1
+        fi
+
+        # Reconcile should only ever lose to a replace by the few digests it
+        # compares before deciding to replace
+        if [ "$method" = "reconcile" ]; then
+            reconciled=$((up + down))
+        elif [ $((reconciled * 100)) -gt $(((up + down) * 102)) ]; then
+            echo -e "${RED}✗ Reconcile moved ${reconciled} bytes at ${percent}% drift, more than a replace's $((up + down))${NC}"
+            failed=1
+        fi
+    done
+done
+
+if [ $failed -eq 0 ]; then
+    echo -e "\n${GREEN}All reconciliations matched the card file${NC}"
+fi
+exit $failed
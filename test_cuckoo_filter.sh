@@ -0,0 +1,123 @@
+#!/bin/bash
+
+# Builds cuckoo_filter.cpp on the host and churns it the way the card
+# database does: 100000 mixed card adds and revocations applied one at a
+# time to the live filter, rebuilt from the whole set only when an add
+# doesn't fit. Checks no enrolled card is ever missed, and reports the
+# rebuilds and the false positive rate along the way.
+# Needs g++; no hardware.
+
+DIR="$(cd "$(dirname "$0")" && pwd)"
+WORK=$(mktemp -d)
+trap "rm -rf '$WORK'" EXIT
+
+# Colors for output
+GREEN='\033[0;32m'
+RED='\033[0;31m'
+NC='\033[0m' # No Color
+
+echo "Churning the cuckoo filter"
+echo "=========================="
+
+cat > "$WORK/churn.cpp" <<'EOF'
+#include "cuckoo_filter.h"
+#include <random>
+#include <set>
+#include <stdio.h>
+
+static int failures = 0;
+static std::mt19937_64 rng(15);
+
+static void check(bool ok, const char* what) {
+    if (!ok) {
+        printf("\033[0;31m✗\033[0m %s\n", what);
+        failures++;
+    }
+}
+
+static uint64_t randomCard() {
+    return (uint64_t)26 << 48 | (uint64_t)(100 + rng() % 4) << 32 | (1 + rng() % 0xFFFFF);
+}
+
+// Fraction of `tries` cards outside `cards` that the filter lets through
+static double measureFalsePositives(const CuckooFilter& filter, const std::set<uint64_t>& cards, int tries) {
+    int passed = 0;
+    for (int i = 0; i < tries;) {
+        uint64_t key = randomCard();
+        if (cards.count(key) == 0) {
+            passed += filter.mightContain(key);
+            i++;
+        }
+    }
+    return (double)passed / tries;
+}
+
+int main() {
+    const size_t START = 10000;
+    const int OPS = 100000;
+    std::set<uint64_t> cards;
+    while (cards.size() < START) {
+        cards.insert(randomCard());
+    }
+    std::vector<uint64_t> keys(cards.begin(), cards.end());
+    CuckooFilter filter;
+    filter.build(keys.data(), keys.size());
+
+    printf("%-7s %-7s %8s %8s %8s %10s\n", "ops", "cards", "slots", "fill", "rebuilds", "fp rate");
+    unsigned rebuilds = 0;
+    size_t falseNegatives = 0;
+    for (int op = 1; op <= OPS; op++) {
+        // Slightly more adds than revocations, so the set grows through
+        // several table doublings
+        if (rng() % 100 < 55 || cards.empty()) {
+            uint64_t key = randomCard();
+            if (!cards.insert(key).second) {
+                continue;
+            }
+            // As CardDatabase: a failed add leaves the filter unchanged and
+            // the new set gets a filter built for it
+            if (!filter.add(key)) {
+                keys.assign(cards.begin(), cards.end());
+                filter.build(keys.data(), keys.size());
+                rebuilds++;
+            }
+            falseNegatives += !filter.mightContain(key);
+        } else {
+            std::set<uint64_t>::iterator it = cards.lower_bound(randomCard());
+            if (it == cards.end()) {
+                it = cards.begin();
+            }
+            check(filter.remove(*it), "an enrolled card can be removed");
+            cards.erase(it);
+        }
+        check(filter.size() == cards.size(), "the filter counts every card");
+
+        if (op % 10000 == 0) {
+            for (uint64_t key : cards) {
+                falseNegatives += !filter.mightContain(key);
+            }
+            printf("%-7d %-7zu %8zu %8.3f %8u %9.4f%%\n", op, cards.size(), filter.getCapacity(),
+                   filter.getFillRatio(), rebuilds, 100 * measureFalsePositives(filter, cards, 100000));
+        }
+    }
+
+    check(falseNegatives == 0, "no enrolled card is ever missed");
+    printf("\nFalse negatives: %zu\n", falseNegatives);
+    printf("Rebuilds: %u\n", rebuilds);
+    printf("Expected false positive rate: %.4f%%\n", 100 * filter.getFalsePositiveRate());
+    return failures == 0 ? 0 : 1;
+}
+EOF
+
+if ! g++ -std=gnu++11 -O2 -Wall -Wextra -I"$DIR/host" -I"$DIR" "$WORK/churn.cpp" "$DIR/cuckoo_filter.cpp" \
+        "$DIR/host/host.cpp" -o "$WORK/churn"; then
+    echo -e "${RED}Build failed${NC}"
+    exit 1
+fi
+
+if "$WORK/churn"; then
+    echo -e "\n${GREEN}All filter checks passed${NC}"
+else
+    echo -e "\n${RED}Filter checks failed${NC}"
+    exit 1
+fi
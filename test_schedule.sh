@@ -0,0 +1,159 @@
+#!/bin/bash
+
+# Builds access_schedule.cpp on the host and checks schedule compiling and
+# evaluation, including across the daylight saving changes, in the time
+# zone the sketch sets with configTime(gmtOffset_sec, daylightOffset_sec).
+# Needs g++; no hardware.
+
+DIR="$(cd "$(dirname "$0")" && pwd)"
+WORK=$(mktemp -d)
+trap "rm -rf '$WORK'" EXIT
+
+# Colors for output
+GREEN='\033[0;32m'
+RED='\033[0;31m'
+NC='\033[0m' # No Color
+
+SKETCH="$DIR/ProxCardWESPDoorFirmware.ino"
+GMT_OFFSET=$(sed -n 's/^const long gmtOffset_sec = \(-\?[0-9]*\);.*/\1/p' "$SKETCH")
+DAYLIGHT_OFFSET=$(sed -n 's/^const int daylightOffset_sec = \(-\?[0-9]*\);.*/\1/p' "$SKETCH")
+if [ -z "$GMT_OFFSET" ] || [ -z "$DAYLIGHT_OFFSET" ]; then
+    echo -e "${RED}Couldn't find gmtOffset_sec and daylightOffset_sec in the sketch${NC}"
+    exit 1
+fi
+
+# The TZ string configTime() builds from the offsets. It names no change
+# dates, so newlib falls back to the US rules, which are spelled out here
+# as the host's C library may pick different ones.
+tz_offset() {
+    local seconds=$1 sign=""
+    if [ "$seconds" -lt 0 ]; then
+        sign="-"
+        seconds=$((-seconds))
+    fi
+    if [ $((seconds % 3600)) -eq 0 ]; then
+        echo "${sign}$((seconds / 3600))"
+    else
+        printf "%s%d:%02d:%02d" "$sign" $((seconds / 3600)) $((seconds % 3600 / 60)) $((seconds % 60))
+    fi
+}
+STANDARD=$((-GMT_OFFSET))
+TZ_RULE="UTC$(tz_offset $STANDARD)DST"
+if [ "$DAYLIGHT_OFFSET" -ne 3600 ]; then
+    TZ_RULE="${TZ_RULE}$(tz_offset $((STANDARD - DAYLIGHT_OFFSET)))"
+fi
+TZ_RULE="${TZ_RULE},M3.2.0,M11.1.0"
+
+echo "Testing access schedules"
+echo "========================"
+echo "TZ=$TZ_RULE (gmtOffset_sec $GMT_OFFSET, daylightOffset_sec $DAYLIGHT_OFFSET)"
+
+cat > "$WORK/test.cpp" <<'EOF'
+#include "access_schedule.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+static int failures = 0;
+
+static void check(bool ok, const char* what) {
+    printf("%s %s\n", ok ? "\033[0;32m✓\033[0m" : "\033[0;31m✗\033[0m", what);
+    failures += !ok;
+}
+
+// A local wall clock time, in standard or daylight time, as seconds since
+// the epoch, from the sketch's offsets
+static time_t local(int year, int month, int day, int hour, int minute, bool daylight) {
+    struct tm utc = {};
+    utc.tm_year = year - 1900;
+    utc.tm_mon = month - 1;
+    utc.tm_mday = day;
+    utc.tm_hour = hour;
+    utc.tm_min = minute;
+    return timegm(&utc) - GMT_OFFSET - (daylight ? DAYLIGHT_OFFSET : 0);
+}
+
+static bool allowed(const AccessSchedules& table, uint8_t id, time_t now) {
+    time_t start, end;
+    return table.allows(id, table.slotAt(now, start, end));
+}
+
+int main() {
+    setenv("TZ", TZ_RULE, 1);
+    tzset();
+
+    AccessSchedules::Week week;
+    check(AccessSchedules::compile("mon-fri 09:00-17:30;sat,sun 10:00-14:00;holiday 12:00-14:00", week) &&
+          AccessSchedules::describe(week) == "mon-fri 09:00-17:30;sat-sun 10:00-14:00;holiday 12:00-14:00",
+          "hours compile and describe back");
+    check(AccessSchedules::compile("none", week) && AccessSchedules::describe(week) == "none",
+          "none closes every day");
+    const char* invalid[] = {"mon 09:10-10:00", "fri-mon 09:00-10:00", "mon 10:00-09:00", "xyz 09:00-10:00",
+                             "mon", "mon 09:00-24:15", "mon-holiday 09:00-10:00", "mon 09:00-10:00;"};
+    bool rejected = true;
+    for (const char* hours : invalid) {
+        rejected = rejected && !AccessSchedules::compile(hours, week);
+    }
+    check(rejected, "malformed hours are rejected");
+
+    AccessSchedules table;
+    AccessSchedules::compile("mon-fri 09:00-17:00;holiday 10:00-12:00", week);
+    table.set(1, "office", week);
+    AccessSchedules::compile("sun 01:30-02:00,03:00-03:15", week);
+    table.set(2, "spring", week);
+    AccessSchedules::compile("sun 01:00-02:00", week);
+    table.set(3, "fall", week);
+    AccessSchedules::compile("sat 23:45-24:00", week);
+    table.set(4, "late", week);
+    std::vector<uint32_t> holidays = {20261225};
+    table.setHolidays(holidays);
+
+    check(table.allows(AccessSchedules::NONE, 0) && !table.allows(5, 0), "no schedule allows, a missing one refuses");
+
+    // Office hours hold in local time in winter and summer
+    check(allowed(table, 1, local(2026, 1, 12, 9, 0, false)) && !allowed(table, 1, local(2026, 1, 12, 8, 59, false)),
+          "winter Monday opens at 09:00 standard time");
+    check(allowed(table, 1, local(2026, 7, 13, 9, 0, true)) && !allowed(table, 1, local(2026, 7, 13, 8, 59, true)),
+          "summer Monday opens at 09:00 daylight time");
+    check(allowed(table, 1, local(2026, 7, 13, 16, 59, true)) && !allowed(table, 1, local(2026, 7, 13, 17, 0, true)),
+          "summer Monday closes at 17:00 daylight time");
+    check(!allowed(table, 1, local(2026, 7, 12, 12, 0, true)), "closed on Sunday");
+
+    // Spring forward: 02:00 standard time is 03:00 daylight time
+    time_t start, end;
+    table.slotAt(local(2026, 3, 8, 1, 50, false), start, end);
+    check(end == local(2026, 3, 8, 3, 0, true), "the 01:45 slot ends at 03:00 daylight time");
+    check(allowed(table, 2, local(2026, 3, 8, 1, 59, false)) && allowed(table, 2, local(2026, 3, 8, 3, 0, true)) &&
+          allowed(table, 2, local(2026, 3, 8, 3, 14, true)) && !allowed(table, 2, local(2026, 3, 8, 3, 15, true)),
+          "spring forward skips 02:00 to 03:00");
+
+    // Fall back: 01:00 to 02:00 happens twice
+    check(!allowed(table, 3, local(2026, 11, 1, 0, 59, true)) && allowed(table, 3, local(2026, 11, 1, 1, 30, true)) &&
+          allowed(table, 3, local(2026, 11, 1, 1, 30, false)) && !allowed(table, 3, local(2026, 11, 1, 2, 0, false)),
+          "fall back opens 01:00 to 02:00 both times");
+    table.slotAt(local(2026, 11, 1, 1, 50, true), start, end);
+    check(end == local(2026, 11, 1, 1, 0, false), "the second 01:00 follows the first 01:45 slot");
+
+    // The holiday row replaces the weekday on holidays
+    check(!allowed(table, 1, local(2026, 12, 25, 9, 30, false)) && allowed(table, 1, local(2026, 12, 25, 10, 30, false)),
+          "holiday hours apply on a holiday");
+    check(allowed(table, 1, local(2026, 12, 24, 9, 30, false)) && !allowed(table, 1, local(2026, 12, 24, 17, 0, false)),
+          "weekday hours apply on other days");
+
+    check(allowed(table, 4, local(2026, 1, 10, 23, 59, false)) && !allowed(table, 4, local(2026, 1, 11, 0, 0, false)),
+          "the last slot of a day ends at midnight");
+    return failures == 0 ? 0 : 1;
+}
+EOF
+
+if ! g++ -std=gnu++11 -Wall -I"$DIR" -DGMT_OFFSET="$GMT_OFFSET" -DDAYLIGHT_OFFSET="$DAYLIGHT_OFFSET" \
+        -DTZ_RULE="\"$TZ_RULE\"" "$WORK/test.cpp" "$DIR/access_schedule.cpp" -o "$WORK/test"; then
+    echo -e "${RED}Build failed${NC}"
+    exit 1
+fi
+
+if "$WORK/test"; then
+    echo -e "\n${GREEN}All schedule checks passed${NC}"
+else
+    echo -e "\n${RED}Schedule checks failed${NC}"
+    exit 1
+fi
@@ -0,0 +1,165 @@
+#!/usr/bin/env python3
+"""Local stand-in for a door controller's card endpoints, for testing sync
+tools without hardware.
+
+    card_device_sim.py [--port 8089]
+
+Serves the parts of the card API that update_cards.sh uses, over plain
+HTTP without checking credentials:
+
+    GET /cards, GET /cards/digest, GET /cards/buckets, GET /cards/changes
+    PUT /cards?mode=add|remove|replace, PUT and DELETE /card?number=N
+
+Card sets, digests and bucket digests are computed with the functions in
+card_image.py, which mirror the firmware's. /cards/changes keeps no
+history, so it always asks for a full resync.
+
+It also counts what crosses the wire, so a test can compare sync
+strategies: GET /sim/stats reports the requests served and the bytes of
+request lines, bodies and response bodies since the last POST /sim/reset.
+"""
+
+import argparse
+import sys
+from http.server import BaseHTTPRequestHandler, HTTPServer
+from urllib.parse import parse_qs, urlparse
+
+import card_image
+
+
+class Device:
+    def __init__(self):
+        self.cards = set()
+        self.generation = 0
+        self.reset()
+
+    def reset(self):
+        self.requests = 0
+        self.bytes_up = 0
+        self.bytes_down = 0
+
+    def change(self, cards):
+        self.generation += 1
+        self.cards = cards
+
+
+DEVICE = Device()
+
+
+def parse_cards(body):
+    cards = set()
+    for line in body.decode().split():
+        cards.add(card_image.parse_key(line))
+    return cards
+
+
+class Handler(BaseHTTPRequestHandler):
+    def log_message(self, format, *args):
+        pass
+
+    def reply(self, code, text):
+        body = text.encode()
+        if not self.path.startswith("/sim/"):
+            DEVICE.bytes_down += len(body)
+        self.send_response(code)
+        self.send_header("Content-Type", "text/plain")
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def read_request(self):
+        url = urlparse(self.path)
+        length = int(self.headers.get("Content-Length", 0))
+        body = self.rfile.read(length) if length else b""
+        if not url.path.startswith("/sim/"):
+            DEVICE.requests += 1
+            DEVICE.bytes_up += len(self.requestline) + len(body)
+        params = {k: v[0] for k, v in parse_qs(url.query, keep_blank_values=True).items()}
+        return url.path, params, body
+
+    def do_GET(self):
+        path, params, _ = self.read_request()
+        keys = sorted(DEVICE.cards)
+        if path == "/cards":
+            self.reply(200, "".join(card_image.format_key(k) + "\n" for k in keys))
+        elif path == "/cards/digest":
+            digest = 0
+            for key in keys:
+                digest ^= card_image.mix(key)
+            self.reply(200, "digest %016x\ncards %d\ngeneration %d\n" % (digest, len(keys), DEVICE.generation))
+        elif path == "/cards/buckets":
+            try:
+                if "cards" in params:
+                    buckets = card_image.parse_index_list(params["cards"], card_image.SYNC_BUCKETS)
+                    self.reply(200, "".join(card_image.format_key(k) + "\n" for k in keys
+                                            if card_image.sync_bucket(k) in buckets))
+                    return
+                groups = None
+                if "groups" in params:
+                    groups = card_image.parse_index_list(
+                        params["groups"], card_image.SYNC_BUCKETS // card_image.SYNC_GROUP_SIZE)
+            except ValueError:
+                self.reply(400, "Invalid bucket list")
+                return
+            lines = card_image.bucket_lines(keys, groups)
+            self.reply(200, "generation %d\n" % DEVICE.generation + "".join(l + "\n" for l in lines))
+        elif path == "/cards/changes":
+            self.reply(410, "full resync required\ngeneration %d\n" % DEVICE.generation)
+        elif path == "/sim/stats":
+            self.reply(200, "requests %d\nbytes_up %d\nbytes_down %d\n" %
+                       (DEVICE.requests, DEVICE.bytes_up, DEVICE.bytes_down))
+        else:
+            self.reply(404, "Not found")
+
+    def do_PUT(self):
+        path, params, body = self.read_request()
+        try:
+            if path == "/cards":
+                cards = parse_cards(body)
+                mode = params.get("mode", "add")
+                if mode == "replace":
+                    DEVICE.change(cards)
+                elif mode == "remove":
+                    DEVICE.change(DEVICE.cards - cards)
+                else:
+                    DEVICE.change(DEVICE.cards | cards)
+                self.reply(200, "%d cards, generation %d" % (len(DEVICE.cards), DEVICE.generation))
+            elif path == "/card":
+                DEVICE.change(DEVICE.cards | {card_image.parse_key(params.get("number", ""))})
+                self.reply(200, "Card added")
+            else:
+                self.reply(404, "Not found")
+        except ValueError as e:
+            self.reply(400, str(e))
+
+    def do_DELETE(self):
+        path, params, _ = self.read_request()
+        try:
+            if path == "/card":
+                DEVICE.change(DEVICE.cards - {card_image.parse_key(params.get("number", ""))})
+                self.reply(200, "Card removed")
+            else:
+                self.reply(404, "Not found")
+        except ValueError as e:
+            self.reply(400, str(e))
+
+    def do_POST(self):
+        path, _, _ = self.read_request()
+        if path == "/sim/reset":
+            DEVICE.reset()
+            self.reply(200, "OK")
+        else:
+            self.reply(404, "Not found")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    parser.add_argument("--port", type=int, default=8089)
+    args = parser.parse_args()
+    server = HTTPServer(("127.0.0.1", args.port), Handler)
+    print("Stand-in device on 127.0.0.1:%d" % args.port, file=sys.stderr)
+    server.serve_forever()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,305 @@
+#!/usr/bin/env python3
+"""Build and verify perfect hash card images for PUT /cards/image.
+
+A card image holds a whole card set as a read-only minimal perfect hash
+table (PTHash-style hash and displace), so the door controller can check a
+card with one hash, one pilot lookup and one compare of the full key. The
+table is built here rather than on the device because finding the pilots
+takes far more time and memory than the controller should spend.
+
+    card_image.py build cards.txt cards.img
+    card_image.py verify cards.img cards.txt
+    card_image.py digest cards.txt
+    card_image.py buckets cards.txt [--groups 1,5 | --cards 17,80]
+
+The card file holds one card per line, as card, facility:card or
+format:facility:card, the same forms update_cards.sh accepts. verify checks
+the image's CRC, that every card in the file is found where the device
+will look for it, and that the image holds nothing else. digest prints the
+card set digest GET /cards/digest reports for a device holding exactly the
+cards in the file. buckets prints the file's side of GET /cards/buckets,
+in the same form, for update_cards.sh --reconcile.
+
+Images are laid out in 4 KiB pages so the device can map them from flash
+and use them in place. The hash functions and layout must match
+PerfectHashCardIndex in card_index.cpp.
+"""
+
+import argparse
+import struct
+import sys
+import zlib
+
+MASK64 = (1 << 64) - 1
+GOLDEN = 0x9E3779B97F4A7C15
+
+IMAGE_MAGIC = 0x314D4943  # "CIM1"
+IMAGE_VERSION = 3
+PAGE_SIZE = 4096  # Sections start on flash sector boundaries
+HEADER = struct.Struct("<IHHIIIIII")  # magic, version, headerSize, keyCount, slotCount, bucketCount, seed, generation, crc
+
+DEFAULT_FORMAT = 26
+LEGACY_FACILITY = 198
+
+KEYS_PER_BUCKET = 5    # 16-bit pilots: 3.2 bits per key
+LOAD_PERCENT = 99      # Spare slots keep the last buckets' pilot search short
+MAX_PILOT = 1 << 16
+MAX_SEEDS = 64
+
+SYNC_BUCKETS = 1024   # As CardDatabase::SYNC_BUCKETS
+SYNC_GROUP_SIZE = 4
+
+
+def mix(key):
+    """MurmurHash3 fmix64, as CardIndex::mix."""
+    key ^= key >> 33
+    key = (key * 0xFF51AFD7ED558CCD) & MASK64
+    key ^= key >> 33
+    key = (key * 0xC4CEB9FE1A85EC53) & MASK64
+    key ^= key >> 33
+    return key
+
+
+def key_hash(key, seed):
+    return mix((key + seed * GOLDEN) & MASK64)
+
+
+def bucket_of(hash_value, bucket_count):
+    return ((hash_value >> 32) * bucket_count) >> 32
+
+
+def slot_of(hash_value, pilot, slot_count):
+    return ((mix(hash_value ^ pilot) & 0xFFFFFFFF) * slot_count) >> 32
+
+
+def parse_key(text):
+    """Card text to a composite key, as CardDatabase::parseKey."""
+    fields = text.split(":")
+    if len(fields) > 3 or not all(f.isdigit() for f in fields):
+        raise ValueError("invalid card '%s'" % text)
+    values = [int(f) for f in fields]
+    if len(values) == 1:
+        values = [DEFAULT_FORMAT, LEGACY_FACILITY] + values
+    elif len(values) == 2:
+        values = [DEFAULT_FORMAT] + values
+    card_format, facility, card = values
+    if card_format > 0xFFFF or facility > 0xFFFF or card > 0xFFFFFFFF or card == 0:
+        raise ValueError("card '%s' out of range" % text)
+    return (card_format << 48) | (facility << 32) | card
+
+
+def format_key(key):
+    """Composite key to the device's text form, as CardDatabase::formatKey."""
+    card_format, facility, card = key >> 48, (key >> 32) & 0xFFFF, key & 0xFFFFFFFF
+    if card_format == DEFAULT_FORMAT:
+        return "%d:%d" % (facility, card)
+    return "%d:%d:%d" % (card_format, facility, card)
+
+
+def sync_bucket(key):
+    """Reconciliation bucket, as CardDatabase::syncBucket."""
+    return mix(key) >> 54
+
+
+def bucket_lines(keys, groups=None):
+    """GET /cards/buckets lines, without the generation: one per group, or
+    one per bucket in `groups` if given."""
+    buckets = [0] * SYNC_BUCKETS
+    for key in keys:
+        buckets[sync_bucket(key)] ^= mix(key)
+    lines = []
+    for group in range(SYNC_BUCKETS // SYNC_GROUP_SIZE):
+        if groups is not None and group not in groups:
+            continue
+        digest = 0
+        for bucket in range(group * SYNC_GROUP_SIZE, (group + 1) * SYNC_GROUP_SIZE):
+            if groups is not None:
+                lines.append("%d %016x" % (bucket, buckets[bucket]))
+            digest ^= buckets[bucket]
+        if groups is None:
+            lines.append("%d %016x" % (group, digest))
+    return lines
+
+
+def parse_index_list(text, limit):
+    indexes = set(int(i) for i in text.split(",") if i)
+    if any(i >= limit for i in indexes):
+        raise ValueError("index out of range")
+    return indexes
+
+
+def read_cards(path):
+    keys = set()
+    with open(path) as f:
+        for number, line in enumerate(f, 1):
+            text = "".join(line.split())
+            if not text:
+                continue
+            try:
+                keys.add(parse_key(text))
+            except ValueError as e:
+                sys.exit("%s:%d: %s" % (path, number, e))
+    return sorted(keys)
+
+
+def try_build(keys, seed, slot_count, bucket_count):
+    buckets = [[] for _ in range(bucket_count)]
+    for key in keys:
+        h = key_hash(key, seed)
+        buckets[bucket_of(h, bucket_count)].append((h, key))
+
+    # Largest buckets first, while the table is still mostly empty
+    order = sorted(range(bucket_count), key=lambda b: len(buckets[b]), reverse=True)
+    slots = [0] * slot_count
+    pilots = [0] * bucket_count
+    for b in order:
+        entries = buckets[b]
+        if not entries:
+            break
+        for pilot in range(MAX_PILOT):
+            positions = [slot_of(h, pilot, slot_count) for h, _ in entries]
+            if len(set(positions)) == len(positions) and not any(slots[p] for p in positions):
+                break
+        else:
+            return None
+        pilots[b] = pilot
+        for position, (_, key) in zip(positions, entries):
+            slots[position] = key
+    return pilots, slots
+
+
+def build_image(keys):
+    count = len(keys)
+    slot_count = max(1, -(-count * 100 // LOAD_PERCENT))
+    bucket_count = max(1, -(-count // KEYS_PER_BUCKET))
+
+    for seed in range(MAX_SEEDS):
+        built = try_build(keys, seed, slot_count, bucket_count)
+        if built is not None:
+            break
+    else:
+        sys.exit("No perfect hash found for %d cards" % count)
+
+    pilots, slots = built
+    pilot_bytes = struct.pack("<%dH" % bucket_count, *pilots)
+    pilot_bytes += b"\0" * (-len(pilot_bytes) % PAGE_SIZE)
+    body = pilot_bytes + struct.pack("<%dQ" % slot_count, *slots)
+    header = HEADER.pack(IMAGE_MAGIC, IMAGE_VERSION, HEADER.size, count, slot_count,
+                         bucket_count, seed, 0, zlib.crc32(body))
+    return header + b"\0" * (PAGE_SIZE - HEADER.size) + body
+
+
+def parse_image(data):
+    if len(data) < PAGE_SIZE:
+        raise ValueError("not a card image")
+    magic, version, header_size, count, slot_count, bucket_count, seed, _, crc = HEADER.unpack_from(data)
+    if magic != IMAGE_MAGIC or version != IMAGE_VERSION or header_size != HEADER.size:
+        raise ValueError("not a card image")
+    pilot_bytes = (bucket_count * 2 + PAGE_SIZE - 1) // PAGE_SIZE * PAGE_SIZE
+    if len(data) != PAGE_SIZE + pilot_bytes + slot_count * 8:
+        raise ValueError("size mismatch")
+    body = data[PAGE_SIZE:]
+    if zlib.crc32(body) != crc:
+        raise ValueError("CRC mismatch")
+    pilots = struct.unpack_from("<%dH" % bucket_count, body)
+    slots = struct.unpack_from("<%dQ" % slot_count, body, pilot_bytes)
+    return count, seed, pilots, slots
+
+
+def lookup_slot(key, seed, pilots, slot_count):
+    h = key_hash(key, seed)
+    return slot_of(h, pilots[bucket_of(h, len(pilots))], slot_count)
+
+
+def command_build(args):
+    keys = read_cards(args.cards)
+    image = build_image(keys)
+    with open(args.image, "wb") as f:
+        f.write(image)
+    overhead = (len(image) - 8 * len(keys)) * 8.0 / max(1, len(keys))
+    print("%d cards, %d bytes, %.2f bits per card over the keys, including page padding" % (len(keys), len(image), overhead))
+
+
+def command_verify(args):
+    with open(args.image, "rb") as f:
+        data = f.read()
+    try:
+        count, seed, pilots, slots = parse_image(data)
+    except ValueError as e:
+        sys.exit("%s: %s" % (args.image, e))
+
+    errors = 0
+    for position, key in enumerate(slots):
+        if key and lookup_slot(key, seed, pilots, len(slots)) != position:
+            print("%016x stored in slot %d, not where lookups go" % (key, position))
+            errors += 1
+    stored = sum(1 for key in slots if key)
+    if stored != count:
+        print("header says %d cards, image holds %d" % (count, stored))
+        errors += 1
+
+    if args.cards:
+        keys = read_cards(args.cards)
+        for key in keys:
+            if slots[lookup_slot(key, seed, pilots, len(slots))] != key:
+                print("%016x missing" % key)
+                errors += 1
+        if len(keys) != stored:
+            print("card file has %d cards, image holds %d" % (len(keys), stored))
+            errors += 1
+
+    if errors:
+        sys.exit("%s: %d errors" % (args.image, errors))
+    print("%s: %d cards OK" % (args.image, stored))
+
+
+def command_digest(args):
+    keys = read_cards(args.cards)
+    digest = 0
+    for key in keys:
+        digest ^= mix(key)  # As CardDatabase::cardHash
+    print("digest %016x" % digest)
+    print("cards %d" % len(keys))
+
+
+def command_buckets(args):
+    keys = read_cards(args.cards)
+    if args.cards_in is not None:
+        buckets = parse_index_list(args.cards_in, SYNC_BUCKETS)
+        for key in keys:
+            if sync_bucket(key) in buckets:
+                print(format_key(key))
+        return
+    groups = None
+    if args.groups is not None:
+        groups = parse_index_list(args.groups, SYNC_BUCKETS // SYNC_GROUP_SIZE)
+    for line in bucket_lines(keys, groups):
+        print(line)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    commands = parser.add_subparsers(dest="command", required=True)
+    build = commands.add_parser("build", help="build an image from a card file")
+    build.add_argument("cards")
+    build.add_argument("image")
+    build.set_defaults(run=command_build)
+    verify = commands.add_parser("verify", help="check an image, and optionally that it holds exactly a card file")
+    verify.add_argument("image")
+    verify.add_argument("cards", nargs="?")
+    verify.set_defaults(run=command_verify)
+    digest = commands.add_parser("digest", help="print the card set digest of a card file")
+    digest.add_argument("cards")
+    digest.set_defaults(run=command_digest)
+    buckets = commands.add_parser("buckets", help="print a card file's bucket digests, or its cards in some buckets")
+    buckets.add_argument("cards")
+    which = buckets.add_mutually_exclusive_group()
+    which.add_argument("--groups", help="comma separated groups to list the buckets of")
+    which.add_argument("--cards", dest="cards_in", help="comma separated buckets to list the cards of")
+    buckets.set_defaults(run=command_buckets)
+    args = parser.parse_args()
+    args.run(args)
+
+
+if __name__ == "__main__":
+    main()
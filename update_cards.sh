@@ -9,6 +9,24 @@ DEVICE_IP=""
 USERNAME=""
 PASSWORD=""
 CARD_FILE=""
+BULK=false
+FORCE=false
+STATE_DIR="${HOME}/.update_cards"
+IMAGE_TOOL="$(dirname "$0")/tools/card_image.py"
+# Most groups whose buckets reconcile compares first, to judge the drift
+RECONCILE_SAMPLE_GROUPS=8
+
+# Cards are "card", "facility:card" or "format:facility:card". A bare card
+# number is a 26-bit card from facility 198, and the device lists 26-bit
+# cards as "facility:card", so this awk function maps any of them to the
+# device's form for comparing card lists.
+CARD_KEY_AWK='function key(card,  f, n) {
+    n = split(card, f, ":")
+    if (n == 1) return "198:" card
+    if (n == 3 && f[1] == "26") return f[2] ":" f[3]
+    return card
+}'
+CARD_PATTERN='^[0-9]+(:[0-9]+){0,2}$'
 
 # Colors for output
 RED='\033[0;31m'
@@ -120,10 +138,9 @@ clear_all_cards() {
     fi
 }
 
-# Function to update cards from file
+# Function to add cards from file one request at a time
 update_cards_from_file() {
     local file_path=$1
-    local action=$2  # "add" or "replace"
     
     if [ ! -f "$file_path" ]; then
         print_status $RED "Error: Card file '${file_path}' not found!"
@@ -136,11 +153,6 @@ update_cards_from_file() {
     local total_cards=$(wc -l < "$file_path")
     print_status $YELLOW "Found ${total_cards} cards in file"
     
-    # If replacing, clear all existing cards first
-    if [ "$action" = "replace" ]; then
-        clear_all_cards
-    fi
-    
     local added_count=0
     local failed_count=0
     local line_number=0
@@ -158,7 +170,7 @@ update_cards_from_file() {
         card_number=$(echo "$card_number" | tr -d '[:space:]')
         
         # Validate card number (should be numeric)
-        if ! [[ "$card_number" =~ ^[0-9]+$ ]]; then
+        if ! [[ "$card_number" =~ $CARD_PATTERN ]]; then
             print_status $RED "✗ Invalid card number on line ${line_number}: '${card_number}'"
             ((failed_count++))
             continue
@@ -184,6 +196,334 @@ update_cards_from_file() {
     fi
 }
 
+# Function to send one bulk request; card list on stdin, mode in $1
+bulk_request() {
+    local mode=$1
+    local response=$(curl -s -w "%{http_code}" -X PUT \
+        -u "${USERNAME}:${PASSWORD}" \
+        -H "Content-Type: application/octet-stream" \
+        --data-binary @- \
+        "http://${DEVICE_IP}/cards?mode=${mode}")
+    
+    local http_code="${response: -3}"
+    local response_body="${response%???}"
+    
+    if [ "$http_code" -eq 200 ]; then
+        print_status $GREEN "✓ ${mode}: ${response_body}"
+        return 0
+    else
+        print_status $RED "✗ Bulk ${mode} failed (HTTP ${http_code})"
+        print_status $YELLOW "Response: ${response_body}"
+        return 1
+    fi
+}
+
+# Function to upload a whole card file in a single PUT /cards request
+bulk_update_cards_from_file() {
+    local file_path=$1
+    local mode=$2  # "add" or "replace"
+    
+    if [ ! -f "$file_path" ]; then
+        print_status $RED "Error: Card file '${file_path}' not found!"
+        exit 1
+    fi
+    
+    print_status $YELLOW "Reading cards from: ${file_path}"
+    
+    # Strip whitespace and blank lines, and reject anything that isn't a
+    # card before sending so the device never sees a partial bad upload
+    local cleaned=$(tr -d ' \t\r' < "$file_path" | grep -v '^$')
+    local invalid=$(echo "$cleaned" | grep -nEv "$CARD_PATTERN")
+    if [ -n "$invalid" ]; then
+        print_status $RED "✗ Invalid card numbers in ${file_path}:"
+        echo "$invalid"
+        return 1
+    fi
+    
+    local total_cards=$(echo "$cleaned" | grep -c .)
+    print_status $YELLOW "Uploading ${total_cards} cards (${mode})..."
+    
+    echo "$cleaned" | bulk_request "$mode"
+}
+
+# Function to build a perfect hash card image from a card file, check it
+# holds exactly the file's cards, and install it with one PUT /cards/image.
+# Like --replace this swaps the whole set atomically.
+upload_card_image() {
+    local file_path=$1
+    
+    if [ ! -f "$file_path" ]; then
+        print_status $RED "Error: Card file '${file_path}' not found!"
+        exit 1
+    fi
+    
+    local image=$(mktemp)
+    trap "rm -f '$image'" RETURN
+    
+    print_status $YELLOW "Building card image from: ${file_path}"
+    python3 "$IMAGE_TOOL" build "$file_path" "$image" || return 1
+    python3 "$IMAGE_TOOL" verify "$image" "$file_path" || return 1
+    
+    local response=$(curl -s -w "%{http_code}" -X PUT \
+        -u "${USERNAME}:${PASSWORD}" \
+        -H "Content-Type: application/octet-stream" \
+        --data-binary @"$image" \
+        "http://${DEVICE_IP}/cards/image")
+    
+    local http_code="${response: -3}"
+    local response_body="${response%???}"
+    
+    if [ "$http_code" -eq 200 ]; then
+        print_status $GREEN "✓ ${response_body}"
+        return 0
+    else
+        print_status $RED "✗ Image upload failed (HTTP ${http_code})"
+        print_status $YELLOW "Response: ${response_body}"
+        return 1
+    fi
+}
+
+# Function to fetch changes since a generation. Prints the response body
+# and returns 0 for a delta, 2 if the device needs a full resync
+fetch_changes() {
+    local since=$1
+    local response=$(curl -s -w "%{http_code}" \
+        -u "${USERNAME}:${PASSWORD}" \
+        "http://${DEVICE_IP}/cards/changes?since=${since}")
+    
+    local http_code="${response: -3}"
+    echo "${response%???}"
+    
+    case $http_code in
+        200) return 0 ;;
+        410) return 2 ;;
+        *) return 1 ;;
+    esac
+}
+
+# Function to apply +card/-card change lines (stdin) to a sorted card list file
+apply_changes() {
+    local cards_file=$1
+    awk "$CARD_KEY_AWK"'
+         NR == FNR { if ($0 != "") set[key($0)] = 1; next }
+         /^\+/ { set[key(substr($0, 2))] = 1 }
+         /^-/ { delete set[key(substr($0, 2))] }
+         END { for (card in set) print card }' "$cards_file" - | sort -u
+}
+
+# Function to bring a device in line with a card file using only the
+# changes since the last sync. The device's card set and generation as of
+# the last sync are kept in STATE_DIR; anything the device changed since
+# then is fetched from /cards/changes, and only the difference is uploaded.
+sync_cards_incremental() {
+    local file_path=$1
+    local state="${STATE_DIR}/${DEVICE_IP}"
+    
+    if [ ! -f "$file_path" ]; then
+        print_status $RED "Error: Card file '${file_path}' not found!"
+        exit 1
+    fi
+    
+    local desired=$(tr -d ' \t\r' < "$file_path" | grep -v '^$')
+    local invalid=$(echo "$desired" | grep -Ev "$CARD_PATTERN")
+    if [ -n "$invalid" ]; then
+        print_status $RED "✗ Invalid card numbers in ${file_path}:"
+        echo "$invalid"
+        return 1
+    fi
+    desired=$(echo "$desired" | awk "$CARD_KEY_AWK"' { print key($0) }' | sort -u)
+    
+    mkdir -p "$STATE_DIR"
+    local since=$(cat "${state}.generation" 2>/dev/null)
+    local changes
+    local status=2
+    if [ -n "$since" ] && [ -f "${state}.cards" ]; then
+        changes=$(fetch_changes "$since")
+        status=$?
+    fi
+    
+    if [ $status -eq 1 ]; then
+        print_status $RED "Failed to fetch changes from device"
+        return 1
+    fi
+    
+    if [ $status -eq 2 ]; then
+        # No usable history: one atomic replace, then record where we are
+        print_status $YELLOW "Full resync required, replacing all cards"
+        echo "$desired" | bulk_request "replace" || return 1
+        changes=$(fetch_changes 0)
+        echo "$changes" | sed -n 's/^generation //p' > "${state}.generation"
+        echo "$desired" > "${state}.cards"
+        return 0
+    fi
+    
+    # Bring our copy of the device set up to date, then diff against the file
+    local generation=$(echo "$changes" | sed -n 's/^generation //p')
+    local device=$(echo "$changes" | grep '^[+-]' | apply_changes "${state}.cards")
+    local adds=$(comm -13 <(echo "$device") <(echo "$desired") | grep -v '^$')
+    local removes=$(comm -23 <(echo "$device") <(echo "$desired") | grep -v '^$')
+    
+    if [ -z "$adds" ] && [ -z "$removes" ]; then
+        print_status $GREEN "Device is up to date at generation ${generation}"
+    else
+        print_status $YELLOW "Adding $(echo "$adds" | grep -c .) cards, removing $(echo "$removes" | grep -c .) cards"
+        if [ -n "$adds" ]; then
+            echo "$adds" | bulk_request "add" || return 1
+        fi
+        if [ -n "$removes" ]; then
+            echo "$removes" | bulk_request "remove" || return 1
+        fi
+        
+        # Pick up our own changes (and anything that raced with them)
+        changes=$(fetch_changes "$generation") || return 1
+        generation=$(echo "$changes" | sed -n 's/^generation //p')
+        device=$(echo "$changes" | grep '^[+-]' | apply_changes <(echo "$device"))
+    fi
+    
+    echo "$generation" > "${state}.generation"
+    echo "$device" > "${state}.cards"
+}
+
+# Function to GET a /cards/buckets query. Prints the response body and
+# returns 1 unless it succeeded
+fetch_buckets() {
+    local query=$1
+    local response=$(curl -s -w "%{http_code}" \
+        -u "${USERNAME}:${PASSWORD}" \
+        "http://${DEVICE_IP}/cards/buckets${query}")
+    
+    local http_code="${response: -3}"
+    echo "${response%???}"
+    [ "$http_code" = "200" ]
+}
+
+# Function to list, comma separated, the indexes on the lines that differ
+# between two "index digest" listings
+differing_indexes() {
+    comm -3 <(echo "$1" | grep -v '^generation' | sort) <(echo "$2" | sort) |
+        awk '{ print $1 }' | sort -un | paste -sd, -
+}
+
+# Function to count the entries in a comma separated list
+count_indexes() {
+    echo "$1" | tr ',' '\n' | grep -c .
+}
+
+# Function to check whether finishing a reconcile would likely move more
+# bytes than replacing every card. Given the fraction of buckets that
+# differ and the bytes of digest listings still to fetch, the rest is the
+# differing buckets' cards fetched from the device and about as many
+# uploaded; a replace uploads the whole file.
+costs_more_than_replace() {
+    local fraction=$1 listing=$2 file_bytes=$3
+    print_status $YELLOW "About $(awk -v f="$fraction" 'BEGIN { printf "%d", f * 100 }')% of card buckets differ"
+    awk -v f="$fraction" -v l="$listing" -v r="$file_bytes" 'BEGIN { exit !(l + 2 * f * r > r) }'
+}
+
+# Function to bring a device in line with a card file when there is no
+# usable sync state, such as after a restore, without re-uploading every
+# card. Both sides split their cards into 1024 buckets by hash, in 256
+# groups of 4; comparing the group digests, then the buckets of the groups
+# that differ, finds the buckets that differ in two requests, and only
+# their cards are fetched and diffed. The buckets of a few groups spread
+# over the range are compared first, and from those and each later listing
+# it estimates the bytes still to move, replacing instead as soon as that
+# exceeds the file: once a few percent of a large set has drifted, nearly
+# every bucket differs and the digests alone would cost more than they save.
+reconcile_cards() {
+    local file_path=$1
+    
+    if [ ! -f "$file_path" ]; then
+        print_status $RED "Error: Card file '${file_path}' not found!"
+        exit 1
+    fi
+    
+    local file_bytes=$(wc -c < "$file_path")
+    local device groups buckets wanted fraction
+    # Below about 2000 cards the group listing alone is a quarter of the
+    # file, and leaves too little to save
+    if [ $((256 * 21 * 4)) -gt "$file_bytes" ]; then
+        print_status $YELLOW "Too few cards to save by comparing digests, replacing all cards"
+        bulk_update_cards_from_file "$file_path" "replace"
+        return
+    fi
+    
+    # The sample, at about 90 bytes a group, costs around 1% of the file
+    local sample_groups=$((file_bytes / 9000))
+    if [ "$sample_groups" -gt "$RECONCILE_SAMPLE_GROUPS" ]; then
+        sample_groups=$RECONCILE_SAMPLE_GROUPS
+    fi
+    local sample=$(seq 0 $((256 / sample_groups)) 255 | head -n "$sample_groups" | paste -sd, -)
+    buckets=$(python3 "$IMAGE_TOOL" buckets "$file_path" --groups "$sample") || return 1
+    device=$(fetch_buckets "?groups=${sample}") || { print_status $RED "Failed to fetch bucket digests from device"; return 1; }
+    buckets=$(differing_indexes "$device" "$buckets")
+    # The group listing, and the buckets of the groups expected to differ
+    fraction=$(awk -v d=$(count_indexes "$buckets") -v n=$((sample_groups * 4)) 'BEGIN { print d / n }')
+    if ! costs_more_than_replace "$fraction" \
+            $(awk -v f="$fraction" 'BEGIN { printf "%d", 256 * 21 + 256 * (1 - (1 - f) ^ 4) * 4 * 22 }') "$file_bytes"; then
+        groups=$(python3 "$IMAGE_TOOL" buckets "$file_path") || return 1
+        device=$(fetch_buckets "") || { print_status $RED "Failed to fetch bucket digests from device"; return 1; }
+        local generation=$(echo "$device" | sed -n 's/^generation //p')
+        groups=$(differing_indexes "$device" "$groups")
+        if [ -z "$groups" ]; then
+            print_status $GREEN "Device is up to date at generation ${generation}"
+            return 0
+        fi
+        
+        # A group differs unless all 4 of its buckets match
+        fraction=$(awk -v g=$(count_indexes "$groups") 'BEGIN { print 1 - (1 - g / 256) ^ 0.25 }')
+        if ! costs_more_than_replace "$fraction" $(( $(count_indexes "$groups") * 4 * 22 )) "$file_bytes"; then
+            buckets=$(python3 "$IMAGE_TOOL" buckets "$file_path" --groups "$groups") || return 1
+            device=$(fetch_buckets "?groups=${groups}") || { print_status $RED "Failed to fetch bucket digests from device"; return 1; }
+            buckets=$(differing_indexes "$device" "$buckets")
+            
+            fraction=$(awk -v b=$(count_indexes "$buckets") 'BEGIN { print b / 1024 }')
+            if ! costs_more_than_replace "$fraction" 0 "$file_bytes"; then
+                wanted=$(python3 "$IMAGE_TOOL" buckets "$file_path" --cards "$buckets") || return 1
+                device=$(fetch_buckets "?cards=${buckets}") || { print_status $RED "Failed to fetch cards from device"; return 1; }
+                wanted=$(echo "$wanted" | sort)
+                device=$(echo "$device" | sort)
+                local adds=$(comm -13 <(echo "$device") <(echo "$wanted") | grep -v '^$')
+                local removes=$(comm -23 <(echo "$device") <(echo "$wanted") | grep -v '^$')
+                
+                print_status $YELLOW "Adding $(echo "$adds" | grep -c .) cards, removing $(echo "$removes" | grep -c .) cards"
+                if [ -n "$adds" ]; then
+                    echo "$adds" | bulk_request "add" || return 1
+                fi
+                if [ -n "$removes" ]; then
+                    echo "$removes" | bulk_request "remove" || return 1
+                fi
+                return 0
+            fi
+        fi
+    fi
+    
+    print_status $YELLOW "Reconciling would cost more than a replace, replacing all cards"
+    bulk_update_cards_from_file "$file_path" "replace"
+}
+
+# Function to check whether the device already holds exactly the cards in
+# a file, by comparing its card set digest from /cards/digest with the
+# file's. Returns 1 if they differ or either digest can't be had, so the
+# caller just goes ahead with the upload.
+device_matches_file() {
+    local file_path=$1
+    local expected=$(python3 "$IMAGE_TOOL" digest "$file_path" 2>/dev/null) || return 1
+    local response=$(curl -s -w "%{http_code}" \
+        -u "${USERNAME}:${PASSWORD}" \
+        "http://${DEVICE_IP}/cards/digest")
+    
+    local http_code="${response: -3}"
+    if [ "$http_code" != "200" ]; then
+        return 1
+    fi
+    
+    # Both give "digest <hex>" and "cards <count>" lines; the device adds
+    # its generation
+    local actual=$(echo "${response%???}" | grep -E '^(digest|cards) ')
+    [ -n "$expected" ] && [ "$actual" = "$expected" ]
+}
+
 # Function to show usage
 show_usage() {
     echo "Card Database Update Script"
@@ -197,25 +537,36 @@ show_usage() {
     echo ""
     echo "Actions (choose one):"
     echo "  -a, --add           Add cards to existing database"
-    echo "  -r, --replace       Replace all cards with file contents"
+    echo "  -r, --replace       Atomically replace all cards with file contents"
     echo "  -l, --list          List all current cards"
     echo "  -c, --clear         Clear all cards from database"
+    echo "  -s, --sync          Upload only the changes needed to match the card file"
+    echo "  -m, --image         Replace all cards with a perfect hash image built from the file"
+    echo "  -R, --reconcile     Find and upload the differences by comparing bucket digests"
     echo ""
     echo "Additional Options:"
     echo "  -f, --file FILE     Card list file (required for add/replace actions)"
+    echo "  -b, --bulk          Send add as a single request instead of one per card"
+    echo "  -F, --force         Upload even if the device's card digest already matches the file"
+    echo "  --state-dir DIR     Where --sync keeps per-device state (default: ~/.update_cards)"
     echo "  -h, --help          Show this help message"
     echo ""
     echo "Examples:"
     echo "  $0 -i 192.168.1.22 -u admin -p password -f mycards.txt -a"
     echo "  $0 -i 192.168.1.22 -u admin -p password -f mycards.txt -r"
+    echo "  $0 -i 192.168.1.22 -u admin -p password -f mycards.txt -a -b"
+    echo "  $0 -i 192.168.1.22 -u admin -p password -f mycards.txt -s"
+    echo "  $0 -i 192.168.1.22 -u admin -p password -f mycards.txt -m"
+    echo "  $0 -i 192.168.1.22 -u admin -p password -f mycards.txt -R"
     echo "  $0 -i 192.168.1.22 -u admin -p password -l"
     echo "  $0 -i 192.168.1.22 -u admin -p password -c"
     echo ""
     echo "Card file format:"
-    echo "  One card number per line, e.g.:"
+    echo "  One card per line, as card, facility:card or format:facility:card."
+    echo "  A bare card number is a 26-bit card from facility 198, e.g.:"
     echo "  12345"
-    echo "  67890"
-    echo "  11111"
+    echo "  42:67890"
+    echo "  35:1000:11111"
 }
 
 # Parse command line arguments
@@ -254,6 +605,30 @@ while [[ $# -gt 0 ]]; do
             ACTION="clear"
             shift
             ;;
+        -s|--sync)
+            ACTION="sync"
+            shift
+            ;;
+        -m|--image)
+            ACTION="image"
+            shift
+            ;;
+        -R|--reconcile)
+            ACTION="reconcile"
+            shift
+            ;;
+        --state-dir)
+            STATE_DIR="$2"
+            shift 2
+            ;;
+        -b|--bulk)
+            BULK=true
+            shift
+            ;;
+        -F|--force)
+            FORCE=true
+            shift
+            ;;
         -h|--help)
             show_usage
             exit 0
@@ -286,16 +661,16 @@ if [ -z "$PASSWORD" ]; then
 fi
 
 # Validate action-specific requirements
-if [ "$ACTION" = "add" ] || [ "$ACTION" = "replace" ]; then
+if [ "$ACTION" = "add" ] || [ "$ACTION" = "replace" ] || [ "$ACTION" = "sync" ] || [ "$ACTION" = "image" ] || [ "$ACTION" = "reconcile" ]; then
     if [ -z "$CARD_FILE" ]; then
-        print_status $RED "Error: Card file is required for add/replace actions (-f or --file)"
+        print_status $RED "Error: Card file is required for add/replace/sync/image/reconcile actions (-f or --file)"
         show_usage
         exit 1
     fi
 fi
 
 if [ -z "$ACTION" ]; then
-    print_status $RED "Error: Action is required (-a, -r, -l, or -c)"
+    print_status $RED "Error: Action is required (-a, -r, -s, -m, -R, -l, or -c)"
     show_usage
     exit 1
 fi
@@ -305,12 +680,37 @@ print_status $YELLOW "Card Database Update Script"
 print_status $YELLOW "Device: ${DEVICE_IP}"
 print_status $YELLOW "User: ${USERNAME}"
 
+# A device that already holds exactly the file's cards needs nothing from
+# any of the file actions, so a fleet run only talks at length to the
+# devices that are out of date
+if [ -n "$CARD_FILE" ] && [ "$ACTION" != "list" ] && [ "$ACTION" != "clear" ] && [ "$FORCE" != true ]; then
+    if device_matches_file "$CARD_FILE"; then
+        print_status $GREEN "Device already holds exactly the cards in ${CARD_FILE}, skipping"
+        exit 0
+    fi
+fi
+
 case $ACTION in
     "add")
-        update_cards_from_file "$CARD_FILE" "add"
+        if [ "$BULK" = true ]; then
+            bulk_update_cards_from_file "$CARD_FILE"
+        else
+            update_cards_from_file "$CARD_FILE"
+        fi
         ;;
     "replace")
-        update_cards_from_file "$CARD_FILE" "replace"
+        # Always a single atomic request; clearing and re-adding card by
+        # card leaves the door denying members until the upload finishes
+        bulk_update_cards_from_file "$CARD_FILE" "replace"
+        ;;
+    "sync")
+        sync_cards_incremental "$CARD_FILE"
+        ;;
+    "image")
+        upload_card_image "$CARD_FILE"
+        ;;
+    "reconcile")
+        reconcile_cards "$CARD_FILE"
         ;;
     "list")
         list_cards
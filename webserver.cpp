@@ -5,6 +5,7 @@
 #include <ADS7828.h>
 #include "secret.h"
 #include "card_database.h"
+#include <algorithm>
 
 // External declarations
 extern SemaphoreHandle_t access_log_mutex;
@@ -27,7 +28,7 @@ extern ADS7828 adc;
 // static CardReaderWebServer webServerInstance;
 
 CardReaderWebServer::CardReaderWebServer(CardReader* readers, size_t numReaders, DoorStrike* strikes, size_t numStrikes, CardDatabase& cardDb, AccessLog& accessLog)
-    : server(80), readers(readers), numReaders(numReaders), strikes(strikes), numStrikes(numStrikes), cardDb(cardDb), accessLog(accessLog) {
+    : server(80), readers(readers), numReaders(numReaders), strikes(strikes), numStrikes(numStrikes), cardDb(cardDb), accessLog(accessLog), pendingImportRequest(nullptr), pendingImageRequest(nullptr), pendingImageFailed(false) {
 }
 
 CardReaderWebServer::~CardReaderWebServer() {
@@ -115,10 +116,95 @@ void CardReaderWebServer::setupRoutes() {
         request->send(200, "text/plain", "");
     }).addMiddleware(&basicAuth);
 
+    // Must be registered before /cards, which would also match it
+    server.on("/cards/changes", HTTP_GET, [this](AsyncWebServerRequest *request) {
+        handleCardChanges(request);
+    }).addMiddleware(&basicAuth);
+
+    server.on("/cards/digest", HTTP_GET, [this](AsyncWebServerRequest *request) {
+        handleCardDigest(request);
+    }).addMiddleware(&basicAuth);
+
+    server.on("/cards/buckets", HTTP_GET, [this](AsyncWebServerRequest *request) {
+        handleCardBuckets(request);
+    }).addMiddleware(&basicAuth);
+
+    server.on("/cards/expiring", HTTP_GET, [this](AsyncWebServerRequest *request) {
+        handleListExpiring(request);
+    }).addMiddleware(&basicAuth);
+
+    server.on("/cards/usage", HTTP_GET, [this](AsyncWebServerRequest *request) {
+        handleCardUsage(request);
+    }).addMiddleware(&basicAuth);
+
+    server.on("/cards/meta", HTTP_GET, [this](AsyncWebServerRequest *request) {
+        handleGetMetadata(request);
+    }).addMiddleware(&basicAuth);
+
+    server.on("/cards/meta", HTTP_PUT, [this](AsyncWebServerRequest *request) {
+        handleSetMetadata(request);
+    }).addMiddleware(&basicAuth);
+
+    server.on("/cards/meta", HTTP_DELETE, [this](AsyncWebServerRequest *request) {
+        handleRemoveMetadata(request);
+    }).addMiddleware(&basicAuth);
+
+    server.on("/cards/range", HTTP_GET, [this](AsyncWebServerRequest *request) {
+        handleListRanges(request);
+    }).addMiddleware(&basicAuth);
+
+    server.on("/cards/range", HTTP_PUT, [this](AsyncWebServerRequest *request) {
+        handleAddRange(request);
+    }).addMiddleware(&basicAuth);
+
+    server.on("/cards/range", HTTP_DELETE, [this](AsyncWebServerRequest *request) {
+        handleRemoveRange(request);
+    }).addMiddleware(&basicAuth);
+
+    server.on("/cards/image", HTTP_PUT, [this](AsyncWebServerRequest *request) {
+        handleInstallImage(request);
+    }, nullptr, [this](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total) {
+        handleInstallImageBody(request, data, len, index, total);
+    }).addMiddleware(&basicAuth);
+
     server.on("/cards", HTTP_GET, [this](AsyncWebServerRequest *request) {
         handleListCards(request);
     }).addMiddleware(&basicAuth);
 
+    server.on("/cards", HTTP_PUT | HTTP_POST, [this](AsyncWebServerRequest *request) {
+        handleImportCards(request);
+    }, nullptr, [this](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total) {
+        handleImportCardsBody(request, data, len, index, total);
+    }).addMiddleware(&basicAuth);
+
+    server.on("/facilities", HTTP_GET, [this](AsyncWebServerRequest *request) {
+        handleListFacilities(request);
+    }).addMiddleware(&basicAuth);
+
+    server.on("/facilities", HTTP_PUT, [this](AsyncWebServerRequest *request) {
+        handleSetFacilities(request);
+    }).addMiddleware(&basicAuth);
+
+    server.on("/schedules", HTTP_GET, [this](AsyncWebServerRequest *request) {
+        handleListSchedules(request);
+    }).addMiddleware(&basicAuth);
+
+    server.on("/schedules", HTTP_PUT, [this](AsyncWebServerRequest *request) {
+        handleSetSchedule(request);
+    }).addMiddleware(&basicAuth);
+
+    server.on("/schedules", HTTP_DELETE, [this](AsyncWebServerRequest *request) {
+        handleRemoveSchedule(request);
+    }).addMiddleware(&basicAuth);
+
+    server.on("/holidays", HTTP_GET, [this](AsyncWebServerRequest *request) {
+        handleListHolidays(request);
+    }).addMiddleware(&basicAuth);
+
+    server.on("/holidays", HTTP_PUT, [this](AsyncWebServerRequest *request) {
+        handleSetHolidays(request);
+    }).addMiddleware(&basicAuth);
+
     // Diagnostics endpoints
     server.on("/diagnostics/strike/status", HTTP_GET, [this](AsyncWebServerRequest *request) {
         handleStrikeStatus(request);
@@ -148,6 +234,10 @@ void CardReaderWebServer::setupRoutes() {
         handleCardReaderFuse(request);
     }).addMiddleware(&basicAuth);
 
+    server.on("/diagnostics/carddb", HTTP_GET, [this](AsyncWebServerRequest *request) {
+        handleCardDatabaseStats(request);
+    }).addMiddleware(&basicAuth);
+
     server.on("/diagnostics/cardreader/list", HTTP_GET, [this](AsyncWebServerRequest *request) {
         handleCardReaderList(request);
     }).addMiddleware(&basicAuth);
@@ -197,15 +287,36 @@ void CardReaderWebServer::handleAddCard(AsyncWebServerRequest *request) {
         return;
     }
     String card = request->getParam("number")->value();
-    if (!card.toInt()) {
+    CardDatabase::CardKey key;
+    if (!CardDatabase::parseKey(card.c_str(), key)) {
         request->send(400, "text/plain", "Invalid card number");
         return;
     }
+    // A guest card is removed at its expiry; adding a card without one
+    // makes it permanent again
+    uint32_t expiresAt = 0;
+    if (request->hasParam("expires") &&
+        (!parseNumber(request->getParam("expires")->value(), UINT32_MAX, expiresAt) || expiresAt == 0)) {
+        request->send(400, "text/plain", "Invalid expires");
+        return;
+    }
     
-    if (cardDb.addCard(card.toInt())) {
-        request->send(200, "text/plain", card);
-    } else {
+    // The change is written to flash with the next batch unless the
+    // caller asks to wait for it. A card new to the set is taken out again
+    // if its expiry can't be saved, so a guest card is never left enrolled
+    // for good; one already enrolled keeps its old expiry.
+    bool enrolled = cardDb.getSnapshot()->contains(key);
+    if (!cardDb.addCard(key)) {
         request->send(500, "text/plain", "Failed to add card");
+    } else if (!cardDb.setCardExpiry(key, expiresAt)) {
+        if (!enrolled) {
+            cardDb.removeCard(key);
+        }
+        request->send(500, "text/plain", "Failed to save card expiry");
+    } else if (request->hasParam("sync") && !cardDb.flush()) {
+        request->send(500, "text/plain", "Card added but not saved");
+    } else {
+        request->send(200, "text/plain", card);
     }
 }
 
@@ -216,21 +327,652 @@ void CardReaderWebServer::handleRemoveCard(AsyncWebServerRequest *request) {
         return;
     }
     String card = request->getParam("number")->value();
-    if (!card.toInt()) {
+    CardDatabase::CardKey key;
+    if (!CardDatabase::parseKey(card.c_str(), key)) {
         request->send(400, "text/plain", "Invalid card number");
         return;
     }
     
-    if (cardDb.removeCard(card.toInt())) {
-        request->send(200, "text/plain", card);
-    } else {
+    if (!cardDb.removeCard(key) || !cardDb.setCardExpiry(key, 0)) {
         request->send(500, "text/plain", "Failed to remove card");
+    } else if (request->hasParam("sync") && !cardDb.flush()) {
+        request->send(500, "text/plain", "Card removed but not saved");
+    } else {
+        request->send(200, "text/plain", card);
     }
 }
 
 void CardReaderWebServer::handleListCards(AsyncWebServerRequest *request) {
-    String cards = cardDb.getAllCards();
-    request->send(200, "text/plain", cards);
+    // Stream straight from a snapshot into the send buffer rather than
+    // building the whole list in one String
+    std::shared_ptr<CardDatabase::Cursor> cursor =
+        std::make_shared<CardDatabase::Cursor>(cardDb.openCursor());
+    AsyncWebServerResponse *response = request->beginChunkedResponse("text/plain",
+        [cursor](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+            if (cursor->done()) {
+                return 0;
+            }
+            size_t written = cursor->read(buffer, maxLen);
+            return written > 0 ? written : RESPONSE_TRY_AGAIN;
+        });
+    request->send(response);
+}
+
+void CardReaderWebServer::handleImportCardsBody(AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total) {
+    if (index == 0) {
+        if (pendingImportRequest != nullptr && pendingImportRequest != request) {
+            return;  // Another import is streaming; handleImportCards answers 409
+        }
+        // Body chunks arrive before the middleware runs, but the headers are
+        // in, so credentials are checked before any heap is spent on the
+        // list; the middleware then answers 401
+        if (!basicAuth.allowed(request)) {
+            return;
+        }
+        pendingImport.reset(new CardDatabase::CardImport());
+        pendingImportRequest = request;
+        request->onDisconnect([this, request]() {
+            if (pendingImportRequest == request) {
+                pendingImport.reset();
+                pendingImportRequest = nullptr;
+            }
+        });
+    }
+    
+    // Only parsed here; nothing is committed until handleImportCards
+    if (pendingImportRequest == request) {
+        pendingImport->feed(data, len);
+    }
+}
+
+void CardReaderWebServer::handleImportCards(AsyncWebServerRequest *request) {
+    std::unique_ptr<CardDatabase::CardImport> import;
+    if (pendingImportRequest == request) {
+        import.swap(pendingImport);
+        pendingImportRequest = nullptr;
+    } else if (request->contentLength() == 0) {
+        import.reset(new CardDatabase::CardImport());
+    } else {
+        request->send(409, "text/plain", "Another card import is in progress");
+        return;
+    }
+    
+    String mode = request->hasParam("mode") ? request->getParam("mode")->value() : "add";
+    if (mode != "add" && mode != "remove" && mode != "replace") {
+        request->send(400, "text/plain", "Invalid mode");
+        return;
+    }
+    if (!import->finish()) {
+        request->send(400, "text/plain", import->getError());
+        return;
+    }
+    
+    size_t count = import->cards.size();
+    bool success;
+    if (mode == "replace") {
+        success = cardDb.replaceCards(import->cards);
+    } else if (mode == "remove") {
+        success = cardDb.removeCards(import->cards) && cardDb.flush();
+    } else {
+        success = cardDb.addCards(import->cards) && cardDb.flush();
+    }
+    if (success) {
+        const char* verb = (mode == "remove") ? " cards removed, " : " cards imported, ";
+        request->send(200, "text/plain", String(count) + verb + String(cardDb.getCardCount()) + " total");
+    } else {
+        request->send(500, "text/plain", "Failed to import cards");
+    }
+}
+
+void CardReaderWebServer::handleInstallImageBody(AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total) {
+    if (index == 0) {
+        if (pendingImageRequest != nullptr && pendingImageRequest != request) {
+            return;  // Another upload is streaming; handleInstallImage answers 409
+        }
+        // As with imports, credentials are checked before anything is
+        // written; the middleware answers 401
+        if (!basicAuth.allowed(request)) {
+            return;
+        }
+        // Images can be larger than free heap, so they go straight to flash
+        pendingImage = LittleFS.open(CardDatabase::IMAGE_UPLOAD_PATH, FILE_WRITE);
+        pendingImageRequest = request;
+        pendingImageFailed = !pendingImage;
+        request->onDisconnect([this, request]() {
+            if (pendingImageRequest == request) {
+                pendingImage.close();
+                LittleFS.remove(CardDatabase::IMAGE_UPLOAD_PATH);
+                pendingImageRequest = nullptr;
+            }
+        });
+    }
+    
+    // Nothing is installed until handleInstallImage
+    if (pendingImageRequest == request && !pendingImageFailed) {
+        pendingImageFailed = pendingImage.write(data, len) != len;
+    }
+}
+
+void CardReaderWebServer::handleInstallImage(AsyncWebServerRequest *request) {
+    if (pendingImageRequest != request) {
+        if (pendingImageRequest != nullptr) {
+            request->send(409, "text/plain", "Another card image upload is in progress");
+        } else {
+            request->send(400, "text/plain", "Missing card image");
+        }
+        return;
+    }
+    pendingImage.close();
+    pendingImageRequest = nullptr;
+    if (pendingImageFailed) {
+        LittleFS.remove(CardDatabase::IMAGE_UPLOAD_PATH);
+        request->send(500, "text/plain", "Failed to store card image");
+        return;
+    }
+    
+    const char* error = nullptr;
+    if (!cardDb.installImage(CardDatabase::IMAGE_UPLOAD_PATH, error)) {
+        request->send(400, "text/plain", error);
+        return;
+    }
+    request->send(200, "text/plain", String(cardDb.getCardCount()) + " cards installed from image, generation " +
+                  String(cardDb.getGeneration()));
+}
+
+void CardReaderWebServer::handleCardChanges(AsyncWebServerRequest *request) {
+    if (!request->hasParam("since")) {
+        request->send(400, "text/plain", "Missing since parameter");
+        return;
+    }
+    uint32_t since;
+    if (!parseNumber(request->getParam("since")->value(), UINT32_MAX, since)) {
+        request->send(400, "text/plain", "Invalid since");
+        return;
+    }
+    
+    std::vector<CardDatabase::Change> changes;
+    uint32_t generation = 0;
+    if (!cardDb.getChangesSince(since, changes, generation)) {
+        request->send(410, "text/plain", "full resync required\ngeneration " + String(generation) + "\n");
+        return;
+    }
+    
+    String response = "generation " + String(generation) + "\n";
+    response.reserve(response.length() + changes.size() * 12);
+    char key[CardDatabase::KEY_TEXT_SIZE];
+    for (const CardDatabase::Change& change : changes) {
+        CardDatabase::formatKey(change.card, key);
+        response += (change.added ? "+" : "-") + String(key) + "\n";
+    }
+    request->send(200, "text/plain", response);
+}
+
+void CardReaderWebServer::handleCardDigest(AsyncWebServerRequest *request) {
+    // All three from one snapshot, so they describe the same set, and only
+    // once its generation can't be lost
+    CardDatabase::Snapshot set = cardDb.getSavedSnapshot();
+    if (!set) {
+        request->send(503, "text/plain", "Card changes not saved");
+        return;
+    }
+    char response[80];
+    snprintf(response, sizeof(response), "digest %016llx\ncards %u\ngeneration %u\n",
+             (unsigned long long)set->getDigest(), (unsigned)set->size(), (unsigned)set->generation);
+    request->send(200, "text/plain", response);
+}
+
+bool CardReaderWebServer::parseNumber(const String& text, uint32_t limit, uint32_t& value) {
+    // Digits only: strtoul() alone reads "abc" as 0, wraps "-1" round to
+    // the largest value and saturates on overflow, and unsigned long is
+    // only 32 bits here. Ten digits hold any 32-bit value, so strtoull()
+    // can't overflow on what's left.
+    if (text.length() == 0 || text.length() > 10) {
+        return false;
+    }
+    for (size_t i = 0; i < text.length(); i++) {
+        if (!isdigit((unsigned char)text[i])) {
+            return false;
+        }
+    }
+    unsigned long long parsed = strtoull(text.c_str(), NULL, 10);
+    if (parsed > limit) {
+        return false;
+    }
+    value = parsed;
+    return true;
+}
+
+bool CardReaderWebServer::parseIndexList(const String& text, size_t limit, CardDatabase::BucketSet& indexes) {
+    // Comma separated, each below limit
+    indexes.reset();
+    const char* p = text.c_str();
+    while (*p != '\0') {
+        char* end;
+        unsigned long index = strtoul(p, &end, 10);
+        if (end == p || index >= limit || (*end != ',' && *end != '\0')) {
+            return false;
+        }
+        indexes.set(index);
+        p = *end == ',' ? end + 1 : end;
+    }
+    return true;
+}
+
+void CardReaderWebServer::handleCardBuckets(AsyncWebServerRequest *request) {
+    CardDatabase::BucketSet selected;
+    if (request->hasParam("cards")) {
+        // The cards in some buckets, streamed like the full list
+        if (!parseIndexList(request->getParam("cards")->value(), CardDatabase::SYNC_BUCKETS, selected)) {
+            request->send(400, "text/plain", "Invalid bucket list");
+            return;
+        }
+        std::shared_ptr<CardDatabase::Cursor> cursor =
+            std::make_shared<CardDatabase::Cursor>(cardDb.openCursor(selected));
+        AsyncWebServerResponse *response = request->beginChunkedResponse("text/plain",
+            [cursor](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+                if (cursor->done()) {
+                    return 0;
+                }
+                size_t written = cursor->read(buffer, maxLen);
+                // A read can skip the last cards and end with nothing to send
+                return (written > 0 || cursor->done()) ? written : RESPONSE_TRY_AGAIN;
+            });
+        request->send(response);
+        return;
+    }
+    
+    bool groups = request->hasParam("groups");
+    if (groups && !parseIndexList(request->getParam("groups")->value(), CardDatabase::SYNC_GROUPS, selected)) {
+        request->send(400, "text/plain", "Invalid group list");
+        return;
+    }
+    
+    CardDatabase::Snapshot set = cardDb.getSavedSnapshot();
+    if (!set) {
+        request->send(503, "text/plain", "Card changes not saved");
+        return;
+    }
+    // Off the stack; the async_tcp task's is small
+    std::unique_ptr<uint64_t[]> buckets(new uint64_t[CardDatabase::SYNC_BUCKETS]);
+    CardDatabase::getBucketDigests(*set, buckets.get());
+    
+    // Without ?groups, one line per group; with it, one per bucket in the
+    // groups asked for
+    String response = "generation " + String(set->generation) + "\n";
+    char line[32];
+    for (size_t group = 0; group < CardDatabase::SYNC_GROUPS; group++) {
+        if (groups && !selected[group]) {
+            continue;
+        }
+        uint64_t digest = 0;
+        for (size_t i = 0; i < CardDatabase::SYNC_GROUP_SIZE; i++) {
+            size_t bucket = group * CardDatabase::SYNC_GROUP_SIZE + i;
+            if (groups) {
+                snprintf(line, sizeof(line), "%u %016llx\n", (unsigned)bucket, (unsigned long long)buckets[bucket]);
+                response += line;
+            }
+            digest ^= buckets[bucket];
+        }
+        if (!groups) {
+            snprintf(line, sizeof(line), "%u %016llx\n", (unsigned)group, (unsigned long long)digest);
+            response += line;
+        }
+    }
+    request->send(200, "text/plain", response);
+}
+
+void CardReaderWebServer::handleListExpiring(AsyncWebServerRequest *request) {
+    // Guests only, so small enough for one String
+    String response;
+    char key[CardDatabase::KEY_TEXT_SIZE];
+    for (const std::pair<CardDatabase::CardKey, uint32_t>& expiry : cardDb.listCardExpiries()) {
+        CardDatabase::formatKey(expiry.first, key);
+        response += String(key) + " " + String(expiry.second) + "\n";
+    }
+    request->send(200, "text/plain", response);
+}
+
+void CardReaderWebServer::handleCardUsage(AsyncWebServerRequest *request) {
+    // With `before`, only cards not seen since then, for stale card reports
+    uint32_t before = 0;
+    if (request->hasParam("before") &&
+        (!parseNumber(request->getParam("before")->value(), UINT32_MAX, before) || before == 0)) {
+        request->send(400, "text/plain", "Invalid before");
+        return;
+    }
+
+    struct Listing {
+        std::vector<CardUsage::Entry> entries;
+        size_t row;
+    };
+    std::shared_ptr<Listing> listing = std::make_shared<Listing>(Listing{cardDb.listCardUsage(), 0});
+    if (before != 0) {
+        std::vector<CardUsage::Entry>& entries = listing->entries;
+        entries.erase(std::remove_if(entries.begin(), entries.end(),
+                                     [before](const CardUsage::Entry& entry) { return entry.lastSeen >= before; }),
+                      entries.end());
+    }
+
+    // Streamed a line at a time, as there can be a row for every card
+    AsyncWebServerResponse *response = request->beginChunkedResponse("text/plain",
+        [listing](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+            size_t written = 0;
+            while (listing->row < listing->entries.size()) {
+                const CardUsage::Entry& entry = listing->entries[listing->row];
+                char key[CardDatabase::KEY_TEXT_SIZE];
+                CardDatabase::formatKey(entry.card, key);
+                char line[64];
+                int length = snprintf(line, sizeof(line), "%s %lu %lu\n", key, (unsigned long)entry.lastSeen,
+                                      (unsigned long)entry.count);
+                if (written + length > maxLen) {
+                    break;
+                }
+                memcpy(buffer + written, line, length);
+                written += length;
+                listing->row++;
+            }
+            return (written > 0 || listing->row == listing->entries.size()) ? written : RESPONSE_TRY_AGAIN;
+        });
+    request->send(response);
+}
+
+String CardReaderWebServer::formatMetadata(const CardMetadata::Entry& entry) {
+    // Label last, as it may hold spaces
+    char key[CardDatabase::KEY_TEXT_SIZE];
+    CardDatabase::formatKey(entry.card, key);
+    return String(key) + " " + String(entry.start) + " " + String(entry.expiry) + " " +
+           String(entry.doors) + " " + String(entry.schedule) + " " + entry.label + "\n";
+}
+
+void CardReaderWebServer::handleGetMetadata(AsyncWebServerRequest *request) {
+    if (request->hasParam("number")) {
+        CardDatabase::CardKey key;
+        CardMetadata::Entry entry;
+        if (!CardDatabase::parseKey(request->getParam("number")->value().c_str(), key)) {
+            request->send(400, "text/plain", "Invalid card number");
+        } else if (!cardDb.getCardMetadata(key, entry)) {
+            request->send(404, "text/plain", "No metadata for card");
+        } else {
+            request->send(200, "text/plain", formatMetadata(entry));
+        }
+        return;
+    }
+    
+    std::vector<CardMetadata::Entry> entries;
+    if (!cardDb.listCardMetadata(entries)) {
+        request->send(500, "text/plain", "Failed to read card metadata");
+        return;
+    }
+    String response;
+    for (const CardMetadata::Entry& entry : entries) {
+        response += formatMetadata(entry);
+    }
+    request->send(200, "text/plain", response);
+}
+
+void CardReaderWebServer::handleSetMetadata(AsyncWebServerRequest *request) {
+    if (!request->hasParam("number")) {
+        request->send(400, "text/plain", "Missing card number parameter");
+        return;
+    }
+    CardMetadata::Entry entry = {0, 0, 0, CardMetadata::ALL_DOORS, AccessSchedules::NONE, ""};
+    if (!CardDatabase::parseKey(request->getParam("number")->value().c_str(), entry.card)) {
+        request->send(400, "text/plain", "Invalid card number");
+        return;
+    }
+    
+    // Anything left out gets the default: no dates, every door, no
+    // schedule, no label
+    const char* names[] = {"start", "expiry", "doors", "schedule"};
+    uint32_t limits[] = {UINT32_MAX, UINT32_MAX, UINT16_MAX, AccessSchedules::MAX_SCHEDULES};
+    uint32_t values[] = {entry.start, entry.expiry, entry.doors, entry.schedule};
+    for (size_t i = 0; i < 4; i++) {
+        if (request->hasParam(names[i]) && !parseNumber(request->getParam(names[i])->value(), limits[i], values[i])) {
+            request->send(400, "text/plain", "Invalid " + String(names[i]));
+            return;
+        }
+    }
+    entry.start = values[0];
+    entry.expiry = values[1];
+    entry.doors = values[2];
+    entry.schedule = values[3];
+    
+    if (request->hasParam("label")) {
+        entry.label = request->getParam("label")->value();
+        bool printable = true;
+        for (size_t i = 0; i < entry.label.length(); i++) {
+            printable = printable && (uint8_t)entry.label[i] >= ' ';
+        }
+        if (entry.label.length() > CardMetadata::MAX_LABEL || !printable) {
+            request->send(400, "text/plain", "Invalid label");
+            return;
+        }
+    }
+    
+    if (!cardDb.setCardMetadata(entry)) {
+        request->send(500, "text/plain", "Failed to save card metadata");
+        return;
+    }
+    request->send(200, "text/plain", formatMetadata(entry));
+}
+
+void CardReaderWebServer::handleRemoveMetadata(AsyncWebServerRequest *request) {
+    if (!request->hasParam("number")) {
+        request->send(400, "text/plain", "Missing card number parameter");
+        return;
+    }
+    CardDatabase::CardKey key;
+    if (!CardDatabase::parseKey(request->getParam("number")->value().c_str(), key)) {
+        request->send(400, "text/plain", "Invalid card number");
+        return;
+    }
+    if (!cardDb.removeCardMetadata(key)) {
+        request->send(500, "text/plain", "Failed to save card metadata");
+        return;
+    }
+    request->send(200, "text/plain", "Card metadata removed");
+}
+
+bool CardReaderWebServer::parseCardRange(AsyncWebServerRequest *request, CardDatabase::CardKey& first,
+                                         CardDatabase::CardKey& last) {
+    // Both ends on one format and facility, in order
+    return CardDatabase::parseKey(request->getParam("first")->value().c_str(), first) &&
+           CardDatabase::parseKey(request->getParam("last")->value().c_str(), last) &&
+           first >> 32 == last >> 32 && first <= last;
+}
+
+String CardReaderWebServer::formatCardRanges() {
+    std::shared_ptr<const CardRanges> ranges = cardDb.getCardRanges();
+    String response;
+    for (size_t i = 0; i < ranges->size(); i++) {
+        char first[CardDatabase::KEY_TEXT_SIZE];
+        char last[CardDatabase::KEY_TEXT_SIZE];
+        CardDatabase::formatKey(ranges->getFirsts()[i], first);
+        CardDatabase::formatKey(ranges->getLasts()[i], last);
+        response += String(first) + " " + String(last) + "\n";
+    }
+    return response;
+}
+
+void CardReaderWebServer::handleListRanges(AsyncWebServerRequest *request) {
+    request->send(200, "text/plain", formatCardRanges());
+}
+
+void CardReaderWebServer::handleAddRange(AsyncWebServerRequest *request) {
+    if (!request->hasParam("first") || !request->hasParam("last")) {
+        request->send(400, "text/plain", "Missing first or last parameter");
+        return;
+    }
+    CardDatabase::CardKey first, last;
+    if (!parseCardRange(request, first, last)) {
+        request->send(400, "text/plain", "Invalid card range");
+        return;
+    }
+    if (!cardDb.addCardRange(first, last)) {
+        request->send(500, "text/plain", "Failed to save card ranges");
+        return;
+    }
+    request->send(200, "text/plain", formatCardRanges());
+}
+
+void CardReaderWebServer::handleRemoveRange(AsyncWebServerRequest *request) {
+    if (!request->hasParam("first") || !request->hasParam("last")) {
+        request->send(400, "text/plain", "Missing first or last parameter");
+        return;
+    }
+    CardDatabase::CardKey first, last;
+    if (!parseCardRange(request, first, last)) {
+        request->send(400, "text/plain", "Invalid card range");
+        return;
+    }
+    if (!cardDb.removeCardRange(first, last)) {
+        request->send(500, "text/plain", "Failed to save card ranges");
+        return;
+    }
+    request->send(200, "text/plain", formatCardRanges());
+}
+
+void CardReaderWebServer::handleListFacilities(AsyncWebServerRequest *request) {
+    String response;
+    for (uint16_t facility : cardDb.getAllowedFacilities()) {
+        response += String(facility) + "\n";
+    }
+    request->send(200, "text/plain", response);
+}
+
+void CardReaderWebServer::handleSetFacilities(AsyncWebServerRequest *request) {
+    if (!request->hasParam("codes")) {
+        request->send(400, "text/plain", "Missing codes parameter");
+        return;
+    }
+    
+    // Comma separated; an empty list refuses every card
+    String codes = request->getParam("codes")->value();
+    std::vector<uint16_t> facilities;
+    const char* p = codes.c_str();
+    while (*p != '\0') {
+        char* end;
+        unsigned long code = strtoul(p, &end, 10);
+        if (end == p || code > UINT16_MAX || (*end != ',' && *end != '\0')) {
+            request->send(400, "text/plain", "Invalid facility code");
+            return;
+        }
+        facilities.push_back(code);
+        p = *end == ',' ? end + 1 : end;
+    }
+    
+    if (!cardDb.setAllowedFacilities(facilities)) {
+        request->send(500, "text/plain", "Failed to save facilities");
+        return;
+    }
+    handleListFacilities(request);
+}
+
+bool CardReaderWebServer::parseScheduleId(AsyncWebServerRequest *request, uint8_t& id) {
+    if (!request->hasParam("id")) {
+        request->send(400, "text/plain", "Missing id parameter");
+        return false;
+    }
+    uint32_t value;
+    if (!parseNumber(request->getParam("id")->value(), AccessSchedules::MAX_SCHEDULES, value) ||
+        value == AccessSchedules::NONE) {
+        request->send(400, "text/plain", "Invalid schedule id");
+        return false;
+    }
+    id = value;
+    return true;
+}
+
+void CardReaderWebServer::handleListSchedules(AsyncWebServerRequest *request) {
+    // One line each, in the form PUT takes: id, name, then hours
+    std::shared_ptr<const AccessSchedules> schedules = cardDb.getSchedules();
+    String response;
+    for (uint8_t id = 1; id <= AccessSchedules::MAX_SCHEDULES; id++) {
+        if (schedules->has(id)) {
+            response += String(id) + " " + schedules->getName(id).c_str() + " " +
+                        AccessSchedules::describe(schedules->getWeek(id)).c_str() + "\n";
+        }
+    }
+    request->send(200, "text/plain", response);
+}
+
+void CardReaderWebServer::handleSetSchedule(AsyncWebServerRequest *request) {
+    uint8_t id;
+    if (!parseScheduleId(request, id)) {
+        return;
+    }
+    if (!request->hasParam("name") || !request->hasParam("hours")) {
+        request->send(400, "text/plain", "Missing name or hours parameter");
+        return;
+    }
+    String name = request->getParam("name")->value();
+    if (!AccessSchedules::isValidName(name.c_str())) {
+        request->send(400, "text/plain", "Invalid schedule name");
+        return;
+    }
+    AccessSchedules::Week week;
+    if (!AccessSchedules::compile(request->getParam("hours")->value().c_str(), week)) {
+        request->send(400, "text/plain", "Invalid hours");
+        return;
+    }
+    
+    if (!cardDb.setSchedule(id, name.c_str(), week)) {
+        request->send(500, "text/plain", "Failed to save schedules");
+        return;
+    }
+    request->send(200, "text/plain", String(id) + " " + name + " " + AccessSchedules::describe(week).c_str() + "\n");
+}
+
+void CardReaderWebServer::handleRemoveSchedule(AsyncWebServerRequest *request) {
+    uint8_t id;
+    if (!parseScheduleId(request, id)) {
+        return;
+    }
+    if (!cardDb.removeSchedule(id)) {
+        request->send(500, "text/plain", "Failed to save schedules");
+        return;
+    }
+    request->send(200, "text/plain", "Schedule removed");
+}
+
+void CardReaderWebServer::handleListHolidays(AsyncWebServerRequest *request) {
+    String response;
+    for (uint32_t date : cardDb.getSchedules()->getHolidays()) {
+        response += String(AccessSchedules::formatDate(date).c_str()) + "\n";
+    }
+    request->send(200, "text/plain", response);
+}
+
+void CardReaderWebServer::handleSetHolidays(AsyncWebServerRequest *request) {
+    if (!request->hasParam("dates")) {
+        request->send(400, "text/plain", "Missing dates parameter");
+        return;
+    }
+    
+    // Comma separated; an empty list clears them
+    String text = request->getParam("dates")->value();
+    std::vector<uint32_t> dates;
+    int start = 0;
+    while (start < (int)text.length()) {
+        int comma = text.indexOf(',', start);
+        if (comma < 0) {
+            comma = text.length();
+        }
+        uint32_t date;
+        if (!AccessSchedules::parseDate(text.substring(start, comma).c_str(), date) ||
+            dates.size() >= AccessSchedules::MAX_HOLIDAYS) {
+            request->send(400, "text/plain", "Invalid date");
+            return;
+        }
+        dates.push_back(date);
+        start = comma + 1;
+    }
+    
+    if (!cardDb.setHolidays(dates)) {
+        request->send(500, "text/plain", "Failed to save schedules");
+        return;
+    }
+    handleListHolidays(request);
 }
 
 void CardReaderWebServer::handleStrikeStatus(AsyncWebServerRequest *request) {
@@ -379,4 +1121,91 @@ void CardReaderWebServer::handleCardReaderBurst(AsyncWebServerRequest *request)
     serializeJson(doc, *response);
     response->addHeader("Access-Control-Allow-Origin", "*");
     request->send(response);
-} 
\ No newline at end of file
+} 
+
+void CardReaderWebServer::handleCardDatabaseStats(AsyncWebServerRequest *request) {
+    CardDatabase::Stats stats = cardDb.getStats();
+
+    AsyncResponseStream *response = request->beginResponseStream("application/json");
+    StaticJsonDocument<1536> doc;
+    doc["cards"] = stats.cardCount;
+    doc["importLimit"] = stats.importLimit;
+    doc["generation"] = stats.generation;
+    doc["journalRecords"] = stats.journalRecords;
+    doc["compactions"] = stats.compactions;
+    doc["mutations"] = stats.mutations;
+    doc["journalBytesWritten"] = stats.journalBytesWritten;
+    doc["snapshotBytesWritten"] = stats.snapshotBytesWritten;
+    doc["batchedRecords"] = stats.batchedRecords;
+    doc["flashCommits"] = stats.flashCommits;
+    doc["commitsPerSecond"] = stats.commitsPerSecond;
+    doc["recordsPerCommit"] = stats.flashCommits > 0 ? (float)stats.mutations / stats.flashCommits : 0.0f;
+
+    // Flash bytes written per byte of journalled mutation
+    doc["writeAmplification"] = stats.journalBytesWritten > 0
+        ? (float)(stats.journalBytesWritten + stats.snapshotBytesWritten) / stats.journalBytesWritten
+        : 0.0f;
+
+    JsonObject cache = doc.createNestedObject("decisionCache");
+    cache["entries"] = stats.cacheEntries;
+    cache["capacity"] = stats.cacheCapacity;
+    cache["hits"] = stats.cacheHits;
+    cache["misses"] = stats.cacheMisses;
+    cache["evictions"] = stats.cacheEvictions;
+    cache["invalidations"] = stats.cacheInvalidations;
+    uint32_t swipes = stats.cacheHits + stats.cacheMisses;
+    cache["hitRate"] = swipes > 0 ? (float)stats.cacheHits / swipes : 0.0f;
+
+    JsonObject recovery = doc.createNestedObject("recovery");
+    recovery["scanMillis"] = stats.recoveryMicros / 1000.0f;
+    recovery["journalBytesDiscarded"] = stats.journalBytesDiscarded;
+    recovery["rolledBack"] = stats.rolledBack;
+
+    JsonObject metadata = doc.createNestedObject("metadata");
+    metadata["rows"] = stats.metadataRows;
+    metadata["bytes"] = stats.metadataBytes;
+    JsonObject rangeStats = doc.createNestedObject("ranges");
+    rangeStats["count"] = stats.rangeCount;
+    rangeStats["cards"] = stats.rangeCards;
+    rangeStats["bytes"] = stats.rangeBytes;
+    JsonObject scheduleStats = doc.createNestedObject("schedules");
+    scheduleStats["count"] = stats.scheduleCount;
+    scheduleStats["holidays"] = stats.holidayCount;
+    JsonObject expiry = doc.createNestedObject("expiry");
+    expiry["pending"] = stats.expiriesPending;
+    expiry["revoked"] = stats.expiriesRevoked;
+    JsonObject usage = doc.createNestedObject("usage");
+    usage["rows"] = stats.usageRows;
+    usage["bytes"] = stats.usageBytes;
+    usage["untracked"] = stats.usageUntracked;
+    usage["saves"] = stats.usageSaves;
+
+    JsonObject index = doc.createNestedObject("index");
+    index["type"] = stats.indexType;
+    index["bytes"] = stats.indexBytes;
+    index["bytesPerCard"] = stats.cardCount > 0 ? (float)stats.indexBytes / stats.cardCount : 0.0f;
+    index["averageProbes"] = stats.indexProbes;
+
+    // Lookups that got past the filter are the ones that searched the index
+    uint32_t searches = stats.lookups - stats.filterRejects;
+    index["averageLookupMicros"] = searches > 0 ? (float)stats.indexMicros / searches : 0.0f;
+
+    JsonObject filter = doc.createNestedObject("filter");
+    filter["slots"] = stats.filterSlots;
+    filter["bytes"] = stats.filterBytes;
+    filter["bytesPerCard"] = stats.cardCount > 0 ? (float)stats.filterBytes / stats.cardCount : 0.0f;
+    filter["fillRatio"] = stats.filterFillRatio;
+    filter["expectedFalsePositiveRate"] = stats.filterFalsePositiveRate;
+    filter["lookups"] = stats.lookups;
+    filter["rejects"] = stats.filterRejects;
+    filter["falsePositives"] = stats.filterFalsePositives;
+    filter["updates"] = stats.filterUpdates;
+    filter["rebuilds"] = stats.filterRebuilds;
+
+    // Share of lookups for unknown cards that the filter let through
+    uint32_t misses = stats.filterRejects + stats.filterFalsePositives;
+    filter["observedFalsePositiveRate"] = misses > 0 ? (float)stats.filterFalsePositives / misses : 0.0f;
+
+    serializeJson(doc, *response);
+    request->send(response);
+}
\ No newline at end of file
@@ -10,6 +10,7 @@
 #include "door_strike.h"
 #include "card_database.h"
 #include "access_log.h"
+#include <memory>
 
 class CardReaderWebServer {
 public:
@@ -35,11 +36,26 @@ private:
     CardDatabase& cardDb;
     AccessLog& accessLog;
     
+    // Card list being streamed into PUT/POST /cards; one import at a time
+    std::unique_ptr<CardDatabase::CardImport> pendingImport;
+    AsyncWebServerRequest* pendingImportRequest;
+    
+    // Card image being streamed to flash by PUT /cards/image; one at a time
+    File pendingImage;
+    AsyncWebServerRequest* pendingImageRequest;
+    bool pendingImageFailed;
+    
     // Helper functions
     void setupRoutes();
     void setupAuthentication();
     void copyStaticFiles();
     void debugDumpParams(AsyncWebServerRequest *request);
+    static bool parseNumber(const String& text, uint32_t limit, uint32_t& value);
+    static bool parseIndexList(const String& text, size_t limit, CardDatabase::BucketSet& indexes);
+    static String formatMetadata(const CardMetadata::Entry& entry);
+    static bool parseScheduleId(AsyncWebServerRequest *request, uint8_t& id);
+    static bool parseCardRange(AsyncWebServerRequest *request, CardDatabase::CardKey& first, CardDatabase::CardKey& last);
+    String formatCardRanges();
     
     // Route handlers
     void handleRoot(AsyncWebServerRequest *request);
@@ -51,6 +67,28 @@ private:
     void handleAddCard(AsyncWebServerRequest *request);
     void handleRemoveCard(AsyncWebServerRequest *request);
     void handleListCards(AsyncWebServerRequest *request);
+    void handleImportCards(AsyncWebServerRequest *request);
+    void handleCardChanges(AsyncWebServerRequest *request);
+    void handleCardDigest(AsyncWebServerRequest *request);
+    void handleCardBuckets(AsyncWebServerRequest *request);
+    void handleListExpiring(AsyncWebServerRequest *request);
+    void handleCardUsage(AsyncWebServerRequest *request);
+    void handleGetMetadata(AsyncWebServerRequest *request);
+    void handleSetMetadata(AsyncWebServerRequest *request);
+    void handleRemoveMetadata(AsyncWebServerRequest *request);
+    void handleListRanges(AsyncWebServerRequest *request);
+    void handleAddRange(AsyncWebServerRequest *request);
+    void handleRemoveRange(AsyncWebServerRequest *request);
+    void handleListFacilities(AsyncWebServerRequest *request);
+    void handleSetFacilities(AsyncWebServerRequest *request);
+    void handleListSchedules(AsyncWebServerRequest *request);
+    void handleSetSchedule(AsyncWebServerRequest *request);
+    void handleRemoveSchedule(AsyncWebServerRequest *request);
+    void handleListHolidays(AsyncWebServerRequest *request);
+    void handleSetHolidays(AsyncWebServerRequest *request);
+    void handleImportCardsBody(AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total);
+    void handleInstallImage(AsyncWebServerRequest *request);
+    void handleInstallImageBody(AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total);
     
     // Diagnostics endpoints
     void handleStrikeStatus(AsyncWebServerRequest *request);
@@ -62,6 +100,7 @@ private:
     void handleCardReaderFuse(AsyncWebServerRequest *request);
     void handleCardReaderList(AsyncWebServerRequest *request);
     void handleCardReaderBurst(AsyncWebServerRequest *request);
+    void handleCardDatabaseStats(AsyncWebServerRequest *request);
     
     // Access log endpoints
     void handleAccessLogGet(AsyncWebServerRequest *request);